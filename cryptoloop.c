@@ -27,6 +27,9 @@
 #include <linux/blkdev.h>
 #include <linux/loop.h>
 #include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/completion.h>
 #include <asm/uaccess.h>
 
 MODULE_LICENSE("GPL");
@@ -36,6 +39,48 @@ MODULE_AUTHOR("Herbert Valerio Riedel <hvr@gnu.org>");
 #define LOOP_IV_SECTOR_BITS 9
 #define LOOP_IV_SECTOR_SIZE (1 << LOOP_IV_SECTOR_BITS)
 
+/*
+ * loop never transfers more than a page at a time, so that many requests
+ * cover any transfer.  Request arrays come from a per-device pool, so
+ * transfers in the writeout path wait for memory instead of failing.
+ */
+#define CRYPTOLOOP_MAX_REQS	(PAGE_SIZE >> LOOP_IV_SECTOR_BITS)
+#define CRYPTOLOOP_POOL_MIN	4
+
+/*
+ * Per-device state kept in lo->key_data.  Modes without an IV (ecb) are
+ * position independent, so a whole transfer goes to the cipher in one
+ * request; modes with an IV need one request per sector, since each
+ * sector starts a new chain.
+ */
+struct cryptoloop_ctx {
+	struct crypto_ablkcipher *tfm;
+	unsigned int ivsize;
+	bool plain64;		/* 64-bit sector number as IV */
+	unsigned int req_size;	/* struct cryptoloop_req plus tfm context */
+	mempool_t *req_pool;	/* CRYPTOLOOP_MAX_REQS requests each */
+};
+
+/*
+ * All requests of a transfer are submitted before waiting for any of
+ * them, so asynchronous implementations (hardware engines, cryptd) work
+ * on the sectors in parallel.  pending holds one extra reference for the
+ * submitter, dropped once everything has been queued.
+ */
+struct cryptoloop_wait {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+struct cryptoloop_req {
+	struct cryptoloop_wait *wait;
+	struct scatterlist sg_in;
+	struct scatterlist sg_out;
+	u32 iv[4];
+	struct ablkcipher_request req;	/* last, the tfm context follows */
+};
+
 static int
 cryptoloop_init(struct loop_device *lo, const struct loop_info64 *info)
 {
@@ -45,8 +90,11 @@ cryptoloop_init(struct loop_device *lo, const struct loop_info64 *info)
 	char cms[LO_NAME_SIZE];			/* cipher-mode string */
 	char *cipher;
 	char *mode;
+	char *ivmode = "";
+	bool plain64;
 	char *cmsp = cms;			/* c-m string pointer */
-	struct crypto_blkcipher *tfm;
+	struct crypto_ablkcipher *tfm;
+	struct cryptoloop_ctx *ctx;
 
 	/* encryption breaks for non sector aligned offsets */
 
@@ -64,6 +112,8 @@ cryptoloop_init(struct loop_device *lo, const struct loop_info64 *info)
 	if (*mode) {
 		mode++;
 		mode_len = strcspn(mode, "-");
+		if (mode[mode_len])
+			ivmode = mode + mode_len + 1;
 	}
 
 	if (!mode_len) {
@@ -71,6 +121,17 @@ cryptoloop_init(struct loop_device *lo, const struct loop_info64 *info)
 		mode_len = 3;
 	}
 
+	/*
+	 * "plain", the default, only uses the low 32 bits of the sector
+	 * number and so repeats IVs beyond 2TB; "plain64" does not.
+	 */
+	if (!*ivmode || !strcmp(ivmode, "plain"))
+		plain64 = false;
+	else if (!strcmp(ivmode, "plain64"))
+		plain64 = true;
+	else
+		goto out;
+
 	if (cipher_len + mode_len + 3 > LO_NAME_SIZE)
 		return -EINVAL;
 
@@ -82,31 +143,60 @@ cryptoloop_init(struct loop_device *lo, const struct loop_info64 *info)
 	*cmsp++ = ')';
 	*cmsp = 0;
 
-	tfm = crypto_alloc_blkcipher(cms, 0, CRYPTO_ALG_ASYNC);
+	tfm = crypto_alloc_ablkcipher(cms, 0, 0);
 	if (IS_ERR(tfm))
 		return PTR_ERR(tfm);
 
-	err = crypto_blkcipher_setkey(tfm, info->lo_encrypt_key,
-				      info->lo_encrypt_key_size);
+	err = crypto_ablkcipher_setkey(tfm, info->lo_encrypt_key,
+				       info->lo_encrypt_key_size);
 	
 	if (err != 0)
 		goto out_free_tfm;
 
-	lo->key_data = tfm;
+	err = -EINVAL;
+	if (crypto_ablkcipher_ivsize(tfm) > 16)
+		goto out_free_tfm;
+
+	err = -ENOMEM;
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		goto out_free_tfm;
+	ctx->tfm = tfm;
+	ctx->ivsize = crypto_ablkcipher_ivsize(tfm);
+	ctx->plain64 = plain64;
+	ctx->req_size = ALIGN(sizeof(struct cryptoloop_req) +
+			      crypto_ablkcipher_reqsize(tfm), CRYPTO_MINALIGN);
+	ctx->req_pool = mempool_create_kmalloc_pool(CRYPTOLOOP_POOL_MIN,
+				CRYPTOLOOP_MAX_REQS * ctx->req_size);
+	if (!ctx->req_pool)
+		goto out_free_ctx;
+
+	lo->key_data = ctx;
 	return 0;
 
+ out_free_ctx:
+	kfree(ctx);
  out_free_tfm:
-	crypto_free_blkcipher(tfm);
+	crypto_free_ablkcipher(tfm);
 
  out:
 	return err;
 }
 
 
-typedef int (*encdec_cbc_t)(struct blkcipher_desc *desc,
-			struct scatterlist *sg_out,
-			struct scatterlist *sg_in,
-			unsigned int nsg);
+static void cryptoloop_done(struct crypto_async_request *areq, int err)
+{
+	struct cryptoloop_req *r = areq->data;
+	struct cryptoloop_wait *wait = r->wait;
+
+	/* a backlogged request got queued, the real completion follows */
+	if (err == -EINPROGRESS)
+		return;
+	if (err)
+		wait->error = err;
+	if (atomic_dec_and_test(&wait->pending))
+		complete(&wait->done);
+}
 
 static int
 cryptoloop_transfer(struct loop_device *lo, int cmd,
@@ -114,48 +204,68 @@ cryptoloop_transfer(struct loop_device *lo, int cmd,
 		    struct page *loop_page, unsigned loop_off,
 		    int size, sector_t IV)
 {
-	struct crypto_blkcipher *tfm = lo->key_data;
-	struct blkcipher_desc desc = {
-		.tfm = tfm,
-		.flags = CRYPTO_TFM_REQ_MAY_SLEEP,
-	};
-	struct scatterlist sg_out;
-	struct scatterlist sg_in;
-
-	encdec_cbc_t encdecfunc;
+	struct cryptoloop_ctx *ctx = lo->key_data;
+	struct cryptoloop_wait wait;
 	struct page *in_page, *out_page;
 	unsigned in_offs, out_offs;
+	unsigned int i, nr;
+	char *reqs;
 	int err;
 
-	sg_init_table(&sg_out, 1);
-	sg_init_table(&sg_in, 1);
-
 	if (cmd == READ) {
 		in_page = raw_page;
 		in_offs = raw_off;
 		out_page = loop_page;
 		out_offs = loop_off;
-		encdecfunc = crypto_blkcipher_crt(tfm)->decrypt;
 	} else {
 		in_page = loop_page;
 		in_offs = loop_off;
 		out_page = raw_page;
 		out_offs = raw_off;
-		encdecfunc = crypto_blkcipher_crt(tfm)->encrypt;
 	}
 
-	while (size > 0) {
-		const int sz = min(size, LOOP_IV_SECTOR_SIZE);
-		u32 iv[4] = { 0, };
-		iv[0] = cpu_to_le32(IV & 0xffffffff);
-
-		sg_set_page(&sg_in, in_page, sz, in_offs);
-		sg_set_page(&sg_out, out_page, sz, out_offs);
-
-		desc.info = iv;
-		err = encdecfunc(&desc, &sg_out, &sg_in, sz);
-		if (err)
-			return err;
+	nr = ctx->ivsize ? DIV_ROUND_UP(size, LOOP_IV_SECTOR_SIZE) : 1;
+	if (WARN_ON_ONCE(nr > CRYPTOLOOP_MAX_REQS))
+		return -EIO;
+	/* may wait for another transfer to return its array, never fails */
+	reqs = mempool_alloc(ctx->req_pool, GFP_NOIO);
+
+	atomic_set(&wait.pending, nr + 1);
+	wait.error = 0;
+	init_completion(&wait.done);
+
+	for (i = 0; i < nr; i++) {
+		struct cryptoloop_req *r = (void *)(reqs + i * ctx->req_size);
+		/* no IV: the whole range in one go */
+		const int sz = ctx->ivsize ? min(size, LOOP_IV_SECTOR_SIZE) :
+					     size;
+
+		r->wait = &wait;
+		memset(r->iv, 0, sizeof(r->iv));
+		if (ctx->plain64)
+			*(__le64 *)r->iv = cpu_to_le64((u64)IV);
+		else
+			r->iv[0] = cpu_to_le32(IV & 0xffffffff);
+
+		sg_init_table(&r->sg_in, 1);
+		sg_init_table(&r->sg_out, 1);
+		sg_set_page(&r->sg_in, in_page, sz, in_offs);
+		sg_set_page(&r->sg_out, out_page, sz, out_offs);
+
+		ablkcipher_request_set_tfm(&r->req, ctx->tfm);
+		ablkcipher_request_set_callback(&r->req,
+				CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+				cryptoloop_done, r);
+		ablkcipher_request_set_crypt(&r->req, &r->sg_in, &r->sg_out,
+					     sz, r->iv);
+
+		if (cmd == READ)
+			err = crypto_ablkcipher_decrypt(&r->req);
+		else
+			err = crypto_ablkcipher_encrypt(&r->req);
+		/* finished synchronously, the callback is not called */
+		if (err != -EINPROGRESS && err != -EBUSY)
+			cryptoloop_done(&r->req.base, err);
 
 		IV++;
 		size -= sz;
@@ -163,7 +273,11 @@ cryptoloop_transfer(struct loop_device *lo, int cmd,
 		out_offs += sz;
 	}
 
-	return 0;
+	if (!atomic_dec_and_test(&wait.pending))
+		wait_for_completion(&wait.done);
+	mempool_free(reqs, ctx->req_pool);
+
+	return wait.error;
 }
 
 static int
@@ -175,13 +289,15 @@ cryptoloop_ioctl(struct loop_device *lo, int cmd, unsigned long arg)
 static int
 cryptoloop_release(struct loop_device *lo)
 {
-	struct crypto_blkcipher *tfm = lo->key_data;
-	if (tfm != NULL) {
-		crypto_free_blkcipher(tfm);
+	struct cryptoloop_ctx *ctx = lo->key_data;
+	if (ctx != NULL) {
+		crypto_free_ablkcipher(ctx->tfm);
+		mempool_destroy(ctx->req_pool);
+		kfree(ctx);
 		lo->key_data = NULL;
 		return 0;
 	}
-	printk(KERN_ERR "cryptoloop_release(): tfm == NULL?\n");
+	printk(KERN_ERR "cryptoloop_release(): ctx == NULL?\n");
 	return -EINVAL;
 }
 
@@ -46,15 +46,6 @@ struct update_odbm_work {
 	unsigned int enr;
 };
 
-struct update_al_work {
-	struct drbd_work w;
-	struct lc_element *al_ext;
-	struct completion event;
-	unsigned int enr;
-	/* if old_enr != LC_FREE, write corresponding bitmap sector, too */
-	unsigned int old_enr;
-};
-
 struct drbd_atodb_wait {
 	atomic_t           count;
 	struct completion  io_done;
@@ -63,8 +54,6 @@ struct drbd_atodb_wait {
 };
 
 
-int w_al_write_transaction(struct drbd_conf *, struct drbd_work *, int);
-
 static int _drbd_md_sync_page_io(struct drbd_conf *mdev,
 				 struct drbd_backing_dev *bdev,
 				 struct page *page, sector_t sector,
@@ -171,12 +160,48 @@ int drbd_md_sync_page_io(struct drbd_conf *mdev, struct drbd_backing_dev *bdev,
 	return ok;
 }
 
-static struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr)
+/* index into al_pending of the uncommitted change of element pos, or -1 */
+static int _al_find_pending(struct drbd_conf *mdev, unsigned int pos)
+{
+	int i;
+
+	for (i = 0; i < mdev->al_nr_pending; i++)
+		if (mdev->al_pending[i].pos == pos)
+			return i;
+	return -1;
+}
+
+/**
+ * drbd_al_pending() - Tells if the AL extent of sector is not on disk yet
+ * @mdev:	DRBD device.
+ * @sector:	Sector within the extent, which the caller holds a reference on.
+ */
+int drbd_al_pending(struct drbd_conf *mdev, sector_t sector)
+{
+	unsigned int enr = (sector >> (AL_EXTENT_SHIFT-9));
+	struct lc_element *al_ext;
+	int rv = 0;
+
+	spin_lock_irq(&mdev->al_lock);
+	al_ext = lc_find(mdev->act_log, enr);
+	if (al_ext && mdev->al_nr_pending)
+		rv = _al_find_pending(mdev,
+				lc_index_of(mdev->act_log, al_ext)) >= 0;
+	spin_unlock_irq(&mdev->al_lock);
+
+	return rv;
+}
+
+/* The change of an element is entered into the lru cache right away, so
+ * that concurrent misses can get their own elements, and queued for the
+ * next transaction.  *pending tells whether the element still waits for it. */
+static struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr,
+				  int *pending)
 {
 	struct lc_element *al_ext;
 	struct lc_element *tmp;
 	unsigned long     al_flags = 0;
-	int wake;
+	int wake, queue = 0;
 
 	spin_lock_irq(&mdev->al_lock);
 	tmp = lc_find(mdev->resync, enr/AL_EXT_PER_BM_SECT);
@@ -190,10 +215,39 @@ static struct lc_element *_al_get(struct drbd_conf *mdev, unsigned int enr)
 			return NULL;
 		}
 	}
+	if (mdev->al_nr_pending == AL_PENDING_MAX &&
+	    !lc_find(mdev->act_log, enr)) {
+		spin_unlock_irq(&mdev->al_lock);
+		return NULL;
+	}
 	al_ext   = lc_get(mdev->act_log, enr);
 	al_flags = mdev->act_log->flags;
+	if (al_ext && al_ext->lc_number != enr) {
+		struct al_update *u = &mdev->al_pending[mdev->al_nr_pending++];
+
+		u->pos = lc_index_of(mdev->act_log, al_ext);
+		u->enr = enr;
+		u->old_enr = al_ext->lc_number;
+		lc_changed(mdev->act_log, al_ext);
+
+		queue = !mdev->al_tr_queued;
+		mdev->al_tr_queued = 1;
+		*pending = 1;
+	} else if (al_ext && mdev->al_nr_pending) {
+		unsigned int pos = lc_index_of(mdev->act_log, al_ext);
+
+		*pending = _al_find_pending(mdev, pos) >= 0;
+	}
 	spin_unlock_irq(&mdev->al_lock);
 
+	/* The transaction recurses into generic_make_request(), which
+	 * disallows recursion, bios being serialized on the
+	 * current->bio_tail list now.
+	 * we have to delegate updates to the activity log
+	 * to the worker thread. */
+	if (queue)
+		drbd_queue_work_front(&mdev->data.work, &mdev->al_tr_work);
+
 	/*
 	if (!al_ext) {
 		if (al_flags & LC_STARVING)
@@ -210,34 +264,38 @@ void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector)
 {
 	unsigned int enr = (sector >> (AL_EXTENT_SHIFT-9));
 	struct lc_element *al_ext;
-	struct update_al_work al_work;
+	int pending = 0;
 
 	D_ASSERT(atomic_read(&mdev->local_cnt) > 0);
 
-	wait_event(mdev->al_wait, (al_ext = _al_get(mdev, enr)));
-
-	if (al_ext->lc_number != enr) {
-		/* drbd_al_write_transaction(mdev,al_ext,enr);
-		 * recurses into generic_make_request(), which
-		 * disallows recursion, bios being serialized on the
-		 * current->bio_tail list now.
-		 * we have to delegate updates to the activity log
-		 * to the worker thread. */
-		init_completion(&al_work.event);
-		al_work.al_ext = al_ext;
-		al_work.enr = enr;
-		al_work.old_enr = al_ext->lc_number;
-		al_work.w.cb = w_al_write_transaction;
-		drbd_queue_work_front(&mdev->data.work, &al_work.w);
-		wait_for_completion(&al_work.event);
-
-		mdev->al_writ_cnt++;
+	wait_event(mdev->al_wait, (al_ext = _al_get(mdev, enr, &pending)));
 
-		spin_lock_irq(&mdev->al_lock);
-		lc_changed(mdev->act_log, al_ext);
-		spin_unlock_irq(&mdev->al_lock);
-		wake_up(&mdev->al_wait);
-	}
+	/* The extent became active just now, by us or by a concurrent
+	 * request: wait until a transaction recorded that on disk. */
+	if (pending)
+		wait_event(mdev->al_wait, !drbd_al_pending(mdev, sector));
+}
+
+/**
+ * drbd_al_begin_io_nonblock() - drbd_al_begin_io() for callers that must not sleep
+ * @mdev:	DRBD device.
+ * @sector:	Sector the request starts at.
+ *
+ * Returns -EAGAIN if no reference on the extent can be had right now, try
+ * again after the next wake up of al_wait.  Otherwise the caller holds a
+ * reference, and 1 means the extent is not on disk yet (see
+ * drbd_al_pending()), 0 that the request may go ahead.
+ */
+int drbd_al_begin_io_nonblock(struct drbd_conf *mdev, sector_t sector)
+{
+	unsigned int enr = (sector >> (AL_EXTENT_SHIFT-9));
+	int pending = 0;
+
+	D_ASSERT(atomic_read(&mdev->local_cnt) > 0);
+
+	if (!_al_get(mdev, enr, &pending))
+		return -EAGAIN;
+	return pending;
 }
 
 void drbd_al_complete_io(struct drbd_conf *mdev, sector_t sector)
@@ -289,43 +347,77 @@ static unsigned int rs_extent_to_bm_page(unsigned int rs_enr)
 		 (BM_EXT_SHIFT - BM_BLOCK_SHIFT));
 }
 
+/* How many extent changes fit into one transaction.  The remaining slots
+ * carry a window of the cyclic context.  As long as each transaction has
+ * at least nr_elements / mx of those, any mx consecutive transactions
+ * still cover every element, like when all of them carry AL_EXTENTS_PT,
+ * and the mx + 1 transactions on disk hold a current record of every
+ * element, even when the last one was torn. */
+static int al_tr_max_updates(struct lru_cache *al)
+{
+	int nr = al->nr_elements;
+	int mx = div_ceil(nr, AL_EXTENTS_PT);
+
+	return AL_EXTENTS_PT + 1 - min(nr, div_ceil(nr, mx));
+}
+
+/* what the on disk activity log should say about element pos,
+ * not counting changes that are not part of the first n */
+static unsigned int _al_disk_number(struct drbd_conf *mdev, unsigned int pos,
+				    int n)
+{
+	int i = _al_find_pending(mdev, pos);
+
+	if (i >= n)
+		return mdev->al_pending[i].old_enr;
+	return lc_element_by_index(mdev->act_log, pos)->lc_number;
+}
+
+/* Writes one transaction with as many of the pending extent changes as
+ * fit, and requeues itself if more are left. */
 int
 w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 {
-	struct update_al_work *aw = container_of(w, struct update_al_work, w);
-	struct lc_element *updated = aw->al_ext;
-	const unsigned int new_enr = aw->enr;
-	const unsigned int evicted = aw->old_enr;
 	struct al_transaction *buffer;
+	struct al_update *u;
 	sector_t sector;
-	int i, n, mx;
+	int i, j, n, nr, mx, requeue;
 	unsigned int extent_nr;
 	u32 xor_sum = 0;
 
+	spin_lock_irq(&mdev->al_lock);
+	n = min(mdev->al_nr_pending, al_tr_max_updates(mdev->act_log));
+	spin_unlock_irq(&mdev->al_lock);
+
 	if (!get_ldev(mdev)) {
 		dev_err(DEV,
-			"disk is %s, cannot start al transaction (-%d +%d)\n",
-			drbd_disk_str(mdev->state.disk), evicted, new_enr);
-		complete(&((struct update_al_work *)w)->event);
-		return 1;
+			"disk is %s, cannot start al transaction (%d updates)\n",
+			drbd_disk_str(mdev->state.disk), n);
+		goto out;
 	}
-	/* do we have to do a bitmap write, first?
+	/* do we have to do bitmap writes, first?
 	 * TODO reduce maximum latency:
-	 * submit both bios, then wait for both,
-	 * instead of doing two synchronous sector writes.
+	 * submit all bios, then wait for them,
+	 * instead of doing synchronous sector writes.
 	 * For now, we must not write the transaction,
-	 * if we cannot write out the bitmap of the evicted extent. */
-	if (mdev->state.conn < C_CONNECTED && evicted != LC_FREE)
-		drbd_bm_write_page(mdev, al_extent_to_bm_page(evicted));
+	 * if we cannot write out the bitmap of the evicted extents.
+	 * The first n pending changes stay put until we remove them. */
+	if (mdev->state.conn < C_CONNECTED) {
+		for (i = 0; i < n; i++) {
+			u = &mdev->al_pending[i];
+			if (u->old_enr != LC_FREE)
+				drbd_bm_write_page(mdev,
+					al_extent_to_bm_page(u->old_enr));
+		}
+	}
 
 	/* The bitmap write may have failed, causing a state change. */
 	if (mdev->state.disk < D_INCONSISTENT) {
 		dev_err(DEV,
-			"disk is %s, cannot write al transaction (-%d +%d)\n",
-			drbd_disk_str(mdev->state.disk), evicted, new_enr);
-		complete(&((struct update_al_work *)w)->event);
+			"disk is %s, cannot write al transaction (%d updates)\n",
+			drbd_disk_str(mdev->state.disk), n);
 		put_ldev(mdev);
-		return 1;
+		goto out;
 	}
 
 	mutex_lock(&mdev->md_io_mutex); /* protects md_io_buffer, al_tr_cycle, ... */
@@ -334,30 +426,33 @@ w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 	buffer->magic = __constant_cpu_to_be32(DRBD_MAGIC);
 	buffer->tr_number = cpu_to_be32(mdev->al_tr_number);
 
-	n = lc_index_of(mdev->act_log, updated);
-
-	buffer->updates[0].pos = cpu_to_be32(n);
-	buffer->updates[0].extent = cpu_to_be32(new_enr);
-
-	xor_sum ^= new_enr;
+	spin_lock_irq(&mdev->al_lock);
+	for (i = 0; i < n; i++) {
+		u = &mdev->al_pending[i];
+		buffer->updates[i].pos = cpu_to_be32(u->pos);
+		buffer->updates[i].extent = cpu_to_be32(u->enr);
+		xor_sum ^= u->enr;
+	}
 
-	mx = min_t(int, AL_EXTENTS_PT,
-		   mdev->act_log->nr_elements - mdev->al_tr_cycle);
-	for (i = 0; i < mx; i++) {
-		unsigned idx = mdev->al_tr_cycle + i;
-		extent_nr = lc_element_by_index(mdev->act_log, idx)->lc_number;
-		buffer->updates[i+1].pos = cpu_to_be32(idx);
-		buffer->updates[i+1].extent = cpu_to_be32(extent_nr);
+	/* The context wraps around within a transaction, instead of being
+	 * cut short at the end of the cycle, so that every transaction
+	 * carries at least as much of it as al_tr_max_updates() assumes. */
+	nr = mdev->act_log->nr_elements;
+	mx = min(AL_EXTENTS_PT + 1 - n, nr);
+	for (j = 0; j < mx; j++, i++) {
+		unsigned idx = (mdev->al_tr_cycle + j) % nr;
+		extent_nr = _al_disk_number(mdev, idx, n);
+		buffer->updates[i].pos = cpu_to_be32(idx);
+		buffer->updates[i].extent = cpu_to_be32(extent_nr);
 		xor_sum ^= extent_nr;
 	}
-	for (; i < AL_EXTENTS_PT; i++) {
-		buffer->updates[i+1].pos = __constant_cpu_to_be32(-1);
-		buffer->updates[i+1].extent = __constant_cpu_to_be32(LC_FREE);
+	spin_unlock_irq(&mdev->al_lock);
+	for (; i < AL_EXTENTS_PT + 1; i++) {
+		buffer->updates[i].pos = __constant_cpu_to_be32(-1);
+		buffer->updates[i].extent = __constant_cpu_to_be32(LC_FREE);
 		xor_sum ^= LC_FREE;
 	}
-	mdev->al_tr_cycle += AL_EXTENTS_PT;
-	if (mdev->al_tr_cycle >= mdev->act_log->nr_elements)
-		mdev->al_tr_cycle = 0;
+	mdev->al_tr_cycle = (mdev->al_tr_cycle + mx) % nr;
 
 	buffer->xor_sum = cpu_to_be32(xor_sum);
 
@@ -373,12 +468,26 @@ w_al_write_transaction(struct drbd_conf *mdev, struct drbd_work *w, int unused)
 
 	D_ASSERT(mdev->al_tr_pos < MD_AL_MAX_SIZE);
 	mdev->al_tr_number++;
+	mdev->al_writ_cnt++;
 
 	mutex_unlock(&mdev->md_io_mutex);
 
-	complete(&((struct update_al_work *)w)->event);
 	put_ldev(mdev);
 
+out:
+	spin_lock_irq(&mdev->al_lock);
+	mdev->al_nr_pending -= n;
+	memmove(mdev->al_pending, mdev->al_pending + n,
+		mdev->al_nr_pending * sizeof(struct al_update));
+	requeue = mdev->al_nr_pending != 0;
+	if (!requeue)
+		mdev->al_tr_queued = 0;
+	spin_unlock_irq(&mdev->al_lock);
+	wake_up(&mdev->al_wait);
+
+	if (requeue)
+		drbd_queue_work_front(&mdev->data.work, &mdev->al_tr_work);
+
 	return 1;
 }
 
@@ -502,9 +611,9 @@ int drbd_al_read_log(struct drbd_conf *mdev, struct drbd_backing_dev *bdev)
 		spin_lock_irq(&mdev->al_lock);
 
 		/* This loop runs backwards because in the cyclic
-		   elements there might be an old version of the
-		   updated element (in slot 0). So the element in slot 0
-		   can overwrite old versions. */
+		   elements there might be an old version of an
+		   updated element (in the first slots). So the updated
+		   elements can overwrite old versions. */
 		for (j = AL_EXTENTS_PT; j >= 0; j--) {
 			pos = be32_to_cpu(buffer->updates[j].pos);
 			extent_nr = be32_to_cpu(buffer->updates[j].extent);
@@ -716,7 +825,7 @@ static void drbd_try_clear_on_disk_bm(struct drbd_conf *mdev, sector_t sector,
 			if (udw) {
 				udw->enr = ext->lce.lc_number;
 				udw->w.cb = w_update_odbm;
-				drbd_queue_work_front(&mdev->data.work, &udw->w);
+				drbd_queue_work_front(&mdev->rs_queue, &udw->w);
 			} else {
 				dev_warn(DEV, "Could not kmalloc an udw\n");
 			}
@@ -37,12 +37,14 @@
 #include <linux/ratelimit.h>
 #include <linux/tcp.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <linux/major.h>
 #include <linux/blkdev.h>
 #include <linux/genhd.h>
 #include <net/tcp.h>
 #include <linux/lru_cache.h>
 #include <linux/prefetch.h>
+#include "drbd_interval.h"
 
 #ifdef __CHECKER__
 # define __protected_by(x)       __attribute__((require_context(x,1,999,"rdwr")))
@@ -63,6 +65,7 @@ extern unsigned int minor_count;
 extern int disable_sendpage;
 extern int allow_oos;
 extern unsigned int cn_idx;
+extern unsigned int data_streams;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int enable_faults;
@@ -208,8 +211,9 @@ enum drbd_packets {
 	P_DELAY_PROBE         = 0x27, /* is used on BOTH sockets */
 	P_OUT_OF_SYNC         = 0x28, /* Mark as out of sync (Outrunning), data socket */
 	P_RS_CANCEL           = 0x29, /* meta: Used to cancel RS_DATA_REQUEST packet by SyncSource */
+	P_DATA_FENCE          = 0x2A, /* data socket, only with data streams */
 
-	P_MAX_CMD	      = 0x2A,
+	P_MAX_CMD	      = 0x2B,
 	P_MAY_IGNORE	      = 0x100, /* Flag to test if (cmd > P_MAY_IGNORE) ... */
 	P_MAX_OPT_CMD	      = 0x101,
 
@@ -217,6 +221,7 @@ enum drbd_packets {
 
 	P_HAND_SHAKE_M	      = 0xfff1, /* First Packet on the MetaSock */
 	P_HAND_SHAKE_S	      = 0xfff2, /* First Packet on the Socket */
+	P_HAND_SHAKE_D	      = 0xfff3, /* First Packet on a data stream */
 
 	P_HAND_SHAKE	      = 0xfffe	/* FIXED for the next century! */
 };
@@ -266,6 +271,7 @@ static inline const char *cmdname(enum drbd_packets cmd)
 		[P_COMPRESSED_BITMAP]   = "CBitmap",
 		[P_DELAY_PROBE]         = "DelayProbe",
 		[P_OUT_OF_SYNC]		= "OutOfSync",
+		[P_DATA_FENCE]		= "DataFence",
 		[P_MAX_CMD]	        = NULL,
 	};
 
@@ -273,6 +279,8 @@ static inline const char *cmdname(enum drbd_packets cmd)
 		return "HandShakeM";
 	if (cmd == P_HAND_SHAKE_S)
 		return "HandShakeS";
+	if (cmd == P_HAND_SHAKE_D)
+		return "HandShakeD";
 	if (cmd == P_HAND_SHAKE)
 		return "HandShake";
 	if (cmd >= P_MAX_CMD)
@@ -431,7 +439,7 @@ struct p_handshake {
 	 * for now, feature_flags and the reserverd array shall be zero.
 	 */
 
-	u32 _pad;
+	u32 data_streams;	/* additional data connections wanted */
 	u64 reserverd[7];
 } __packed;
 /* 80 bytes, FIXED for the next century */
@@ -439,7 +447,7 @@ struct p_handshake {
 struct p_barrier {
 	struct p_header80 head;
 	u32 barrier;	/* barrier number _handle_ only */
-	u32 pad;	/* to multiple of 8 Byte */
+	u32 seq_num;	/* with data streams, zero otherwise */
 } __packed;
 
 struct p_barrier_ack {
@@ -554,6 +562,12 @@ struct p_block_desc {
 	u32 pad;	/* to multiple of 8 Byte */
 } __packed;
 
+struct p_data_fence {
+	struct p_header80 head;
+	u32 seq_num;	/* last P_DATA or P_BARRIER numbered before */
+	u32 pad;
+} __packed;
+
 /* Valid values for the encoding field.
  * Bump proto version when changing this. */
 enum drbd_bitmap_code {
@@ -652,6 +666,7 @@ union p_polymorph {
 	struct p_delay_probe93   delay_probe93;
 	struct p_rs_uuid         rs_uuid;
 	struct p_block_desc      block_desc;
+	struct p_data_fence      data_fence;
 } __packed;
 
 /**********************************************************************/
@@ -700,7 +715,7 @@ struct drbd_request {
 	 * see drbd_endio_pri(). */
 	struct bio *private_bio;
 
-	struct hlist_node collision;
+	struct drbd_interval i;
 	sector_t sector;
 	unsigned int size;
 	unsigned int epoch; /* barrier_nr */
@@ -766,7 +781,7 @@ struct digest_info {
 
 struct drbd_epoch_entry {
 	struct drbd_work w;
-	struct hlist_node collision;
+	struct drbd_interval i;
 	struct drbd_epoch *epoch; /* for writes */
 	struct drbd_conf *mdev;
 	struct page *pages;
@@ -802,12 +817,16 @@ enum {
 
 	/* This ee has a pointer to a digest instead of a block id */
 	__EE_HAS_DIGEST,
+
+	/* resync or online verify read, completed by the rs_worker */
+	__EE_RS_READ,
 };
 #define EE_CALL_AL_COMPLETE_IO (1<<__EE_CALL_AL_COMPLETE_IO)
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define	EE_RESUBMITTED         (1<<__EE_RESUBMITTED)
 #define EE_WAS_ERROR           (1<<__EE_WAS_ERROR)
 #define EE_HAS_DIGEST          (1<<__EE_HAS_DIGEST)
+#define EE_RS_READ             (1<<__EE_RS_READ)
 
 /* global flag bits */
 enum {
@@ -852,6 +871,7 @@ enum {
 	NEW_CUR_UUID,		/* Create new current UUID when thawing IO */
 	AL_SUSPENDED,		/* Activity logging is currently suspended. */
 	AHEAD_TO_SYNC_SOURCE,   /* Ahead -> SyncSource queued */
+	DATA_FENCE,		/* next P_DATA goes over the data socket, see drbd_send_data_fence() */
 };
 
 struct drbd_bitmap; /* opaque for drbd_conf */
@@ -904,6 +924,9 @@ struct drbd_socket {
 	union p_polymorph rbuf;
 };
 
+/* upper limit of the data_streams module parameter */
+#define DRBD_MAX_DATA_STREAMS 8
+
 struct drbd_md {
 	u64 md_offset;		/* sector offset to 'super' block */
 
@@ -964,6 +987,17 @@ struct fifo_buffer {
 	unsigned int size;
 };
 
+/* An activity log extent change that is not on disk yet.  Changes of
+ * concurrent AL misses are collected and written in one transaction,
+ * see w_al_write_transaction(). */
+struct al_update {
+	unsigned int pos;	/* index of the element in act_log */
+	unsigned int enr;	/* extent it now covers */
+	unsigned int old_enr;	/* extent it covered before, or LC_FREE */
+};
+
+#define AL_PENDING_MAX 64
+
 struct drbd_conf {
 	/* things that are stored as / read from meta data on disk */
 	unsigned long flags;
@@ -980,6 +1014,13 @@ struct drbd_conf {
 
 	struct drbd_socket data; /* data/barrier/cstate/parameter packets */
 	struct drbd_socket meta; /* ping/ack (metadata) packets */
+	/* Additional connections for P_DATA packets only, agreed on in the
+	 * handshake.  The worker spreads P_DATA over these and the data socket,
+	 * the receiving side puts them back in order by their seq_num, see
+	 * drbd_send_dblock() and drbd_wait_data_seq().  Control packets on
+	 * the data socket are fenced against them, see drbd_send_data_fence(). */
+	struct drbd_socket streams[DRBD_MAX_DATA_STREAMS];
+	unsigned int nr_streams;
 	int agreed_pro_version;  /* actually used protocol version */
 	unsigned long last_received; /* in jiffies, either socket */
 	unsigned int ko_count;
@@ -1023,8 +1064,13 @@ struct drbd_conf {
 	struct drbd_tl_epoch *newest_tle;
 	struct drbd_tl_epoch *oldest_tle;
 	struct list_head out_of_sequence_requests;
-	struct hlist_head *tl_hash;
-	unsigned int tl_hash_s;
+
+	/* Interval trees of requests in flight, for conflict detection and
+	 * to verify the block_id the peer sends back.  All three are
+	 * protected by req_lock. */
+	struct rb_root write_requests;	/* local writes sent to the peer */
+	struct rb_root read_requests;	/* local reads sent to the peer */
+	struct rb_root epoch_entries;	/* peer writes (two_primaries only) */
 
 	/* blocks to resync in this run [unit BM_BLOCK_SIZE] */
 	unsigned long rs_total;
@@ -1060,6 +1106,14 @@ struct drbd_conf {
 	struct drbd_thread receiver;
 	struct drbd_thread worker;
 	struct drbd_thread asender;
+	/* Resync and online verify work: making resync requests, reading and
+	 * checksumming blocks for them, and on disk bitmap updates.  Kept off
+	 * data.work, so that a CPU heavy verify or checksum based resync does
+	 * not hold up sending application writes.  Started and stopped along
+	 * with the worker. */
+	struct drbd_thread rs_worker;
+	struct drbd_work_queue rs_queue;
+	struct drbd_thread stream_receiver[DRBD_MAX_DATA_STREAMS];
 	struct drbd_bitmap *bitmap;
 	unsigned long bm_resync_fo; /* bit offset for drbd_bm_find_next */
 
@@ -1081,14 +1135,11 @@ struct drbd_conf {
 	struct list_head done_ee;   /* send ack */
 	struct list_head read_ee;   /* IO in progress (any read) */
 	struct list_head net_ee;    /* zero-copy network send in progress */
-	struct hlist_head *ee_hash; /* is proteced by req_lock! */
-	unsigned int ee_hash_s;
 
 	/* this one is protected by ee_lock, single thread */
 	struct drbd_epoch_entry *last_write_w_barrier;
 
 	int next_barrier_nr;
-	struct hlist_head *app_reads_hash; /* is proteced by req_lock */
 	struct list_head resync_reads;
 	atomic_t pp_in_use;		/* allocated from page pool */
 	atomic_t pp_in_use_by_net;	/* sendpage()d, still referenced by tcp */
@@ -1102,6 +1153,15 @@ struct drbd_conf {
 	unsigned int al_tr_number;
 	int al_tr_cycle;
 	int al_tr_pos;   /* position of the next transaction in the journal */
+	struct al_update al_pending[AL_PENDING_MAX]; /* oldest first, al_lock */
+	int al_nr_pending;
+	int al_tr_queued;	/* al_tr_work is queued, al_lock */
+	struct drbd_work al_tr_work;
+	/* local writes waiting for their AL extent, protected by al_lock;
+	 * do_submit() sends them on */
+	struct list_head submit_list;
+	struct workqueue_struct *submit_wq;
+	struct work_struct submit_work;
 	struct crypto_hash *cram_hmac_tfm;
 	struct crypto_hash *integrity_w_tfm; /* to be used by the worker thread */
 	struct crypto_hash *integrity_r_tfm; /* to be used by the receiver thread */
@@ -1111,6 +1171,8 @@ struct drbd_conf {
 	wait_queue_head_t seq_wait;
 	atomic_t packet_seq;
 	unsigned int peer_seq;
+	u32 data_seq;		/* last P_DATA or P_BARRIER sent, under data.mutex */
+	u32 peer_data_seq;	/* last one received, protected by peer_seq_lock */
 	spinlock_t peer_seq_lock;
 	unsigned int minor;
 	unsigned long comm_bm_set; /* communicated number of set bits. */
@@ -1429,18 +1491,15 @@ struct bm_extent {
 #endif
 #endif
 
-/* Sector shift value for the "hash" functions of tl_hash and ee_hash tables.
- * With a value of 8 all IO in one 128K block make it to the same slot of the
- * hash table. */
+/* Sector shift value for the alignment of requests: drbd_make_request() splits
+ * any bio crossing a 128K boundary, so a request never spans two activity log
+ * extents. */
 #define HT_SHIFT 8
 #define DRBD_MAX_BIO_SIZE (1U<<(9+HT_SHIFT))
 #define DRBD_MAX_BIO_SIZE_SAFE (1 << 12)       /* Works always = 4k */
 
 #define DRBD_MAX_SIZE_H80_PACKET (1 << 15) /* The old header only allows packets up to 32Kib data */
 
-/* Number of elements in the app_reads_hash */
-#define APP_R_HSIZE 15
-
 extern int  drbd_bm_init(struct drbd_conf *mdev);
 extern int  drbd_bm_resize(struct drbd_conf *mdev, sector_t sectors, int set_new_bits);
 extern void drbd_bm_cleanup(struct drbd_conf *mdev);
@@ -1508,6 +1567,7 @@ extern int proc_details;
 
 /* drbd_req */
 extern int drbd_make_request(struct request_queue *q, struct bio *bio);
+extern void do_submit(struct work_struct *ws);
 extern int drbd_read_remote(struct drbd_conf *mdev, struct drbd_request *req);
 extern int drbd_merge_bvec(struct request_queue *q, struct bvec_merge_data *bvm, struct bio_vec *bvec);
 extern int is_valid_ar_handle(struct drbd_request *, sector_t);
@@ -1531,6 +1591,7 @@ extern int drbd_khelper(struct drbd_conf *mdev, char *cmd);
 
 /* drbd_worker.c */
 extern int drbd_worker(struct drbd_thread *thi);
+extern int drbd_rs_worker(struct drbd_thread *thi);
 extern int drbd_alter_sa(struct drbd_conf *mdev, int na);
 extern void drbd_start_resync(struct drbd_conf *mdev, enum drbd_conns side);
 extern void resume_next_sg(struct drbd_conf *mdev);
@@ -1575,6 +1636,7 @@ extern int w_e_reissue(struct drbd_conf *, struct drbd_work *, int);
 extern int w_restart_disk_io(struct drbd_conf *, struct drbd_work *, int);
 extern int w_send_oos(struct drbd_conf *, struct drbd_work *, int);
 extern int w_start_resync(struct drbd_conf *, struct drbd_work *, int);
+extern int w_al_write_transaction(struct drbd_conf *, struct drbd_work *, int);
 
 extern void resync_timer_fn(unsigned long data);
 extern void start_resync_timer_fn(unsigned long data);
@@ -1600,7 +1662,6 @@ extern void _drbd_wait_ee_list_empty(struct drbd_conf *mdev,
 extern void drbd_set_recv_tcq(struct drbd_conf *mdev, int tcq_enabled);
 extern void _drbd_clear_done_ee(struct drbd_conf *mdev, struct list_head *to_be_freed);
 extern void drbd_flush_workqueue(struct drbd_conf *mdev);
-extern void drbd_free_tl_hash(struct drbd_conf *mdev);
 
 /* yes, there is kernel_setsockopt, but only since 2.6.18. we don't need to
  * mess with get_fs/set_fs, we know we are KERNEL_DS always. */
@@ -1654,6 +1715,8 @@ extern const char *drbd_role_str(enum drbd_role s);
 
 /* drbd_actlog.c */
 extern void drbd_al_begin_io(struct drbd_conf *mdev, sector_t sector);
+extern int drbd_al_begin_io_nonblock(struct drbd_conf *mdev, sector_t sector);
+extern int drbd_al_pending(struct drbd_conf *mdev, sector_t sector);
 extern void drbd_al_complete_io(struct drbd_conf *mdev, sector_t sector);
 extern void drbd_rs_complete_io(struct drbd_conf *mdev, sector_t sector);
 extern int drbd_rs_begin_io(struct drbd_conf *mdev, sector_t sector);
@@ -68,6 +68,7 @@ static DEFINE_MUTEX(drbd_main_mutex);
 int drbdd_init(struct drbd_thread *);
 int drbd_worker(struct drbd_thread *);
 int drbd_asender(struct drbd_thread *);
+int drbd_stream_receiver(struct drbd_thread *);
 
 int drbd_init(void);
 static int drbd_open(struct block_device *bdev, fmode_t mode);
@@ -92,12 +93,15 @@ MODULE_ALIAS_BLOCKDEV_MAJOR(DRBD_MAJOR);
 #include <linux/moduleparam.h>
 /* allow_open_on_secondary */
 MODULE_PARM_DESC(allow_oos, "DONT USE!");
+MODULE_PARM_DESC(data_streams, "Additional data connections per device (0-"
+		 __stringify(DRBD_MAX_DATA_STREAMS) "), used if the peer agrees");
 /* thanks to these macros, if compiled into the kernel (not-module),
  * this becomes the boot parameter drbd.minor_count */
 module_param(minor_count, uint, 0444);
 module_param(disable_sendpage, bool, 0644);
 module_param(allow_oos, bool, 0);
 module_param(cn_idx, uint, 0444);
+module_param(data_streams, uint, 0644);
 module_param(proc_details, int, 0644);
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
@@ -120,6 +124,7 @@ unsigned int minor_count = DRBD_MINOR_COUNT_DEF;
 int disable_sendpage;
 int allow_oos;
 unsigned int cn_idx = CN_IDX_DRBD;
+unsigned int data_streams;
 int proc_details;       /* Detail level in proc drbd*/
 
 /* Module parameter for setting the user mode helper program
@@ -209,8 +214,9 @@ static int tl_init(struct drbd_conf *mdev)
 	mdev->newest_tle = b;
 	INIT_LIST_HEAD(&mdev->out_of_sequence_requests);
 
-	mdev->tl_hash = NULL;
-	mdev->tl_hash_s = 0;
+	mdev->write_requests = RB_ROOT;
+	mdev->read_requests = RB_ROOT;
+	mdev->epoch_entries = RB_ROOT;
 
 	return 1;
 }
@@ -223,9 +229,9 @@ static void tl_cleanup(struct drbd_conf *mdev)
 	mdev->oldest_tle = NULL;
 	kfree(mdev->unused_spare_tle);
 	mdev->unused_spare_tle = NULL;
-	kfree(mdev->tl_hash);
-	mdev->tl_hash = NULL;
-	mdev->tl_hash_s = 0;
+	D_ASSERT(RB_EMPTY_ROOT(&mdev->write_requests));
+	D_ASSERT(RB_EMPTY_ROOT(&mdev->read_requests));
+	D_ASSERT(RB_EMPTY_ROOT(&mdev->epoch_entries));
 }
 
 /**
@@ -426,6 +432,7 @@ void tl_clear(struct drbd_conf *mdev)
 {
 	struct list_head *le, *tle;
 	struct drbd_request *r;
+	struct rb_node *node;
 
 	spin_lock_irq(&mdev->req_lock);
 
@@ -445,7 +452,11 @@ void tl_clear(struct drbd_conf *mdev)
 	/* ensure bit indicating barrier is required is clear */
 	clear_bit(CREATE_BARRIER, &mdev->flags);
 
-	memset(mdev->app_reads_hash, 0, APP_R_HSIZE*sizeof(void *));
+	/* reads still around are no longer expected from the peer;
+	 * they are added again should they get sent once more */
+	while ((node = rb_first(&mdev->read_requests)))
+		drbd_remove_interval(&mdev->read_requests,
+			rb_entry(node, struct drbd_interval, rb));
 
 	spin_unlock_irq(&mdev->req_lock);
 }
@@ -1603,10 +1614,6 @@ static void after_state_ch(struct drbd_conf *mdev, union drbd_state os,
 		put_ldev(mdev);
 	}
 
-	/* free tl_hash if we Got thawed and are C_STANDALONE */
-	if (ns.conn == C_STANDALONE && !is_susp(ns) && mdev->tl_hash)
-		drbd_free_tl_hash(mdev);
-
 	/* Upon network connection, we need to start the receiver */
 	if (os.conn == C_STANDALONE && ns.conn == C_UNCONNECTED)
 		drbd_thread_start(&mdev->receiver);
@@ -1688,7 +1695,9 @@ int drbd_thread_start(struct drbd_thread *thi)
 	const char *me =
 		thi == &mdev->receiver ? "receiver" :
 		thi == &mdev->asender  ? "asender"  :
-		thi == &mdev->worker   ? "worker"   : "NONSENSE";
+		thi == &mdev->worker   ? "worker"   :
+		thi == &mdev->rs_worker ? "rs_worker" :
+		thi->function == drbd_stream_receiver ? "stream" : "NONSENSE";
 
 	/* is used from state engine doing drbd_thread_stop_nowait,
 	 * while holding the req lock irqsave */
@@ -1831,6 +1840,45 @@ void drbd_thread_current_set_cpu(struct drbd_conf *mdev)
 }
 #endif
 
+/* Packets on the data socket which change what the peer accepts from us;
+ * with data streams they must not be reordered against P_DATA. */
+static bool drbd_cmd_needs_fence(enum drbd_packets cmd)
+{
+	switch (cmd) {
+	case P_SYNC_PARAM:
+	case P_SYNC_PARAM89:
+	case P_PROTOCOL:
+	case P_UUIDS:
+	case P_SIZES:
+	case P_STATE:
+	case P_SYNC_UUID:
+	case P_STATE_CHG_REQ:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* With data streams, the peer's receiver could process a control packet
+ * before a P_DATA sent earlier on a stream, and a stream reader a P_DATA sent
+ * later before that control packet.  P_DATA_FENCE makes the peer wait for
+ * every P_DATA and P_BARRIER numbered so far; DATA_FENCE sends the next P_DATA
+ * over the data socket, so everything numbered after it waits for this
+ * control packet in turn.  data.mutex must be held. */
+static int drbd_send_data_fence(struct drbd_conf *mdev, struct socket *sock)
+{
+	struct p_data_fence p;
+
+	p.head.magic   = BE_DRBD_MAGIC;
+	p.head.command = cpu_to_be16(P_DATA_FENCE);
+	p.head.length  = cpu_to_be16(sizeof(p) - sizeof(struct p_header80));
+	p.seq_num = cpu_to_be32(mdev->data_seq);
+	p.pad = 0;
+	set_bit(DATA_FENCE, &mdev->flags);
+
+	return drbd_send(mdev, sock, &p, sizeof(p), MSG_MORE) == sizeof(p);
+}
+
 /* the appropriate socket mutex must be held already */
 int _drbd_send_cmd(struct drbd_conf *mdev, struct socket *sock,
 			  enum drbd_packets cmd, struct p_header80 *h,
@@ -1841,6 +1889,10 @@ int _drbd_send_cmd(struct drbd_conf *mdev, struct socket *sock,
 	ERR_IF(!h) return false;
 	ERR_IF(!size) return false;
 
+	if (mdev->nr_streams && sock == mdev->data.socket &&
+	    drbd_cmd_needs_fence(cmd) && !drbd_send_data_fence(mdev, sock))
+		return false;
+
 	h->magic   = BE_DRBD_MAGIC;
 	h->command = cpu_to_be16(cmd);
 	h->length  = cpu_to_be16(size-sizeof(struct p_header80));
@@ -2553,18 +2605,18 @@ static int we_should_drop_the_connection(struct drbd_conf *mdev, struct socket *
  * As a workaround, we disable sendpage on pages
  * with page_count == 0 or PageSlab.
  */
-static int _drbd_no_send_page(struct drbd_conf *mdev, struct page *page,
-		   int offset, size_t size, unsigned msg_flags)
+static int _drbd_no_send_page(struct drbd_conf *mdev, struct socket *sock,
+		   struct page *page, int offset, size_t size, unsigned msg_flags)
 {
-	int sent = drbd_send(mdev, mdev->data.socket, kmap(page) + offset, size, msg_flags);
+	int sent = drbd_send(mdev, sock, kmap(page) + offset, size, msg_flags);
 	kunmap(page);
 	if (sent == size)
 		mdev->send_cnt += size>>9;
 	return sent == size;
 }
 
-static int _drbd_send_page(struct drbd_conf *mdev, struct page *page,
-		    int offset, size_t size, unsigned msg_flags)
+static int _drbd_send_page(struct drbd_conf *mdev, struct socket *sock,
+		    struct page *page, int offset, size_t size, unsigned msg_flags)
 {
 	mm_segment_t oldfs = get_fs();
 	int sent, ok;
@@ -2577,18 +2629,16 @@ static int _drbd_send_page(struct drbd_conf *mdev, struct page *page,
 	 * __page_cache_release a page that would actually still be referenced
 	 * by someone, leading to some obscure delayed Oops somewhere else. */
 	if (disable_sendpage || (page_count(page) < 1) || PageSlab(page))
-		return _drbd_no_send_page(mdev, page, offset, size, msg_flags);
+		return _drbd_no_send_page(mdev, sock, page, offset, size, msg_flags);
 
 	msg_flags |= MSG_NOSIGNAL;
-	drbd_update_congested(mdev);
+	if (sock == mdev->data.socket)
+		drbd_update_congested(mdev);
 	set_fs(KERNEL_DS);
 	do {
-		sent = mdev->data.socket->ops->sendpage(mdev->data.socket, page,
-							offset, len,
-							msg_flags);
+		sent = sock->ops->sendpage(sock, page, offset, len, msg_flags);
 		if (sent == -EAGAIN) {
-			if (we_should_drop_the_connection(mdev,
-							  mdev->data.socket))
+			if (we_should_drop_the_connection(mdev, sock))
 				break;
 			else
 				continue;
@@ -2610,13 +2660,14 @@ static int _drbd_send_page(struct drbd_conf *mdev, struct page *page,
 	return ok;
 }
 
-static int _drbd_send_bio(struct drbd_conf *mdev, struct bio *bio)
+static int _drbd_send_bio(struct drbd_conf *mdev, struct socket *sock,
+			  struct bio *bio)
 {
 	struct bio_vec *bvec;
 	int i;
 	/* hint all but last page with MSG_MORE */
 	__bio_for_each_segment(bvec, bio, i, 0) {
-		if (!_drbd_no_send_page(mdev, bvec->bv_page,
+		if (!_drbd_no_send_page(mdev, sock, bvec->bv_page,
 				     bvec->bv_offset, bvec->bv_len,
 				     i == bio->bi_vcnt -1 ? 0 : MSG_MORE))
 			return 0;
@@ -2624,13 +2675,14 @@ static int _drbd_send_bio(struct drbd_conf *mdev, struct bio *bio)
 	return 1;
 }
 
-static int _drbd_send_zc_bio(struct drbd_conf *mdev, struct bio *bio)
+static int _drbd_send_zc_bio(struct drbd_conf *mdev, struct socket *sock,
+			     struct bio *bio)
 {
 	struct bio_vec *bvec;
 	int i;
 	/* hint all but last page with MSG_MORE */
 	__bio_for_each_segment(bvec, bio, i, 0) {
-		if (!_drbd_send_page(mdev, bvec->bv_page,
+		if (!_drbd_send_page(mdev, sock, bvec->bv_page,
 				     bvec->bv_offset, bvec->bv_len,
 				     i == bio->bi_vcnt -1 ? 0 : MSG_MORE))
 			return 0;
@@ -2645,7 +2697,7 @@ static int _drbd_send_zc_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
 	/* hint all but last page with MSG_MORE */
 	page_chain_for_each(page) {
 		unsigned l = min_t(unsigned, len, PAGE_SIZE);
-		if (!_drbd_send_page(mdev, page, 0, l,
+		if (!_drbd_send_page(mdev, mdev->data.socket, page, 0, l,
 				page_chain_next(page) ? MSG_MORE : 0))
 			return 0;
 		len -= l;
@@ -2664,6 +2716,29 @@ static u32 bio_flags_to_wire(struct drbd_conf *mdev, unsigned long bi_rw)
 		return bi_rw & REQ_SYNC ? DP_RW_SYNC : 0;
 }
 
+/* Choose the connection for the next P_DATA: with data streams, the one with
+ * the most room left in its send buffer.  The peer puts them back in order.
+ * data.mutex must be held. */
+static struct drbd_socket *drbd_pick_data_stream(struct drbd_conf *mdev)
+{
+	struct drbd_socket *ds, *best = &mdev->data;
+	int i, space, best_space = -1;
+
+	for (i = -1; i < (int)mdev->nr_streams; i++) {
+		ds = i < 0 ? &mdev->data : &mdev->streams[i];
+		if (i >= 0)
+			mutex_lock(&ds->mutex);
+		space = ds->socket ? sk_stream_wspace(ds->socket->sk) : -1;
+		if (i >= 0)
+			mutex_unlock(&ds->mutex);
+		if (space > best_space) {
+			best_space = space;
+			best = ds;
+		}
+	}
+	return best;
+}
+
 /* Used to send write requests
  * R_PRIMARY -> Peer	(P_DATA)
  */
@@ -2671,12 +2746,37 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 {
 	int ok = 1;
 	struct p_data p;
+	struct drbd_socket *ds = &mdev->data;
 	unsigned int dp_flags = 0;
 	void *dgb;
 	int dgs;
-
-	if (!drbd_get_data_sock(mdev))
+	u32 seq = 0;
+
+	mutex_lock(&ds->mutex);
+	if (mdev->nr_streams) {
+		/* DATA_FENCE, the choice of the stream and data_seq go together
+		 * under data.mutex, which drbd_send_data_fence() holds as well.
+		 * Not while resync or online verify run: their requests and
+		 * replies go over the data socket, and must not overtake a
+		 * write.  Nor right after a control packet. */
+		if (mdev->state.conn == C_CONNECTED &&
+		    !test_bit(DATA_FENCE, &mdev->flags))
+			ds = drbd_pick_data_stream(mdev);
+		/* P_DATA and P_BARRIER are numbered in the order the worker
+		 * sends them, see drbd_wait_data_seq() */
+		seq = ++mdev->data_seq;
+		if (ds == &mdev->data) {
+			clear_bit(DATA_FENCE, &mdev->flags);
+		} else {
+			mutex_unlock(&mdev->data.mutex);
+			mutex_lock(&ds->mutex);
+		}
+	}
+	/* drbd_disconnect() could have called drbd_free_sock() meanwhile */
+	if (unlikely(ds->socket == NULL)) {
+		mutex_unlock(&ds->mutex);
 		return 0;
+	}
 
 	dgs = (mdev->agreed_pro_version >= 87 && mdev->integrity_w_tfm) ?
 		crypto_hash_digestsize(mdev->integrity_w_tfm) : 0;
@@ -2695,8 +2795,11 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 
 	p.sector   = cpu_to_be64(req->sector);
 	p.block_id = (unsigned long)req;
-	p.seq_num  = cpu_to_be32(req->seq_num =
-				 atomic_add_return(1, &mdev->packet_seq));
+	if (mdev->nr_streams)
+		p.seq_num = cpu_to_be32(req->seq_num = seq);
+	else
+		p.seq_num = cpu_to_be32(req->seq_num =
+					atomic_add_return(1, &mdev->packet_seq));
 
 	dp_flags = bio_flags_to_wire(mdev, req->master_bio->bi_rw);
 
@@ -2707,11 +2810,11 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 	p.dp_flags = cpu_to_be32(dp_flags);
 	set_bit(UNPLUG_REMOTE, &mdev->flags);
 	ok = (sizeof(p) ==
-		drbd_send(mdev, mdev->data.socket, &p, sizeof(p), dgs ? MSG_MORE : 0));
+		drbd_send(mdev, ds->socket, &p, sizeof(p), dgs ? MSG_MORE : 0));
 	if (ok && dgs) {
 		dgb = mdev->int_dig_out;
 		drbd_csum_bio(mdev, mdev->integrity_w_tfm, req->master_bio, dgb);
-		ok = dgs == drbd_send(mdev, mdev->data.socket, dgb, dgs, 0);
+		ok = dgs == drbd_send(mdev, ds->socket, dgb, dgs, 0);
 	}
 	if (ok) {
 		/* For protocol A, we have to memcpy the payload into
@@ -2726,9 +2829,9 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 		 * receiving side, we sure have detected corruption elsewhere.
 		 */
 		if (mdev->net_conf->wire_protocol == DRBD_PROT_A || dgs)
-			ok = _drbd_send_bio(mdev, req->master_bio);
+			ok = _drbd_send_bio(mdev, ds->socket, req->master_bio);
 		else
-			ok = _drbd_send_zc_bio(mdev, req->master_bio);
+			ok = _drbd_send_zc_bio(mdev, ds->socket, req->master_bio);
 
 		/* double check digest, sometimes buffers have been modified in flight. */
 		if (dgs > 0 && dgs <= 64) {
@@ -2746,7 +2849,7 @@ int drbd_send_dblock(struct drbd_conf *mdev, struct drbd_request *req)
 		} */
 	}
 
-	drbd_put_data_sock(mdev);
+	mutex_unlock(&ds->mutex);
 
 	return ok;
 }
@@ -2850,9 +2953,11 @@ int drbd_send(struct drbd_conf *mdev, struct socket *sock,
 	msg.msg_controllen = 0;
 	msg.msg_flags      = msg_flags | MSG_NOSIGNAL;
 
-	if (sock == mdev->data.socket) {
+	if (sock != mdev->meta.socket) {
+		/* the data socket, or one of the data streams */
 		mdev->ko_count = mdev->net_conf->ko_count;
-		drbd_update_congested(mdev);
+		if (sock == mdev->data.socket)
+			drbd_update_congested(mdev);
 	}
 	do {
 		/* STRANGE
@@ -2970,6 +3075,8 @@ static void drbd_set_defaults(struct drbd_conf *mdev)
 
 void drbd_init_set_defaults(struct drbd_conf *mdev)
 {
+	int i;
+
 	/* the memset(,0,) did most of this.
 	 * note: only assignments, no allocation in here */
 
@@ -2991,12 +3098,16 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	mutex_init(&mdev->md_io_mutex);
 	mutex_init(&mdev->data.mutex);
 	mutex_init(&mdev->meta.mutex);
+	for (i = 0; i < DRBD_MAX_DATA_STREAMS; i++)
+		mutex_init(&mdev->streams[i].mutex);
 	sema_init(&mdev->data.work.s, 0);
 	sema_init(&mdev->meta.work.s, 0);
+	sema_init(&mdev->rs_queue.s, 0);
 	mutex_init(&mdev->state_mutex);
 
 	spin_lock_init(&mdev->data.work.q_lock);
 	spin_lock_init(&mdev->meta.work.q_lock);
+	spin_lock_init(&mdev->rs_queue.q_lock);
 
 	spin_lock_init(&mdev->al_lock);
 	spin_lock_init(&mdev->req_lock);
@@ -3011,12 +3122,16 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	INIT_LIST_HEAD(&mdev->resync_reads);
 	INIT_LIST_HEAD(&mdev->data.work.q);
 	INIT_LIST_HEAD(&mdev->meta.work.q);
+	INIT_LIST_HEAD(&mdev->rs_queue.q);
 	INIT_LIST_HEAD(&mdev->resync_work.list);
 	INIT_LIST_HEAD(&mdev->unplug_work.list);
 	INIT_LIST_HEAD(&mdev->go_diskless.list);
 	INIT_LIST_HEAD(&mdev->md_sync_work.list);
 	INIT_LIST_HEAD(&mdev->start_resync_work.list);
 	INIT_LIST_HEAD(&mdev->bm_io_work.w.list);
+	INIT_LIST_HEAD(&mdev->al_tr_work.list);
+	INIT_LIST_HEAD(&mdev->submit_list);
+	INIT_WORK(&mdev->submit_work, do_submit);
 
 	mdev->resync_work.cb  = w_resync_timer;
 	mdev->unplug_work.cb  = w_send_write_hint;
@@ -3024,6 +3139,7 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	mdev->md_sync_work.cb = w_md_sync;
 	mdev->bm_io_work.w.cb = w_bitmap_io;
 	mdev->start_resync_work.cb = w_start_resync;
+	mdev->al_tr_work.cb = w_al_write_transaction;
 	init_timer(&mdev->resync_timer);
 	init_timer(&mdev->md_sync_timer);
 	init_timer(&mdev->start_resync_timer);
@@ -3047,6 +3163,10 @@ void drbd_init_set_defaults(struct drbd_conf *mdev)
 	drbd_thread_init(mdev, &mdev->receiver, drbdd_init);
 	drbd_thread_init(mdev, &mdev->worker, drbd_worker);
 	drbd_thread_init(mdev, &mdev->asender, drbd_asender);
+	drbd_thread_init(mdev, &mdev->rs_worker, drbd_rs_worker);
+	for (i = 0; i < DRBD_MAX_DATA_STREAMS; i++)
+		drbd_thread_init(mdev, &mdev->stream_receiver[i],
+				 drbd_stream_receiver);
 
 	mdev->agreed_pro_version = PRO_VERSION_MAX;
 	mdev->write_ordering = WO_bdev_flush;
@@ -3105,6 +3225,7 @@ void drbd_mdev_cleanup(struct drbd_conf *mdev)
 	D_ASSERT(list_empty(&mdev->resync_reads));
 	D_ASSERT(list_empty(&mdev->data.work.q));
 	D_ASSERT(list_empty(&mdev->meta.work.q));
+	D_ASSERT(list_empty(&mdev->rs_queue.q));
 	D_ASSERT(list_empty(&mdev->resync_work.list));
 	D_ASSERT(list_empty(&mdev->unplug_work.list));
 	D_ASSERT(list_empty(&mdev->go_diskless.list));
@@ -3287,13 +3408,6 @@ static void drbd_delete_device(unsigned int minor)
 
 	drbd_release_ee_lists(mdev);
 
-	/* should be freed on disconnect? */
-	kfree(mdev->ee_hash);
-	/*
-	mdev->ee_hash_s = 0;
-	mdev->ee_hash = NULL;
-	*/
-
 	lc_destroy(mdev->act_log);
 	lc_destroy(mdev->resync);
 
@@ -3444,10 +3558,6 @@ struct drbd_conf *drbd_new_device(unsigned int minor)
 	if (!tl_init(mdev))
 		goto out_no_tl;
 
-	mdev->app_reads_hash = kzalloc(APP_R_HSIZE*sizeof(void *), GFP_KERNEL);
-	if (!mdev->app_reads_hash)
-		goto out_no_app_reads;
-
 	mdev->current_epoch = kzalloc(sizeof(struct drbd_epoch), GFP_KERNEL);
 	if (!mdev->current_epoch)
 		goto out_no_epoch;
@@ -3455,13 +3565,17 @@ struct drbd_conf *drbd_new_device(unsigned int minor)
 	INIT_LIST_HEAD(&mdev->current_epoch->list);
 	mdev->epochs = 1;
 
+	mdev->submit_wq = create_singlethread_workqueue("drbd_submit");
+	if (!mdev->submit_wq)
+		goto out_no_submit_wq;
+
 	return mdev;
 
 /* out_whatever_else:
-	kfree(mdev->current_epoch); */
+	destroy_workqueue(mdev->submit_wq); */
+out_no_submit_wq:
+	kfree(mdev->current_epoch);
 out_no_epoch:
-	kfree(mdev->app_reads_hash);
-out_no_app_reads:
 	tl_cleanup(mdev);
 out_no_tl:
 	drbd_bm_cleanup(mdev);
@@ -3482,8 +3596,8 @@ out_no_cpumask:
  * last part of drbd_delete_device. */
 void drbd_free_mdev(struct drbd_conf *mdev)
 {
+	destroy_workqueue(mdev->submit_wq);
 	kfree(mdev->current_epoch);
-	kfree(mdev->app_reads_hash);
 	tl_cleanup(mdev);
 	if (mdev->bitmap) /* should no longer be there. */
 		drbd_bm_cleanup(mdev);
@@ -3491,7 +3605,6 @@ void drbd_free_mdev(struct drbd_conf *mdev)
 	put_disk(mdev->vdisk);
 	blk_cleanup_queue(mdev->rq_queue);
 	free_cpumask_var(mdev->cpu_mask);
-	drbd_free_tl_hash(mdev);
 	kfree(mdev);
 }
 
@@ -3589,6 +3702,8 @@ void drbd_free_bc(struct drbd_backing_dev *ldev)
 
 void drbd_free_sock(struct drbd_conf *mdev)
 {
+	int i;
+
 	if (mdev->data.socket) {
 		mutex_lock(&mdev->data.mutex);
 		kernel_sock_shutdown(mdev->data.socket, SHUT_RDWR);
@@ -3603,6 +3718,17 @@ void drbd_free_sock(struct drbd_conf *mdev)
 		mdev->meta.socket = NULL;
 		mutex_unlock(&mdev->meta.mutex);
 	}
+	for (i = 0; i < DRBD_MAX_DATA_STREAMS; i++) {
+		struct drbd_socket *ds = &mdev->streams[i];
+
+		if (!ds->socket)
+			continue;
+		mutex_lock(&ds->mutex);
+		kernel_sock_shutdown(ds->socket, SHUT_RDWR);
+		sock_release(ds->socket);
+		ds->socket = NULL;
+		mutex_unlock(&ds->mutex);
+	}
 }
 
 
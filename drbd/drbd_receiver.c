@@ -333,7 +333,9 @@ struct drbd_epoch_entry *drbd_alloc_ee(struct drbd_conf *mdev,
 	if (!page)
 		goto fail;
 
-	INIT_HLIST_NODE(&e->collision);
+	drbd_clear_interval(&e->i);
+	e->i.sector = sector;
+	e->i.size = data_size;
 	e->epoch = NULL;
 	e->mdev = mdev;
 	e->pages = page;
@@ -356,7 +358,7 @@ void drbd_free_some_ee(struct drbd_conf *mdev, struct drbd_epoch_entry *e, int i
 		kfree(e->digest);
 	drbd_pp_free(mdev, e->pages, is_net);
 	D_ASSERT(atomic_read(&e->pending_bios) == 0);
-	D_ASSERT(hlist_unhashed(&e->collision));
+	D_ASSERT(drbd_interval_empty(&e->i));
 	mempool_free(e, drbd_ee_mempool);
 }
 
@@ -494,7 +496,8 @@ static int drbd_recv_short(struct drbd_conf *mdev, struct socket *sock,
 	return rv;
 }
 
-static int drbd_recv(struct drbd_conf *mdev, void *buf, size_t size)
+static int drbd_recv_sock(struct drbd_conf *mdev, struct socket *sock,
+			  void *buf, size_t size)
 {
 	mm_segment_t oldfs;
 	struct kvec iov = {
@@ -512,7 +515,7 @@ static int drbd_recv(struct drbd_conf *mdev, void *buf, size_t size)
 	set_fs(KERNEL_DS);
 
 	for (;;) {
-		rv = sock_recvmsg(mdev->data.socket, &msg, size, msg.msg_flags);
+		rv = sock_recvmsg(sock, &msg, size, msg.msg_flags);
 		if (rv == size)
 			break;
 
@@ -547,6 +550,11 @@ static int drbd_recv(struct drbd_conf *mdev, void *buf, size_t size)
 	return rv;
 }
 
+static int drbd_recv(struct drbd_conf *mdev, void *buf, size_t size)
+{
+	return drbd_recv_sock(mdev, mdev->data.socket, buf, size);
+}
+
 /* quoting tcp(7):
  *   On individual connections, the socket buffer size must be set prior to the
  *   listen(2) or connect(2) calls in order to have it take effect.
@@ -738,6 +746,56 @@ static int drbd_socket_okay(struct drbd_conf *mdev, struct socket **sock)
 	}
 }
 
+/**
+ * drbd_connect_streams() - Establish the data streams agreed on in the handshake
+ * @mdev:	DRBD device.
+ *
+ * The node that accepted the meta socket accepts these as well, the other one
+ * connects.  Returns 1 if all streams are up, 0 if we should try again.
+ */
+static int drbd_connect_streams(struct drbd_conf *mdev)
+{
+	struct socket *s;
+	unsigned int i;
+	int try;
+
+	for (i = 0; i < mdev->nr_streams; i++) {
+		if (test_bit(DISCARD_CONCURRENT, &mdev->flags)) {
+			s = drbd_wait_for_connect(mdev);
+			if (s && drbd_recv_fp(mdev, s) != P_HAND_SHAKE_D) {
+				dev_warn(DEV, "Error receiving initial packet on data stream\n");
+				sock_release(s);
+				s = NULL;
+			}
+		} else {
+			for (try = 0;;) {
+				s = drbd_try_connect(mdev);
+				if (s || ++try >= mdev->net_conf->try_connect_int * 10 ||
+				    signal_pending(current))
+					break;
+				/* give the other side time to call bind() & listen() */
+				schedule_timeout_interruptible(HZ / 10);
+			}
+			if (s && !drbd_send_fp(mdev, s, P_HAND_SHAKE_D)) {
+				sock_release(s);
+				s = NULL;
+			}
+		}
+		if (!s)
+			return 0;
+
+		s->sk->sk_reuse = 1; /* SO_REUSEADDR */
+		s->sk->sk_allocation = GFP_NOIO;
+		s->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
+		s->sk->sk_sndtimeo = mdev->net_conf->timeout*HZ/10;
+		s->sk->sk_rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+		drbd_tcp_nodelay(s);
+
+		mdev->streams[i].socket = s;
+	}
+	return 1;
+}
+
 /*
  * return values:
  *   1 yes, we have a valid connection
@@ -749,6 +807,7 @@ static int drbd_socket_okay(struct drbd_conf *mdev, struct socket **sock)
 static int drbd_connect(struct drbd_conf *mdev)
 {
 	struct socket *s, *sock, *msock;
+	unsigned int i;
 	int try, h, ok;
 
 	D_ASSERT(!mdev->data.socket);
@@ -888,6 +947,11 @@ retry:
 		}
 	}
 
+	if (!drbd_connect_streams(mdev)) {
+		dev_err(DEV, "Establishing data streams failed, trying again.\n");
+		return 0;
+	}
+
 	if (drbd_request_state(mdev, NS(conn, C_WF_REPORT_PARAMS)) < SS_SUCCESS)
 		return 0;
 
@@ -896,8 +960,12 @@ retry:
 
 	atomic_set(&mdev->packet_seq, 0);
 	mdev->peer_seq = 0;
+	mdev->data_seq = 0;
+	mdev->peer_data_seq = 0;
 
 	drbd_thread_start(&mdev->asender);
+	for (i = 0; i < mdev->nr_streams; i++)
+		drbd_thread_start(&mdev->stream_receiver[i]);
 
 	if (drbd_send_protocol(mdev) == -1)
 		return -1;
@@ -919,12 +987,13 @@ out_release_sockets:
 	return -1;
 }
 
-static int drbd_recv_header(struct drbd_conf *mdev, enum drbd_packets *cmd, unsigned int *packet_size)
+static int _drbd_recv_header(struct drbd_conf *mdev, struct drbd_socket *ds,
+			     enum drbd_packets *cmd, unsigned int *packet_size)
 {
-	union p_header *h = &mdev->data.rbuf.header;
+	union p_header *h = &ds->rbuf.header;
 	int r;
 
-	r = drbd_recv(mdev, h, sizeof(*h));
+	r = drbd_recv_sock(mdev, ds->socket, h, sizeof(*h));
 	if (unlikely(r != sizeof(*h))) {
 		if (!signal_pending(current))
 			dev_warn(DEV, "short read expecting header on sock: r=%d\n", r);
@@ -949,6 +1018,11 @@ static int drbd_recv_header(struct drbd_conf *mdev, enum drbd_packets *cmd, unsi
 	return true;
 }
 
+static int drbd_recv_header(struct drbd_conf *mdev, enum drbd_packets *cmd, unsigned int *packet_size)
+{
+	return _drbd_recv_header(mdev, &mdev->data, cmd, packet_size);
+}
+
 static void drbd_flush(struct drbd_conf *mdev)
 {
 	int rv;
@@ -1156,10 +1230,82 @@ fail:
 	return err;
 }
 
-static int receive_Barrier(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
+/* With data streams, P_DATA and P_BARRIER packets may arrive on different
+ * connections.  They still have to be accounted to their epochs, and their
+ * writes submitted, in the order the peer sent them; their seq_num tells.
+ * Each one waits here for its turn, and passes it on with
+ * drbd_data_seq_done().
+ *
+ * returns 0 if we may process the packet,
+ * -ERESTARTSYS if we were interrupted (by disconnect signal). */
+static int drbd_wait_data_seq(struct drbd_conf *mdev, const u32 seq)
+{
+	DEFINE_WAIT(wait);
+	int ret = 0;
+
+	if (!mdev->nr_streams)
+		return 0;
+
+	spin_lock(&mdev->peer_seq_lock);
+	for (;;) {
+		prepare_to_wait(&mdev->seq_wait, &wait, TASK_INTERRUPTIBLE);
+		if (mdev->peer_data_seq + 1 == seq)
+			break;
+		if (!seq_gt(seq, mdev->peer_data_seq)) {
+			dev_err(DEV, "data sequence number %u seen twice\n", seq);
+			ret = -EIO;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		spin_unlock(&mdev->peer_seq_lock);
+		schedule();
+		spin_lock(&mdev->peer_seq_lock);
+	}
+	finish_wait(&mdev->seq_wait, &wait);
+	spin_unlock(&mdev->peer_seq_lock);
+	return ret;
+}
+
+/* For P_DATA_FENCE: wait until every P_DATA and P_BARRIER up to seq is done,
+ * so that the control packet after it does not overtake them. */
+static int drbd_wait_data_fence(struct drbd_conf *mdev, const u32 seq)
+{
+	DEFINE_WAIT(wait);
+	int ret = 0;
+
+	spin_lock(&mdev->peer_seq_lock);
+	while (seq_gt(seq, mdev->peer_data_seq)) {
+		prepare_to_wait(&mdev->seq_wait, &wait, TASK_INTERRUPTIBLE);
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		spin_unlock(&mdev->peer_seq_lock);
+		schedule();
+		spin_lock(&mdev->peer_seq_lock);
+	}
+	finish_wait(&mdev->seq_wait, &wait);
+	spin_unlock(&mdev->peer_seq_lock);
+	return ret;
+}
+
+static void drbd_data_seq_done(struct drbd_conf *mdev, const u32 seq)
+{
+	if (!mdev->nr_streams)
+		return;
+
+	spin_lock(&mdev->peer_seq_lock);
+	mdev->peer_data_seq = seq;
+	spin_unlock(&mdev->peer_seq_lock);
+	wake_up(&mdev->seq_wait);
+}
+
+static int _receive_Barrier(struct drbd_conf *mdev, struct p_barrier *p)
 {
 	int rv;
-	struct p_barrier *p = &mdev->data.rbuf.barrier;
 	struct drbd_epoch *epoch;
 
 	inc_unacked(mdev);
@@ -1227,12 +1373,46 @@ static int receive_Barrier(struct drbd_conf *mdev, enum drbd_packets cmd, unsign
 	return true;
 }
 
+static int receive_Barrier(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
+{
+	struct p_barrier *p = &mdev->data.rbuf.barrier;
+	const u32 seq = be32_to_cpu(p->seq_num);
+	int rv;
+
+	if (drbd_wait_data_seq(mdev, seq))
+		return false;
+
+	rv = _receive_Barrier(mdev, p);
+	if (rv)
+		drbd_data_seq_done(mdev, seq);
+	return rv;
+}
+
+/* even though we trust out peer,
+ * we sometimes have to double check.
+ * With data streams, only once P_DATA has its turn: a P_SIZES before it
+ * may have grown the device meanwhile. */
+static bool drbd_beyond_capacity(struct drbd_conf *mdev, struct drbd_epoch_entry *e)
+{
+	const sector_t capacity = drbd_get_capacity(mdev->this_bdev);
+
+	if (e->sector + (e->size>>9) <= capacity)
+		return false;
+
+	dev_err(DEV, "request from peer beyond end of local disk: "
+		"capacity: %llus < sector: %llus + size: %u\n",
+		(unsigned long long)capacity,
+		(unsigned long long)e->sector, e->size);
+	return true;
+}
+
 /* used from receive_RSDataReply (recv_resync_read)
- * and from receive_Data */
+ * and from receive_Data, which may read from a data stream;
+ * the callers check the capacity, see drbd_beyond_capacity() */
 static struct drbd_epoch_entry *
-read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __must_hold(local)
+read_in_block(struct drbd_conf *mdev, struct socket *sock, u64 id,
+	      sector_t sector, int data_size) __must_hold(local)
 {
-	const sector_t capacity = drbd_get_capacity(mdev->this_bdev);
 	struct drbd_epoch_entry *e;
 	struct page *page;
 	int dgs, ds, rr;
@@ -1244,7 +1424,7 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 		crypto_hash_digestsize(mdev->integrity_r_tfm) : 0;
 
 	if (dgs) {
-		rr = drbd_recv(mdev, dig_in, dgs);
+		rr = drbd_recv_sock(mdev, sock, dig_in, dgs);
 		if (rr != dgs) {
 			if (!signal_pending(current))
 				dev_warn(DEV,
@@ -1260,16 +1440,6 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 	ERR_IF(data_size &  0x1ff) return NULL;
 	ERR_IF(data_size >  DRBD_MAX_BIO_SIZE) return NULL;
 
-	/* even though we trust out peer,
-	 * we sometimes have to double check. */
-	if (sector + (data_size>>9) > capacity) {
-		dev_err(DEV, "request from peer beyond end of local disk: "
-			"capacity: %llus < sector: %llus + size: %u\n",
-			(unsigned long long)capacity,
-			(unsigned long long)sector, data_size);
-		return NULL;
-	}
-
 	/* GFP_NOIO, because we must not cause arbitrary write-out: in a DRBD
 	 * "criss-cross" setup, that might cause write-out on some other DRBD,
 	 * which in turn might block on the other node at this very place.  */
@@ -1282,7 +1452,7 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 	page_chain_for_each(page) {
 		unsigned len = min_t(int, ds, PAGE_SIZE);
 		data = kmap(page);
-		rr = drbd_recv(mdev, data, len);
+		rr = drbd_recv_sock(mdev, sock, data, len);
 		if (drbd_insert_fault(mdev, DRBD_FAULT_RECEIVE)) {
 			dev_err(DEV, "Fault injection: Corrupting data on receive\n");
 			data[0] = data[0] ^ (unsigned long)-1;
@@ -1316,7 +1486,8 @@ read_in_block(struct drbd_conf *mdev, u64 id, sector_t sector, int data_size) __
 /* drbd_drain_block() just takes a data block
  * out of the socket input buffer, and discards it.
  */
-static int drbd_drain_block(struct drbd_conf *mdev, int data_size)
+static int drbd_drain_block(struct drbd_conf *mdev, struct socket *sock,
+			    int data_size)
 {
 	struct page *page;
 	int rr, rv = 1;
@@ -1329,7 +1500,8 @@ static int drbd_drain_block(struct drbd_conf *mdev, int data_size)
 
 	data = kmap(page);
 	while (data_size) {
-		rr = drbd_recv(mdev, data, min_t(int, data_size, PAGE_SIZE));
+		rr = drbd_recv_sock(mdev, sock, data,
+				    min_t(int, data_size, PAGE_SIZE));
 		if (rr != min_t(int, data_size, PAGE_SIZE)) {
 			rv = 0;
 			if (!signal_pending(current))
@@ -1413,7 +1585,7 @@ static int e_end_resync_block(struct drbd_conf *mdev, struct drbd_work *w, int u
 	sector_t sector = e->sector;
 	int ok;
 
-	D_ASSERT(hlist_unhashed(&e->collision));
+	D_ASSERT(drbd_interval_empty(&e->i));
 
 	if (likely((e->flags & EE_WAS_ERROR) == 0)) {
 		drbd_set_in_sync(mdev, sector, e->size);
@@ -1433,9 +1605,13 @@ static int recv_resync_read(struct drbd_conf *mdev, sector_t sector, int data_si
 {
 	struct drbd_epoch_entry *e;
 
-	e = read_in_block(mdev, ID_SYNCER, sector, data_size);
+	e = read_in_block(mdev, mdev->data.socket, ID_SYNCER, sector, data_size);
 	if (!e)
 		goto fail;
+	if (drbd_beyond_capacity(mdev, e)) {
+		drbd_free_ee(mdev, e);
+		goto fail;
+	}
 
 	dec_rs_pending(mdev);
 
@@ -1482,7 +1658,7 @@ static int receive_DataReply(struct drbd_conf *mdev, enum drbd_packets cmd, unsi
 		return false;
 	}
 
-	/* hlist_del(&req->collision) is done in _req_may_be_done, to avoid
+	/* drbd_remove_interval() is done in _req_may_be_done, to avoid
 	 * special casing it there for the various failure cases.
 	 * still no race with drbd_fail_pending_reads */
 	ok = recv_dless_read(mdev, req, sector, data_size);
@@ -1514,7 +1690,7 @@ static int receive_RSDataReply(struct drbd_conf *mdev, enum drbd_packets cmd, un
 		if (__ratelimit(&drbd_ratelimit_state))
 			dev_err(DEV, "Can not write resync data to local disk.\n");
 
-		ok = drbd_drain_block(mdev, data_size);
+		ok = drbd_drain_block(mdev, mdev->data.socket, data_size);
 
 		drbd_send_ack_dp(mdev, P_NEG_ACK, p, data_size);
 	}
@@ -1549,15 +1725,15 @@ static int e_end_block(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 		}
 		dec_unacked(mdev);
 	}
-	/* we delete from the conflict detection hash _after_ we sent out the
+	/* we delete from the conflict detection tree _after_ we sent out the
 	 * P_WRITE_ACK / P_NEG_ACK, to get the sequence number right.  */
 	if (mdev->net_conf->two_primaries) {
 		spin_lock_irq(&mdev->req_lock);
-		D_ASSERT(!hlist_unhashed(&e->collision));
-		hlist_del_init(&e->collision);
+		D_ASSERT(!drbd_interval_empty(&e->i));
+		drbd_remove_interval(&mdev->epoch_entries, &e->i);
 		spin_unlock_irq(&mdev->req_lock);
 	} else {
-		D_ASSERT(hlist_unhashed(&e->collision));
+		D_ASSERT(drbd_interval_empty(&e->i));
 	}
 
 	drbd_may_finish_epoch(mdev, e->epoch, EV_PUT + (cancel ? EV_CLEANUP : 0));
@@ -1574,8 +1750,8 @@ static int e_send_discard_ack(struct drbd_conf *mdev, struct drbd_work *w, int u
 	ok = drbd_send_ack(mdev, P_DISCARD_ACK, e);
 
 	spin_lock_irq(&mdev->req_lock);
-	D_ASSERT(!hlist_unhashed(&e->collision));
-	hlist_del_init(&e->collision);
+	D_ASSERT(!drbd_interval_empty(&e->i));
+	drbd_remove_interval(&mdev->epoch_entries, &e->i);
 	spin_unlock_irq(&mdev->req_lock);
 
 	dec_unacked(mdev);
@@ -1647,24 +1823,31 @@ static unsigned long wire_flags_to_bio(struct drbd_conf *mdev, u32 dpf)
 		(dpf & DP_DISCARD ? REQ_DISCARD : 0);
 }
 
-/* mirrored write */
-static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
+/* mirrored write, received on the data socket or on one of the data streams */
+static int _receive_Data(struct drbd_conf *mdev, struct drbd_socket *ds,
+			 unsigned int data_size)
 {
 	sector_t sector;
 	struct drbd_epoch_entry *e;
-	struct p_data *p = &mdev->data.rbuf.data;
+	struct p_data *p = &ds->rbuf.data;
+	const u32 seq = be32_to_cpu(p->seq_num);
 	int rw = WRITE;
 	u32 dp_flags;
 
 	if (!get_ldev(mdev)) {
 		spin_lock(&mdev->peer_seq_lock);
-		if (mdev->peer_seq+1 == be32_to_cpu(p->seq_num))
+		if (mdev->peer_seq+1 == seq)
 			mdev->peer_seq++;
 		spin_unlock(&mdev->peer_seq_lock);
 
 		drbd_send_ack_dp(mdev, P_NEG_ACK, p, data_size);
+		if (!drbd_drain_block(mdev, ds->socket, data_size))
+			return false;
+		if (drbd_wait_data_seq(mdev, seq))
+			return false;
 		atomic_inc(&mdev->current_epoch->epoch_size);
-		return drbd_drain_block(mdev, data_size);
+		drbd_data_seq_done(mdev, seq);
+		return true;
 	}
 
 	/* get_ldev(mdev) successful.
@@ -1673,12 +1856,20 @@ static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 	 * the end of this function. */
 
 	sector = be64_to_cpu(p->sector);
-	e = read_in_block(mdev, p->block_id, sector, data_size);
+	e = read_in_block(mdev, ds->socket, p->block_id, sector, data_size);
 	if (!e) {
 		put_ldev(mdev);
 		return false;
 	}
 
+	/* the payload was read in parallel to the other data streams,
+	 * the rest is done in order */
+	if (drbd_wait_data_seq(mdev, seq) || drbd_beyond_capacity(mdev, e)) {
+		put_ldev(mdev);
+		drbd_free_ee(mdev, e);
+		return false;
+	}
+
 	e->w.cb = e_end_block;
 
 	dp_flags = be32_to_cpu(p->dp_flags);
@@ -1702,20 +1893,16 @@ static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 		const int size = e->size;
 		const int discard = test_bit(DISCARD_CONCURRENT, &mdev->flags);
 		DEFINE_WAIT(wait);
-		struct drbd_request *i;
-		struct hlist_node *n;
-		struct hlist_head *slot;
+		struct drbd_interval *i;
 		int first;
 
 		D_ASSERT(mdev->net_conf->wire_protocol == DRBD_PROT_C);
-		BUG_ON(mdev->ee_hash == NULL);
-		BUG_ON(mdev->tl_hash == NULL);
 
 		/* conflict detection and handling:
 		 * 1. wait on the sequence number,
 		 *    in case this data packet overtook ACK packets.
-		 * 2. check our hash tables for conflicting requests.
-		 *    we only need to walk the tl_hash, since an ee can not
+		 * 2. check our interval trees for conflicting requests.
+		 *    we only need to search write_requests, since an ee can not
 		 *    have a conflict with an other ee: on the submitting
 		 *    node, the corresponding req had already been conflicting,
 		 *    and a conflicting req is never sent.
@@ -1724,7 +1911,7 @@ static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 		 * so there cannot be any request that is DONE
 		 * but still on the transfer log.
 		 *
-		 * unconditionally add to the ee_hash.
+		 * unconditionally add to the epoch_entries tree.
 		 *
 		 * if no conflicting request is found:
 		 *    submit.
@@ -1745,37 +1932,35 @@ static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 		 *
 		 *	 then proceed normally, i.e. submit.
 		 */
-		if (drbd_wait_peer_seq(mdev, be32_to_cpu(p->seq_num)))
+		if (drbd_wait_peer_seq(mdev, seq))
 			goto out_interrupted;
 
 		spin_lock_irq(&mdev->req_lock);
 
-		hlist_add_head(&e->collision, ee_hash_slot(mdev, sector));
+		drbd_insert_interval(&mdev->epoch_entries, &e->i);
 
-#define OVERLAPS overlaps(i->sector, i->size, sector, size)
-		slot = tl_hash_slot(mdev, sector);
 		first = 1;
 		for (;;) {
 			int have_unacked = 0;
 			int have_conflict = 0;
 			prepare_to_wait(&mdev->misc_wait, &wait,
 				TASK_INTERRUPTIBLE);
-			hlist_for_each_entry(i, n, slot, collision) {
-				if (OVERLAPS) {
-					/* only ALERT on first iteration,
-					 * we may be woken up early... */
-					if (first)
-						dev_alert(DEV, "%s[%u] Concurrent local write detected!"
-						      "	new: %llus +%u; pending: %llus +%u\n",
-						      current->comm, current->pid,
-						      (unsigned long long)sector, size,
-						      (unsigned long long)i->sector, i->size);
-					if (i->rq_state & RQ_NET_PENDING)
-						++have_unacked;
-					++have_conflict;
-				}
+			drbd_for_each_overlap(i, &mdev->write_requests, sector, size) {
+				struct drbd_request *req =
+					container_of(i, struct drbd_request, i);
+
+				/* only ALERT on first iteration,
+				 * we may be woken up early... */
+				if (first)
+					dev_alert(DEV, "%s[%u] Concurrent local write detected!"
+					      "	new: %llus +%u; pending: %llus +%u\n",
+					      current->comm, current->pid,
+					      (unsigned long long)sector, size,
+					      (unsigned long long)i->sector, i->size);
+				if (req->rq_state & RQ_NET_PENDING)
+					++have_unacked;
+				++have_conflict;
 			}
-#undef OVERLAPS
 			if (!have_conflict)
 				break;
 
@@ -1799,7 +1984,7 @@ static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 			}
 
 			if (signal_pending(current)) {
-				hlist_del_init(&e->collision);
+				drbd_remove_interval(&mdev->epoch_entries, &e->i);
 
 				spin_unlock_irq(&mdev->req_lock);
 
@@ -1850,14 +2035,17 @@ static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned
 		drbd_al_begin_io(mdev, e->sector);
 	}
 
-	if (drbd_submit_ee(mdev, e, rw, DRBD_FAULT_DT_WR) == 0)
+	if (drbd_submit_ee(mdev, e, rw, DRBD_FAULT_DT_WR) == 0) {
+		drbd_data_seq_done(mdev, seq);
 		return true;
+	}
 
 	/* don't care for the reason here */
 	dev_err(DEV, "submit failed, triggering re-connect\n");
 	spin_lock_irq(&mdev->req_lock);
 	list_del(&e->w.list);
-	hlist_del_init(&e->collision);
+	if (!drbd_interval_empty(&e->i))
+		drbd_remove_interval(&mdev->epoch_entries, &e->i);
 	spin_unlock_irq(&mdev->req_lock);
 	if (e->flags & EE_CALL_AL_COMPLETE_IO)
 		drbd_al_complete_io(mdev, e->sector);
@@ -1869,6 +2057,11 @@ out_interrupted:
 	return false;
 }
 
+static int receive_Data(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
+{
+	return _receive_Data(mdev, &mdev->data, data_size);
+}
+
 /* We may throttle resync, if the lower device seems to be busy,
  * and current sync rate is above c_min_rate.
  *
@@ -1985,7 +2178,7 @@ static int receive_DataRequest(struct drbd_conf *mdev, enum drbd_packets cmd, un
 			    "no local data.\n");
 
 		/* drain possibly payload */
-		return drbd_drain_block(mdev, digest_size);
+		return drbd_drain_block(mdev, mdev->data.socket, digest_size);
 	}
 
 	/* GFP_NOIO, because we must not cause arbitrary write-out: in a DRBD
@@ -1997,6 +2190,9 @@ static int receive_DataRequest(struct drbd_conf *mdev, enum drbd_packets cmd, un
 		return false;
 	}
 
+	if (cmd != P_DATA_REQUEST)
+		e->flags |= EE_RS_READ;
+
 	switch (cmd) {
 	case P_DATA_REQUEST:
 		e->w.cb = w_e_end_data_req;
@@ -3613,6 +3809,13 @@ static int receive_UnplugRemote(struct drbd_conf *mdev, enum drbd_packets cmd, u
 	return true;
 }
 
+static int receive_DataFence(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
+{
+	struct p_data_fence *p = &mdev->data.rbuf.data_fence;
+
+	return drbd_wait_data_fence(mdev, be32_to_cpu(p->seq_num)) == 0;
+}
+
 static int receive_out_of_sync(struct drbd_conf *mdev, enum drbd_packets cmd, unsigned int data_size)
 {
 	struct p_block_desc *p = &mdev->data.rbuf.block_desc;
@@ -3663,6 +3866,7 @@ static struct data_cmd drbd_cmd_handler[] = {
 	[P_CSUM_RS_REQUEST] = { 1, sizeof(struct p_block_req), receive_DataRequest },
 	[P_DELAY_PROBE]     = { 0, sizeof(struct p_delay_probe93), receive_skip },
 	[P_OUT_OF_SYNC]     = { 0, sizeof(struct p_block_desc), receive_out_of_sync },
+	[P_DATA_FENCE]      = { 0, sizeof(struct p_data_fence), receive_DataFence },
 	/* anything missing from this table is in
 	 * the asender_tbl, see get_asender_cmd */
 	[P_MAX_CMD]	    = { 0, 0, NULL },
@@ -3728,42 +3932,20 @@ static void drbdd(struct drbd_conf *mdev)
 
 void drbd_flush_workqueue(struct drbd_conf *mdev)
 {
-	struct drbd_wq_barrier barr;
+	struct drbd_wq_barrier barr, rs_barr;
+	int rs = get_t_state(&mdev->rs_worker) == Running;
 
 	barr.w.cb = w_prev_work_done;
 	init_completion(&barr.done);
 	drbd_queue_work(&mdev->data.work, &barr.w);
-	wait_for_completion(&barr.done);
-}
-
-void drbd_free_tl_hash(struct drbd_conf *mdev)
-{
-	struct hlist_head *h;
-
-	spin_lock_irq(&mdev->req_lock);
-
-	if (!mdev->tl_hash || mdev->state.conn != C_STANDALONE) {
-		spin_unlock_irq(&mdev->req_lock);
-		return;
+	if (rs) {
+		rs_barr.w.cb = w_prev_work_done;
+		init_completion(&rs_barr.done);
+		drbd_queue_work(&mdev->rs_queue, &rs_barr.w);
 	}
-	/* paranoia code */
-	for (h = mdev->ee_hash; h < mdev->ee_hash + mdev->ee_hash_s; h++)
-		if (h->first)
-			dev_err(DEV, "ASSERT FAILED ee_hash[%u].first == %p, expected NULL\n",
-				(int)(h - mdev->ee_hash), h->first);
-	kfree(mdev->ee_hash);
-	mdev->ee_hash = NULL;
-	mdev->ee_hash_s = 0;
-
-	/* paranoia code */
-	for (h = mdev->tl_hash; h < mdev->tl_hash + mdev->tl_hash_s; h++)
-		if (h->first)
-			dev_err(DEV, "ASSERT FAILED tl_hash[%u] == %p, expected NULL\n",
-				(int)(h - mdev->tl_hash), h->first);
-	kfree(mdev->tl_hash);
-	mdev->tl_hash = NULL;
-	mdev->tl_hash_s = 0;
-	spin_unlock_irq(&mdev->req_lock);
+	wait_for_completion(&barr.done);
+	if (rs)
+		wait_for_completion(&rs_barr.done);
 }
 
 static void drbd_disconnect(struct drbd_conf *mdev)
@@ -3778,7 +3960,10 @@ static void drbd_disconnect(struct drbd_conf *mdev)
 
 	/* asender does not clean up anything. it must not interfere, either */
 	drbd_thread_stop(&mdev->asender);
+	for (i = 0; i < DRBD_MAX_DATA_STREAMS; i++)
+		drbd_thread_stop(&mdev->stream_receiver[i]);
 	drbd_free_sock(mdev);
+	mdev->nr_streams = 0;
 
 	/* wait for current activity to cease. */
 	spin_lock_irq(&mdev->req_lock);
@@ -3889,6 +4074,28 @@ static void drbd_disconnect(struct drbd_conf *mdev)
 	D_ASSERT(list_empty(&mdev->current_epoch->list));
 }
 
+/* How many data streams we offer in the handshake; the peer may want less.
+ * Not with two primaries: conflict detection relies on P_DATA and the acks
+ * being received in order.  Not with data integrity checking, which shares
+ * one digest buffer per direction.  Not with a shared secret: drbd_do_auth()
+ * only authenticates the data and meta sockets.  And only with protocol C,
+ * where a write completes only after the peer wrote it, so no later request
+ * on the data socket can overtake it.  Every stream reader waiting for its
+ * turn holds the pages of up to one bio; they must not use up max_buffers. */
+static unsigned int drbd_data_streams_wanted(struct drbd_conf *mdev)
+{
+	struct net_conf *nc = mdev->net_conf;
+	unsigned int n;
+
+	if (nc->two_primaries || nc->integrity_alg[0] || mdev->cram_hmac_tfm ||
+	    nc->wire_protocol != DRBD_PROT_C)
+		return 0;
+
+	n = min_t(unsigned int, data_streams, DRBD_MAX_DATA_STREAMS);
+	return min_t(unsigned int, n,
+		     (nc->max_buffers - 1) / (DRBD_MAX_BIO_SIZE >> PAGE_SHIFT));
+}
+
 /*
  * We support PRO_VERSION_MIN to PRO_VERSION_MAX. The protocol version
  * we can agree on is stored in agreed_pro_version.
@@ -3917,6 +4124,7 @@ static int drbd_send_handshake(struct drbd_conf *mdev)
 	memset(p, 0, sizeof(*p));
 	p->protocol_min = cpu_to_be32(PRO_VERSION_MIN);
 	p->protocol_max = cpu_to_be32(PRO_VERSION_MAX);
+	p->data_streams = cpu_to_be32(drbd_data_streams_wanted(mdev));
 	ok = _drbd_send_cmd( mdev, mdev->data.socket, P_HAND_SHAKE,
 			     (struct p_header80 *)p, sizeof(*p), 0 );
 	mutex_unlock(&mdev->data.mutex);
@@ -3978,8 +4186,14 @@ static int drbd_do_handshake(struct drbd_conf *mdev)
 
 	mdev->agreed_pro_version = min_t(int, PRO_VERSION_MAX, p->protocol_max);
 
+	/* peers not knowing about data streams send zero here */
+	mdev->nr_streams = min_t(unsigned int, drbd_data_streams_wanted(mdev),
+				 be32_to_cpu(p->data_streams));
+
 	dev_info(DEV, "Handshake successful: "
 	     "Agreed network protocol version %d\n", mdev->agreed_pro_version);
+	if (mdev->nr_streams)
+		dev_info(DEV, "Using %u additional data streams\n", mdev->nr_streams);
 
 	return 1;
 
@@ -4187,6 +4401,52 @@ int drbdd_init(struct drbd_thread *thi)
 	return 0;
 }
 
+/* Receiver of one data stream.  Only P_DATA is sent on these; the payload is
+ * read in parallel with the other streams, _receive_Data() puts the writes
+ * back in order.  Stopped by drbd_disconnect(). */
+int drbd_stream_receiver(struct drbd_thread *thi)
+{
+	struct drbd_conf *mdev = thi->mdev;
+	const unsigned int i = thi - mdev->stream_receiver;
+	struct drbd_socket *ds = &mdev->streams[i];
+	const size_t shs = sizeof(struct p_data) - sizeof(union p_header);
+	unsigned int packet_size;
+	enum drbd_packets cmd;
+	int rv;
+
+	sprintf(current->comm, "drbd%d_stream%u", mdev_to_minor(mdev), i);
+
+	while (get_t_state(thi) == Running) {
+		if (!_drbd_recv_header(mdev, ds, &cmd, &packet_size))
+			goto err_out;
+
+		if (cmd != P_DATA || packet_size < shs) {
+			dev_err(DEV, "unexpected %s on data stream %u, l: %d!\n",
+			    cmdname(cmd), i, packet_size);
+			goto err_out;
+		}
+
+		rv = drbd_recv_sock(mdev, ds->socket, &ds->rbuf.header.h80.payload, shs);
+		if (unlikely(rv != shs)) {
+			if (!signal_pending(current))
+				dev_warn(DEV, "short read while reading sub header: rv=%d\n", rv);
+			goto err_out;
+		}
+
+		if (unlikely(!_receive_Data(mdev, ds, packet_size - shs))) {
+			dev_err(DEV, "error receiving %s on data stream %u, l: %d!\n",
+			    cmdname(cmd), i, packet_size);
+			goto err_out;
+		}
+	}
+
+	if (0) {
+	err_out:
+		drbd_force_state(mdev, NS(conn, C_PROTOCOL_ERROR));
+	}
+	return 0;
+}
+
 /* ********* acknowledge sender ******** */
 
 static int got_RqSReply(struct drbd_conf *mdev, struct p_header80 *h)
@@ -4251,22 +4511,11 @@ static int got_IsInSync(struct drbd_conf *mdev, struct p_header80 *h)
 static struct drbd_request *_ack_id_to_req(struct drbd_conf *mdev,
 	u64 id, sector_t sector)
 {
-	struct hlist_head *slot = tl_hash_slot(mdev, sector);
-	struct hlist_node *n;
-	struct drbd_request *req;
+	struct drbd_request *req = (struct drbd_request *)(unsigned long)id;
 
-	hlist_for_each_entry(req, n, slot, collision) {
-		if ((unsigned long)req == (unsigned long)id) {
-			if (req->sector != sector) {
-				dev_err(DEV, "_ack_id_to_req: found req %p but it has "
-				    "wrong sector (%llus versus %llus)\n", req,
-				    (unsigned long long)req->sector,
-				    (unsigned long long)sector);
-				break;
-			}
-			return req;
-		}
-	}
+	/* does not dereference req, which may be garbage */
+	if (drbd_contains_interval(&mdev->write_requests, sector, &req->i))
+		return req;
 	return NULL;
 }
 
@@ -4361,7 +4610,7 @@ static int got_NegAck(struct drbd_conf *mdev, struct p_header80 *h)
 		    mdev->net_conf->wire_protocol == DRBD_PROT_B) {
 			/* Protocol A has no P_WRITE_ACKs, but has P_NEG_ACKs.
 			   The master bio might already be completed, therefore the
-			   request is no longer in the collision hash.
+			   request is no longer in the write_requests tree.
 			   => Do not try to validate block_id as request. */
 			/* In Protocol B we might already have got a P_RECV_ACK
 			   but then get a P_NEG_ACK after wards. */
@@ -135,10 +135,7 @@ static void _about_to_complete_local_write(struct drbd_conf *mdev,
 	struct drbd_request *req)
 {
 	const unsigned long s = req->rq_state;
-	struct drbd_request *i;
-	struct drbd_epoch_entry *e;
-	struct hlist_node *n;
-	struct hlist_head *slot;
+	struct drbd_interval *i;
 
 	/* Before we can signal completion to the upper layers,
 	 * we may need to close the current epoch.
@@ -152,24 +149,21 @@ static void _about_to_complete_local_write(struct drbd_conf *mdev,
 		queue_barrier(mdev);
 
 	/* we need to do the conflict detection stuff,
-	 * if we have the ee_hash (two_primaries) and
+	 * if there are epoch entries (two_primaries) and
 	 * this has been on the network */
-	if ((s & RQ_NET_DONE) && mdev->ee_hash != NULL) {
+	if ((s & RQ_NET_DONE) && !RB_EMPTY_ROOT(&mdev->epoch_entries)) {
 		const sector_t sector = req->sector;
 		const int size = req->size;
 
 		/* ASSERT:
 		 * there must be no conflicting requests, since
 		 * they must have been failed on the spot */
-#define OVERLAPS overlaps(sector, size, i->sector, i->size)
-		slot = tl_hash_slot(mdev, sector);
-		hlist_for_each_entry(i, n, slot, collision) {
-			if (OVERLAPS) {
-				dev_alert(DEV, "LOGIC BUG: completed: %p %llus +%u; "
-				      "other: %p %llus +%u\n",
-				      req, (unsigned long long)sector, size,
-				      i, (unsigned long long)i->sector, i->size);
-			}
+		drbd_for_each_overlap(i, &mdev->write_requests, sector, size) {
+			dev_alert(DEV, "LOGIC BUG: completed: %p %llus +%u; "
+			      "other: %p %llus +%u\n",
+			      req, (unsigned long long)sector, size,
+			      container_of(i, struct drbd_request, i),
+			      (unsigned long long)i->sector, i->size);
 		}
 
 		/* maybe "wake" those conflicting epoch entries
@@ -184,17 +178,9 @@ static void _about_to_complete_local_write(struct drbd_conf *mdev,
 		 *
 		 * anyways, if we found one,
 		 * we just have to do a wake_up.  */
-#undef OVERLAPS
-#define OVERLAPS overlaps(sector, size, e->sector, e->size)
-		slot = ee_hash_slot(mdev, req->sector);
-		hlist_for_each_entry(e, n, slot, collision) {
-			if (OVERLAPS) {
-				wake_up(&mdev->misc_wait);
-				break;
-			}
-		}
+		if (drbd_find_overlap(&mdev->epoch_entries, sector, size))
+			wake_up(&mdev->misc_wait);
 	}
-#undef OVERLAPS
 }
 
 void complete_master_bio(struct drbd_conf *mdev,
@@ -259,9 +245,10 @@ void _req_may_be_done(struct drbd_request *req, struct bio_and_error *m)
 		int error = PTR_ERR(req->private_bio);
 
 		/* remove the request from the conflict detection
-		 * respective block_id verification hash */
-		if (!hlist_unhashed(&req->collision))
-			hlist_del(&req->collision);
+		 * respective block_id verification tree */
+		if (!drbd_interval_empty(&req->i))
+			drbd_remove_interval(rw == WRITE ? &mdev->write_requests
+						: &mdev->read_requests, &req->i);
 		else
 			D_ASSERT((s & (RQ_NET_MASK & ~RQ_NET_DONE)) == 0);
 
@@ -315,8 +302,8 @@ static void _req_may_be_done_not_susp(struct drbd_request *req, struct bio_and_e
  * conflicting requests with local origin, and why we have to do so regardless
  * of whether we allowed multiple primaries.
  *
- * BTW, in case we only have one primary, the ee_hash is empty anyways, and the
- * second hlist_for_each_entry becomes a noop. This is even simpler than to
+ * BTW, in case we only have one primary, the epoch_entries tree is empty
+ * anyways, and the second lookup finds nothing. This is even simpler than to
  * grab a reference on the net_conf, and check for the two_primaries flag...
  */
 static int _req_conflicts(struct drbd_request *req)
@@ -324,56 +311,36 @@ static int _req_conflicts(struct drbd_request *req)
 	struct drbd_conf *mdev = req->mdev;
 	const sector_t sector = req->sector;
 	const int size = req->size;
-	struct drbd_request *i;
-	struct drbd_epoch_entry *e;
-	struct hlist_node *n;
-	struct hlist_head *slot;
+	struct drbd_interval *i;
 
-	D_ASSERT(hlist_unhashed(&req->collision));
+	D_ASSERT(drbd_interval_empty(&req->i));
 
 	if (!get_net_conf(mdev))
 		return 0;
 
-	/* BUG_ON */
-	ERR_IF (mdev->tl_hash_s == 0)
-		goto out_no_conflict;
-	BUG_ON(mdev->tl_hash == NULL);
-
-#define OVERLAPS overlaps(i->sector, i->size, sector, size)
-	slot = tl_hash_slot(mdev, sector);
-	hlist_for_each_entry(i, n, slot, collision) {
-		if (OVERLAPS) {
-			dev_alert(DEV, "%s[%u] Concurrent local write detected! "
-			      "[DISCARD L] new: %llus +%u; "
-			      "pending: %llus +%u\n",
-			      current->comm, current->pid,
-			      (unsigned long long)sector, size,
-			      (unsigned long long)i->sector, i->size);
-			goto out_conflict;
-		}
+	i = drbd_find_overlap(&mdev->write_requests, sector, size);
+	if (i) {
+		dev_alert(DEV, "%s[%u] Concurrent local write detected! "
+		      "[DISCARD L] new: %llus +%u; "
+		      "pending: %llus +%u\n",
+		      current->comm, current->pid,
+		      (unsigned long long)sector, size,
+		      (unsigned long long)i->sector, i->size);
+		goto out_conflict;
 	}
 
-	if (mdev->ee_hash_s) {
-		/* now, check for overlapping requests with remote origin */
-		BUG_ON(mdev->ee_hash == NULL);
-#undef OVERLAPS
-#define OVERLAPS overlaps(e->sector, e->size, sector, size)
-		slot = ee_hash_slot(mdev, sector);
-		hlist_for_each_entry(e, n, slot, collision) {
-			if (OVERLAPS) {
-				dev_alert(DEV, "%s[%u] Concurrent remote write detected!"
-				      " [DISCARD L] new: %llus +%u; "
-				      "pending: %llus +%u\n",
-				      current->comm, current->pid,
-				      (unsigned long long)sector, size,
-				      (unsigned long long)e->sector, e->size);
-				goto out_conflict;
-			}
-		}
+	/* now, check for overlapping requests with remote origin */
+	i = drbd_find_overlap(&mdev->epoch_entries, sector, size);
+	if (i) {
+		dev_alert(DEV, "%s[%u] Concurrent remote write detected!"
+		      " [DISCARD L] new: %llus +%u; "
+		      "pending: %llus +%u\n",
+		      current->comm, current->pid,
+		      (unsigned long long)sector, size,
+		      (unsigned long long)i->sector, i->size);
+		goto out_conflict;
 	}
-#undef OVERLAPS
 
-out_no_conflict:
 	/* this is like it should be, and what we expected.
 	 * our users do behave after all... */
 	put_net_conf(mdev);
@@ -490,8 +457,8 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * or from bio_endio during read io-error recovery */
 
 		/* so we can verify the handle in the answer packet
-		 * corresponding hlist_del is in _req_may_be_done() */
-		hlist_add_head(&req->collision, ar_hash_slot(mdev, req->sector));
+		 * corresponding drbd_remove_interval is in _req_may_be_done() */
+		drbd_insert_interval(&mdev->read_requests, &req->i);
 
 		set_bit(UNPLUG_REMOTE, &mdev->flags);
 
@@ -507,8 +474,8 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		/* assert something? */
 		/* from drbd_make_request_common only */
 
-		hlist_add_head(&req->collision, tl_hash_slot(mdev, req->sector));
-		/* corresponding hlist_del is in _req_may_be_done() */
+		drbd_insert_interval(&mdev->write_requests, &req->i);
+		/* corresponding drbd_remove_interval is in _req_may_be_done() */
 
 		/* NOTE
 		 * In case the req ended up on the transfer log before being
@@ -763,16 +730,87 @@ static int drbd_may_do_local_read(struct drbd_conf *mdev, sector_t sector, int s
 	return 0 == drbd_bm_count_bits(mdev, sbnr, ebnr);
 }
 
+static int drbd_send_and_submit(struct drbd_conf *mdev, struct drbd_request *req,
+				int local, int remote);
+
+/* Park a local write until its activity log extent is ready. */
+static void drbd_queue_write(struct drbd_conf *mdev, struct drbd_request *req)
+{
+	/* tl_requests is unused until the request enters the transfer log */
+	spin_lock_irq(&mdev->al_lock);
+	list_add_tail(&req->tl_requests, &mdev->submit_list);
+	spin_unlock_irq(&mdev->al_lock);
+
+	queue_work(mdev->submit_wq, &mdev->submit_work);
+	/* in case do_submit() is waiting already */
+	wake_up(&mdev->al_wait);
+}
+
+/* Whether a parked write may go ahead now.  Never sleeps. */
+static int drbd_write_ready(struct drbd_conf *mdev, struct drbd_request *req)
+{
+	int r;
+
+	if (req->rq_state & RQ_IN_ACT_LOG)
+		return !drbd_al_pending(mdev, req->sector);
+
+	r = drbd_al_begin_io_nonblock(mdev, req->sector);
+	if (r >= 0)
+		req->rq_state |= RQ_IN_ACT_LOG;
+	return r == 0;
+}
+
+/* Sends and submits the writes drbd_make_request_common() parked, once
+ * their activity log extents are ready, waiting on al_wait meanwhile.
+ * Runs on the per-device submit_wq, so it may sleep, and the worker,
+ * which writes the AL transactions, never waits for it. */
+void do_submit(struct work_struct *ws)
+{
+	struct drbd_conf *mdev = container_of(ws, struct drbd_conf, submit_work);
+	LIST_HEAD(writes);
+	LIST_HEAD(ready);
+	struct drbd_request *req, *tmp;
+	DEFINE_WAIT(wait);
+
+	for (;;) {
+		prepare_to_wait(&mdev->al_wait, &wait, TASK_UNINTERRUPTIBLE);
+
+		spin_lock_irq(&mdev->al_lock);
+		list_splice_tail_init(&mdev->submit_list, &writes);
+		spin_unlock_irq(&mdev->al_lock);
+
+		list_for_each_entry_safe(req, tmp, &writes, tl_requests)
+			if (drbd_write_ready(mdev, req))
+				list_move_tail(&req->tl_requests, &ready);
+
+		if (list_empty(&ready)) {
+			if (list_empty(&writes))
+				break;
+			schedule();
+			continue;
+		}
+		finish_wait(&mdev->al_wait, &wait);
+
+		list_for_each_entry_safe(req, tmp, &ready, tl_requests) {
+			struct bio *bio = req->master_bio;
+
+			list_del_init(&req->tl_requests);
+			/* only local writes get parked */
+			if (drbd_send_and_submit(mdev, req, 1, 1))
+				generic_make_request(bio);
+		}
+	}
+	finish_wait(&mdev->al_wait, &wait);
+}
+
 static int drbd_make_request_common(struct drbd_conf *mdev, struct bio *bio, unsigned long start_time)
 {
 	const int rw = bio_rw(bio);
 	const int size = bio->bi_size;
 	const sector_t sector = bio->bi_sector;
-	struct drbd_tl_epoch *b = NULL;
 	struct drbd_request *req;
-	int local, remote, send_oos = 0;
+	int local, remote;
 	int err = -EIO;
-	int ret = 0;
 
 	/* allocate outside of all locks; */
 	req = drbd_req_new(mdev, bio);
@@ -825,14 +863,51 @@ static int drbd_make_request_common(struct drbd_conf *mdev, struct bio *bio, uns
 	}
 
 	/* For WRITES going to the local disk, grab a reference on the target
-	 * extent.  This waits for any resync activity in the corresponding
-	 * resync extent to finish, and, if necessary, pulls in the target
-	 * extent into the activity log, which involves further disk io because
-	 * of transactional on-disk meta data updates. */
+	 * extent.  If there is resync activity in the corresponding resync
+	 * extent, or the target extent needs to be pulled into the activity
+	 * log, which involves further disk io because of transactional on-disk
+	 * meta data updates, do not wait for that here: park the request, and
+	 * let do_submit() send it on once its extent is ready. */
 	if (rw == WRITE && local && !test_bit(AL_SUSPENDED, &mdev->flags)) {
-		req->rq_state |= RQ_IN_ACT_LOG;
-		drbd_al_begin_io(mdev, sector);
+		int r = drbd_al_begin_io_nonblock(mdev, sector);
+
+		if (r >= 0)
+			req->rq_state |= RQ_IN_ACT_LOG;
+		if (r) {
+			drbd_queue_write(mdev, req);
+			return 0;
+		}
+	}
+
+	return drbd_send_and_submit(mdev, req, local, remote);
+
+fail_and_free_req:
+	if (local) {
+		bio_put(req->private_bio);
+		req->private_bio = NULL;
+		put_ldev(mdev);
 	}
+	bio_endio(bio, err);
+	drbd_req_free(req);
+	dec_ap_bio(mdev);
+
+	return 0;
+}
+
+/* Second half of drbd_make_request_common(), for requests that hold their
+ * activity log reference, if they need one.  Returns 1 if the bio should
+ * be retried, like drbd_make_request(). */
+static int drbd_send_and_submit(struct drbd_conf *mdev, struct drbd_request *req,
+				int local, int remote)
+{
+	struct bio *bio = req->master_bio;
+	const int rw = bio_rw(bio);
+	const int size = req->size;
+	const sector_t sector = req->sector;
+	struct drbd_tl_epoch *b = NULL;
+	int send_oos = 0;
+	int err = -EIO;
+	int ret = 0;
 
 	remote = remote && drbd_should_do_remote(mdev->state);
 	send_oos = rw == WRITE && drbd_should_send_oos(mdev->state);
@@ -945,7 +1020,7 @@ allocate_barrier:
 	if (local)
 		_req_mod(req, to_be_submitted);
 
-	/* check this request on the collision detection hash tables.
+	/* check this request on the collision detection trees.
 	 * if we have a conflict, just complete it here.
 	 * THINK do we want to check reads, too? (I don't think so...) */
 	if (rw == WRITE && _req_conflicts(req))
@@ -1035,7 +1110,6 @@ fail_conflicting:
 fail_free_complete:
 	if (req->rq_state & RQ_IN_ACT_LOG)
 		drbd_al_complete_io(mdev, sector);
-fail_and_free_req:
 	if (local) {
 		bio_put(req->private_bio);
 		req->private_bio = NULL;
@@ -1093,8 +1167,8 @@ int drbd_make_request(struct request_queue *q, struct bio *bio)
 	D_ASSERT((bio->bi_size & 0x1ff) == 0);
 	D_ASSERT(bio->bi_idx == 0);
 
-	/* to make some things easier, force alignment of requests within the
-	 * granularity of our hash tables */
+	/* to make some things easier, force alignment of requests within
+	 * DRBD_MAX_BIO_SIZE, which keeps them within one activity log extent */
 	s_enr = bio->bi_sector >> HT_SHIFT;
 	e_enr = (bio->bi_sector+(bio->bi_size>>9)-1) >> HT_SHIFT;
 
@@ -1115,7 +1189,7 @@ int drbd_make_request(struct request_queue *q, struct bio *bio)
 	} else {
 		/* This bio crosses some boundary, so we have to split it. */
 		struct bio_pair *bp;
-		/* works for the "do not cross hash slot boundaries" case
+		/* works for the "do not cross DRBD_MAX_BIO_SIZE boundaries" case
 		 * e.g. sector 262269, size 4096
 		 * s_enr = 262269 >> 6 = 4097
 		 * e_enr = (262269+8-1) >> 6 = 4098
@@ -96,7 +96,8 @@ void drbd_endio_read_sec_final(struct drbd_epoch_entry *e) __releases(local)
 		__drbd_chk_io_error(mdev, false);
 	spin_unlock_irqrestore(&mdev->req_lock, flags);
 
-	drbd_queue_work(&mdev->data.work, &e->w);
+	drbd_queue_work(e->flags & EE_RS_READ ? &mdev->rs_queue : &mdev->data.work,
+			&e->w);
 	put_ldev(mdev);
 }
 
@@ -126,7 +127,7 @@ static void drbd_endio_write_sec_final(struct drbd_epoch_entry *e) __releases(lo
 	list_del(&e->w.list); /* has been on active_ee or sync_ee */
 	list_add_tail(&e->w.list, &mdev->done_ee);
 
-	/* No hlist_del_init(&e->collision) here, we did not send the Ack yet,
+	/* No drbd_remove_interval(&e->i) here, we did not send the Ack yet,
 	 * neither did we wake possibly waiting conflicting requests.
 	 * done from "drbd_process_done_ee" within the appropriate w.cb
 	 * (e_end_block/e_end_resync_block) or from _drbd_clear_done_ee */
@@ -364,6 +365,7 @@ static int read_for_csum(struct drbd_conf *mdev, sector_t sector, int size)
 		goto defer;
 
 	e->w.cb = w_e_send_csum;
+	e->flags |= EE_RS_READ;
 	spin_lock_irq(&mdev->req_lock);
 	list_add(&e->w.list, &mdev->read_ee);
 	spin_unlock_irq(&mdev->req_lock);
@@ -405,7 +407,7 @@ void resync_timer_fn(unsigned long data)
 	struct drbd_conf *mdev = (struct drbd_conf *) data;
 
 	if (list_empty(&mdev->resync_work.list))
-		drbd_queue_work(&mdev->data.work, &mdev->resync_work);
+		drbd_queue_work(&mdev->rs_queue, &mdev->resync_work);
 }
 
 static void fifo_set(struct fifo_buffer *fb, int value)
@@ -772,7 +774,7 @@ int drbd_resync_finished(struct drbd_conf *mdev)
 	 * resync LRU would be wrong. */
 	if (drbd_rs_del_all(mdev)) {
 		/* In case this is not possible now, most probably because
-		 * there are P_RS_DATA_REPLY Packets lingering on the worker's
+		 * there are P_RS_DATA_REPLY Packets lingering on the rs_worker's
 		 * queue (or even the read operations for those packets
 		 * is not finished by now).   Retry in 100ms. */
 
@@ -780,7 +782,7 @@ int drbd_resync_finished(struct drbd_conf *mdev)
 		w = kmalloc(sizeof(struct drbd_work), GFP_ATOMIC);
 		if (w) {
 			w->cb = w_resync_finished;
-			drbd_queue_work(&mdev->data.work, w);
+			drbd_queue_work(&mdev->rs_queue, w);
 			return 1;
 		}
 		dev_err(DEV, "Warn failed to drbd_rs_del_all() and to kmalloc(w).\n");
@@ -973,11 +975,6 @@ int w_e_end_rsdata_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 		return 1;
 	}
 
-	if (get_ldev_if_state(mdev, D_FAILED)) {
-		drbd_rs_complete_io(mdev, e->sector);
-		put_ldev(mdev);
-	}
-
 	if (mdev->state.conn == C_AHEAD) {
 		ok = drbd_send_ack(mdev, P_RS_CANCEL, e);
 	} else if (likely((e->flags & EE_WAS_ERROR) == 0)) {
@@ -1001,6 +998,14 @@ int w_e_end_rsdata_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 		drbd_rs_failed_io(mdev, e->sector, e->size);
 	}
 
+	/* Only now that the reply is on the data socket: this runs on the
+	 * rs_worker, and a write to this extent, sent by the worker, must not
+	 * overtake the resync data. */
+	if (get_ldev_if_state(mdev, D_FAILED)) {
+		drbd_rs_complete_io(mdev, e->sector);
+		put_ldev(mdev);
+	}
+
 	dec_unacked(mdev);
 
 	move_to_net_ee_or_free(mdev, e);
@@ -1024,11 +1029,6 @@ int w_e_end_csum_rs_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 		return 1;
 	}
 
-	if (get_ldev(mdev)) {
-		drbd_rs_complete_io(mdev, e->sector);
-		put_ldev(mdev);
-	}
-
 	di = e->digest;
 
 	if (likely((e->flags & EE_WAS_ERROR) == 0)) {
@@ -1064,6 +1064,12 @@ int w_e_end_csum_rs_req(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 			dev_err(DEV, "Sending NegDReply. I guess it gets messy.\n");
 	}
 
+	/* after the reply, see w_e_end_rsdata_req() */
+	if (get_ldev(mdev)) {
+		drbd_rs_complete_io(mdev, e->sector);
+		put_ldev(mdev);
+	}
+
 	dec_unacked(mdev);
 	move_to_net_ee_or_free(mdev, e);
 
@@ -1225,6 +1231,9 @@ int w_send_barrier(struct drbd_conf *mdev, struct drbd_work *w, int cancel)
 	if (!drbd_get_data_sock(mdev))
 		return 0;
 	p->barrier = b->br_number;
+	/* P_BARRIER is numbered along with P_DATA, see drbd_send_dblock() */
+	p->seq_num = mdev->nr_streams ? cpu_to_be32(++mdev->data_seq) : 0;
+	clear_bit(DATA_FENCE, &mdev->flags);
 	/* inc_ap_pending was done where this was queued.
 	 * dec_ap_pending will be done in got_BarrierAck
 	 * or (on connection loss) in w_clear_epoch.  */
@@ -1613,12 +1622,82 @@ void drbd_start_resync(struct drbd_conf *mdev, enum drbd_conns side)
 	drbd_state_unlock(mdev);
 }
 
+/* Calls the callbacks of all work left on q with cancel set.  Only once
+ * the thread serving q is gone. */
+static void drbd_cancel_work(struct drbd_conf *mdev, struct drbd_work_queue *q)
+{
+	struct drbd_work *w;
+	LIST_HEAD(work_list);
+
+	spin_lock_irq(&q->q_lock);
+	while (!list_empty(&q->q)) {
+		list_splice_init(&q->q, &work_list);
+		spin_unlock_irq(&q->q_lock);
+
+		while (!list_empty(&work_list)) {
+			w = list_entry(work_list.next, struct drbd_work, list);
+			list_del_init(&w->list);
+			w->cb(mdev, w, 1);
+		}
+
+		spin_lock_irq(&q->q_lock);
+	}
+	sema_init(&q->s, 0);
+	/* DANGEROUS race: if someone did queue his work within the spinlock,
+	 * but up() ed outside the spinlock, we could get an up() on the
+	 * semaphore without corresponding list entry.
+	 * So don't do that.
+	 */
+	spin_unlock_irq(&q->q_lock);
+}
+
+/* Serves mdev->rs_queue, see there.  This thread sends on the data socket
+ * too, but each packet goes out under data.mutex, and the packets of one
+ * resync or verify request still go out in order.  It runs with a lower
+ * priority than the worker, and is not bound to the device's CPU, so that
+ * checksumming can go on elsewhere. */
+int drbd_rs_worker(struct drbd_thread *thi)
+{
+	struct drbd_conf *mdev = thi->mdev;
+	struct drbd_work *w;
+
+	sprintf(current->comm, "drbd%d_rs_worker", mdev_to_minor(mdev));
+	set_user_nice(current, 5);
+
+	while (get_t_state(thi) == Running) {
+		if (down_interruptible(&mdev->rs_queue.s)) {
+			flush_signals(current);
+			continue;
+		}
+
+		if (get_t_state(thi) != Running)
+			break;
+		/* Like in drbd_worker(), the worker cleans up after us. */
+
+		spin_lock_irq(&mdev->rs_queue.q_lock);
+		ERR_IF(list_empty(&mdev->rs_queue.q)) {
+			spin_unlock_irq(&mdev->rs_queue.q_lock);
+			continue;
+		}
+		w = list_entry(mdev->rs_queue.q.next, struct drbd_work, list);
+		list_del_init(&w->list);
+		spin_unlock_irq(&mdev->rs_queue.q_lock);
+
+		if (!w->cb(mdev, w, mdev->state.conn < C_CONNECTED)) {
+			if (mdev->state.conn >= C_CONNECTED)
+				drbd_force_state(mdev,
+						NS(conn, C_NETWORK_FAILURE));
+		}
+	}
+
+	return 0;
+}
+
 int drbd_worker(struct drbd_thread *thi)
 {
 	struct drbd_conf *mdev = thi->mdev;
 	struct drbd_work *w = NULL;
-	LIST_HEAD(work_list);
-	int intr = 0, i;
+	int intr = 0;
 
 	sprintf(current->comm, "drbd%d_worker", mdev_to_minor(mdev));
 
@@ -1684,28 +1763,10 @@ int drbd_worker(struct drbd_thread *thi)
 	D_ASSERT(test_bit(DEVICE_DYING, &mdev->flags));
 	D_ASSERT(test_bit(CONFIG_PENDING, &mdev->flags));
 
-	spin_lock_irq(&mdev->data.work.q_lock);
-	i = 0;
-	while (!list_empty(&mdev->data.work.q)) {
-		list_splice_init(&mdev->data.work.q, &work_list);
-		spin_unlock_irq(&mdev->data.work.q_lock);
-
-		while (!list_empty(&work_list)) {
-			w = list_entry(work_list.next, struct drbd_work, list);
-			list_del_init(&w->list);
-			w->cb(mdev, w, 1);
-			i++; /* dead debugging code */
-		}
-
-		spin_lock_irq(&mdev->data.work.q_lock);
-	}
-	sema_init(&mdev->data.work.s, 0);
-	/* DANGEROUS race: if someone did queue his work within the spinlock,
-	 * but up() ed outside the spinlock, we could get an up() on the
-	 * semaphore without corresponding list entry.
-	 * So don't do that.
-	 */
-	spin_unlock_irq(&mdev->data.work.q_lock);
+	/* resync work may still queue work for us */
+	drbd_thread_stop(&mdev->rs_worker);
+	drbd_cancel_work(mdev, &mdev->rs_queue);
+	drbd_cancel_work(mdev, &mdev->data.work);
 
 	D_ASSERT(mdev->state.disk == D_DISKLESS && mdev->state.conn == C_STANDALONE);
 	/* _drbd_set_state only uses stop_nowait.
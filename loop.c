@@ -75,14 +75,21 @@
 #include <linux/kthread.h>
 #include <linux/splice.h>
 #include <linux/sysfs.h>
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 #include <asm/uaccess.h>
 
+#include "loop.h"
+
 static LIST_HEAD(loop_devices);
 static DEFINE_MUTEX(loop_devices_mutex);
 
 static int max_part;
 static int part_shift;
+static bool parallel_xfer = true;
 
 /*
  * Transfer functions
@@ -186,6 +193,9 @@ figure_loop_size(struct loop_device *lo)
 	if (unlikely((loff_t)x != size))
 		return -EFBIG;
 
+	/* a trailing partial logical block is not addressable */
+	x &= ~(sector_t)((to_loop_priv(lo)->logical_block_size >> 9) - 1);
+
 	set_capacity(lo->lo_disk, x);
 	return 0;					
 }
@@ -202,14 +212,127 @@ lo_do_transfer(struct loop_device *lo, int cmd,
 	return lo->transfer(lo, cmd, rpage, roffs, lpage, loffs, size, rblock);
 }
 
+/*
+ * Parallel transfer.  Transfer functions work on independent sectors (the
+ * IV only depends on the sector number), so for multi-page bios the pages
+ * can be transformed concurrently.  Each page becomes a job on an unbound
+ * workqueue, which spreads them over all CPUs.  The submitter waits for
+ * the whole batch: before the backing write on WRITE, and after the
+ * backing read (before completing the bio) on READ.
+ */
+struct loop_xfer_batch {
+	atomic_t		pending;
+	int			error;
+	struct completion	done;
+};
+
+struct loop_xfer_job {
+	struct work_struct	work;
+	struct loop_xfer_batch	*batch;
+	struct loop_device	*lo;
+	int			cmd;
+	struct page		*raw_page;
+	unsigned		raw_off;
+	struct page		*loop_page;
+	unsigned		loop_off;
+	int			size;
+	sector_t		IV;
+};
+
+#define LOOP_XFER_POOL_MIN	64
+
+static struct workqueue_struct *loop_xfer_wq;
+static struct kmem_cache *loop_xfer_cache;
+static mempool_t *loop_xfer_pool;
+
+static inline bool loop_xfer_parallel(struct loop_device *lo, struct bio *bio)
+{
+	return parallel_xfer && lo->transfer && lo->transfer != transfer_none &&
+		bio_segments(bio) > 1;
+}
+
+static void loop_xfer_batch_init(struct loop_xfer_batch *batch)
+{
+	atomic_set(&batch->pending, 1);
+	batch->error = 0;
+	init_completion(&batch->done);
+}
+
+static void loop_xfer_batch_put(struct loop_xfer_batch *batch)
+{
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/*
+ * Drop the submitter's reference and wait for all queued jobs.  Returns
+ * the first error any job reported.
+ */
+static int loop_xfer_batch_wait(struct loop_xfer_batch *batch)
+{
+	loop_xfer_batch_put(batch);
+	wait_for_completion(&batch->done);
+	return batch->error;
+}
+
+static void loop_xfer_work(struct work_struct *work)
+{
+	struct loop_xfer_job *job = container_of(work, struct loop_xfer_job,
+						 work);
+	struct loop_xfer_batch *batch = job->batch;
+	int ret;
+
+	ret = lo_do_transfer(job->lo, job->cmd, job->raw_page, job->raw_off,
+			     job->loop_page, job->loop_off, job->size, job->IV);
+	if (unlikely(ret)) {
+		printk(KERN_ERR "loop: transfer error block %llu\n",
+		       (unsigned long long)job->IV);
+		cmpxchg(&batch->error, 0, ret > 0 ? -EIO : ret);
+	}
+
+	/* on READ the raw page is a page cache page we took a reference on */
+	if (job->cmd == READ) {
+		flush_dcache_page(job->loop_page);
+		page_cache_release(job->raw_page);
+	}
+	mempool_free(job, loop_xfer_pool);
+	loop_xfer_batch_put(batch);
+}
+
+static void loop_xfer_queue(struct loop_device *lo,
+			    struct loop_xfer_batch *batch, int cmd,
+			    struct page *rpage, unsigned roffs,
+			    struct page *lpage, unsigned loffs,
+			    int size, sector_t rblock)
+{
+	struct loop_xfer_job *job = mempool_alloc(loop_xfer_pool, GFP_NOIO);
+
+	INIT_WORK(&job->work, loop_xfer_work);
+	job->batch = batch;
+	job->lo = lo;
+	job->cmd = cmd;
+	job->raw_page = rpage;
+	job->raw_off = roffs;
+	job->loop_page = lpage;
+	job->loop_off = loffs;
+	job->size = size;
+	job->IV = rblock;
+
+	atomic_inc(&batch->pending);
+	queue_work(loop_xfer_wq, &job->work);
+}
+
 /**
  * do_lo_send_aops - helper for writing data to a loop device
  *
  * This is the fast version for backing filesystems which implement the address
- * space operations write_begin and write_end.
+ * space operations write_begin and write_end.  The caller must hold i_mutex
+ * of the backing inode, so that a whole batch of bios can share one lock
+ * round trip.  If @transformed is set, @bvec already holds the data as it
+ * goes to the backing file and is copied without running the transfer.
  */
 static int do_lo_send_aops(struct loop_device *lo, struct bio_vec *bvec,
-		loff_t pos, struct page *unused)
+		loff_t pos, bool transformed)
 {
 	struct file *file = lo->lo_backing_file; /* kudos to NFsckingS */
 	struct address_space *mapping = file->f_mapping;
@@ -217,7 +340,6 @@ static int do_lo_send_aops(struct loop_device *lo, struct bio_vec *bvec,
 	unsigned offset, bv_offs;
 	int len, ret;
 
-	mutex_lock(&mapping->host->i_mutex);
 	index = pos >> PAGE_CACHE_SHIFT;
 	offset = pos & ((pgoff_t)PAGE_CACHE_SIZE - 1);
 	bv_offs = bvec->bv_offset;
@@ -241,8 +363,12 @@ static int do_lo_send_aops(struct loop_device *lo, struct bio_vec *bvec,
 
 		file_update_time(file);
 
-		transfer_result = lo_do_transfer(lo, WRITE, page, offset,
-				bvec->bv_page, bv_offs, size, IV);
+		if (transformed)
+			transfer_result = transfer_none(lo, WRITE, page, offset,
+					bvec->bv_page, bv_offs, size, IV);
+		else
+			transfer_result = lo_do_transfer(lo, WRITE, page, offset,
+					bvec->bv_page, bv_offs, size, IV);
 		copied = size;
 		if (unlikely(transfer_result))
 			copied = 0;
@@ -263,7 +389,6 @@ static int do_lo_send_aops(struct loop_device *lo, struct bio_vec *bvec,
 	}
 	ret = 0;
 out:
-	mutex_unlock(&mapping->host->i_mutex);
 	return ret;
 fail:
 	ret = -1;
@@ -342,6 +467,106 @@ static int do_lo_send_write(struct loop_device *lo, struct bio_vec *bvec,
 	return ret;
 }
 
+/*
+ * Write one bio through the address space operations.  i_mutex of the
+ * backing inode must be held; see loop_handle_write_batch().
+ */
+static int lo_send_aops(struct loop_device *lo, struct bio *bio, loff_t pos)
+{
+	struct bio_vec *bvec;
+	int i, ret = 0;
+
+	bio_for_each_segment(bvec, bio, i) {
+		ret = do_lo_send_aops(lo, bvec, pos, false);
+		if (ret < 0)
+			break;
+		pos += bvec->bv_len;
+	}
+	return ret;
+}
+
+/*
+ * Write already transformed pages to the backing file.
+ */
+static int lo_send_transformed(struct loop_device *lo, struct bio_vec *vecs,
+			       int nr, loff_t pos)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+	int i, ret = 0;
+
+	if (lo->lo_flags & LO_FLAGS_USE_AOPS) {
+		mutex_lock(&inode->i_mutex);
+		for (i = 0; i < nr; i++) {
+			ret = do_lo_send_aops(lo, &vecs[i], pos, true);
+			if (ret < 0)
+				break;
+			pos += vecs[i].bv_len;
+		}
+		mutex_unlock(&inode->i_mutex);
+		return ret;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = __do_lo_send_write(lo->lo_backing_file,
+				kmap(vecs[i].bv_page) + vecs[i].bv_offset,
+				vecs[i].bv_len, pos);
+		kunmap(vecs[i].bv_page);
+		if (ret < 0)
+			break;
+		pos += vecs[i].bv_len;
+	}
+	return ret;
+}
+
+/*
+ * Transform a multi-page bio into bounce pages using the parallel transfer
+ * jobs, then write the result to the backing file.  Returns 1 if the bounce
+ * pages could not be set up, in which case the caller falls back to the
+ * inline transfer.
+ */
+static int lo_send_parallel(struct loop_device *lo, struct bio *bio,
+			    loff_t pos)
+{
+	struct loop_xfer_batch batch;
+	struct bio_vec *bvec, *bounce;
+	loff_t xpos = pos;
+	int i, nr = 0, ret;
+
+	bounce = kcalloc(bio_segments(bio), sizeof(*bounce), GFP_NOIO);
+	if (!bounce)
+		return 1;
+
+	loop_xfer_batch_init(&batch);
+	bio_for_each_segment(bvec, bio, i) {
+		struct page *page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+
+		if (unlikely(!page))
+			break;
+		bounce[nr].bv_page = page;
+		bounce[nr].bv_offset = 0;
+		bounce[nr].bv_len = bvec->bv_len;
+		nr++;
+		loop_xfer_queue(lo, &batch, WRITE, page, 0, bvec->bv_page,
+				bvec->bv_offset, bvec->bv_len, xpos >> 9);
+		xpos += bvec->bv_len;
+	}
+	ret = loop_xfer_batch_wait(&batch);
+
+	if (nr < bio_segments(bio))
+		ret = 1;
+	else if (!ret)
+		ret = lo_send_transformed(lo, bounce, nr, pos);
+	else
+		printk(KERN_ERR "loop: Transfer error at byte offset %llu, "
+				"length %u.\n", (unsigned long long)pos,
+				bio->bi_size);
+
+	while (nr--)
+		__free_page(bounce[nr].bv_page);
+	kfree(bounce);
+	return ret;
+}
+
 static int lo_send(struct loop_device *lo, struct bio *bio, loff_t pos)
 {
 	int (*do_lo_send)(struct loop_device *, struct bio_vec *, loff_t,
@@ -350,16 +575,29 @@ static int lo_send(struct loop_device *lo, struct bio *bio, loff_t pos)
 	struct page *page = NULL;
 	int i, ret = 0;
 
-	do_lo_send = do_lo_send_aops;
-	if (!(lo->lo_flags & LO_FLAGS_USE_AOPS)) {
-		do_lo_send = do_lo_send_direct_write;
-		if (lo->transfer != transfer_none) {
-			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page))
-				goto fail;
-			kmap(page);
-			do_lo_send = do_lo_send_write;
-		}
+	if (loop_xfer_parallel(lo, bio)) {
+		ret = lo_send_parallel(lo, bio, pos);
+		if (ret <= 0)
+			return ret;
+		/* out of memory for bounce pages, transfer inline */
+	}
+
+	if (lo->lo_flags & LO_FLAGS_USE_AOPS) {
+		struct inode *inode = lo->lo_backing_file->f_mapping->host;
+
+		mutex_lock(&inode->i_mutex);
+		ret = lo_send_aops(lo, bio, pos);
+		mutex_unlock(&inode->i_mutex);
+		return ret;
+	}
+
+	do_lo_send = do_lo_send_direct_write;
+	if (lo->transfer != transfer_none) {
+		page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page))
+			goto fail;
+		kmap(page);
+		do_lo_send = do_lo_send_write;
 	}
 	bio_for_each_segment(bvec, bio, i) {
 		ret = do_lo_send(lo, bvec, pos, page);
@@ -384,6 +622,7 @@ struct lo_read_data {
 	struct page *page;
 	unsigned offset;
 	int bsize;
+	struct loop_xfer_batch *batch;
 };
 
 static int
@@ -402,13 +641,21 @@ lo_splice_actor(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
 	if (size > p->bsize)
 		size = p->bsize;
 
-	if (lo_do_transfer(lo, READ, page, buf->offset, p->page, p->offset, size, IV)) {
-		printk(KERN_ERR "loop: transfer error block %ld\n",
-		       page->index);
-		size = -EINVAL;
-	}
+	if (p->batch) {
+		/* the job drops this reference once it is done with the page */
+		page_cache_get(page);
+		loop_xfer_queue(lo, p->batch, READ, page, buf->offset,
+				p->page, p->offset, size, IV);
+	} else {
+		if (lo_do_transfer(lo, READ, page, buf->offset, p->page,
+				   p->offset, size, IV)) {
+			printk(KERN_ERR "loop: transfer error block %ld\n",
+			       page->index);
+			size = -EINVAL;
+		}
 
-	flush_dcache_page(p->page);
+		flush_dcache_page(p->page);
+	}
 
 	if (size > 0)
 		p->offset += size;
@@ -423,8 +670,8 @@ lo_direct_splice_actor(struct pipe_inode_info *pipe, struct splice_desc *sd)
 }
 
 static int
-do_lo_receive(struct loop_device *lo,
-	      struct bio_vec *bvec, int bsize, loff_t pos)
+do_lo_receive(struct loop_device *lo, struct bio_vec *bvec, int bsize,
+	      loff_t pos, struct loop_xfer_batch *batch)
 {
 	struct lo_read_data cookie;
 	struct splice_desc sd;
@@ -435,6 +682,7 @@ do_lo_receive(struct loop_device *lo,
 	cookie.page = bvec->bv_page;
 	cookie.offset = bvec->bv_offset;
 	cookie.bsize = bsize;
+	cookie.batch = batch;
 
 	sd.len = 0;
 	sd.total_len = bvec->bv_len;
@@ -454,23 +702,549 @@ do_lo_receive(struct loop_device *lo,
 static int
 lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 {
+	struct loop_xfer_batch batch, *b = NULL;
 	struct bio_vec *bvec;
-	int i, ret = 0;
+	int i, err, ret = 0;
+
+	if (loop_xfer_parallel(lo, bio)) {
+		loop_xfer_batch_init(&batch);
+		b = &batch;
+	}
 
 	bio_for_each_segment(bvec, bio, i) {
-		ret = do_lo_receive(lo, bvec, bsize, pos);
+		ret = do_lo_receive(lo, bvec, bsize, pos, b);
 		if (ret < 0)
 			break;
 		pos += bvec->bv_len;
 	}
+
+	if (b) {
+		err = loop_xfer_batch_wait(b);
+		if (!ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/*
+ * Synchronous I/O on a kernel buffer through the plain file operations,
+ * used by the overlay and compressed image modes.  Short reads past the
+ * end of the file are zero filled.
+ */
+static int lo_file_io(struct file *file, int rw, void *buf, size_t len,
+		     loff_t pos)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t n;
+
+	set_fs(get_ds());
+	if (rw == WRITE)
+		n = file->f_op->write(file, (const char __user *)buf, len, &pos);
+	else
+		n = file->f_op->read(file, (char __user *)buf, len, &pos);
+	set_fs(old_fs);
+
+	if (n < 0)
+		return n;
+	if (rw == WRITE) {
+		if (n != len)
+			return -EIO;
+	} else if (n < len) {
+		/* reading past the end of a sparse file */
+		memset(buf + n, 0, len - n);
+	}
+	return 0;
+}
+
+/*
+ * Copy-on-write overlay.  The worker thread is the only user of the
+ * bitmap and the bounce block, so no further locking is needed.
+ */
+static int lo_cow_write_bitmap(struct loop_cow *cow)
+{
+	unsigned long nr_chunks = cow->bitmap_size / LOOP_COW_CHUNK;
+	unsigned long chunk;
+	int ret;
+
+	for_each_set_bit(chunk, cow->dirty, nr_chunks) {
+		loff_t off = (loff_t)chunk * LOOP_COW_CHUNK;
+
+		ret = lo_file_io(cow->delta, WRITE, (void *)cow->bitmap + off,
+				LOOP_COW_CHUNK, cow->bitmap_offset + off);
+		if (ret)
+			return ret;
+		__clear_bit(chunk, cow->dirty);
+	}
+	return 0;
+}
+
+/*
+ * Make everything written so far stable: delta data first, then the
+ * bitmap that refers to it.
+ */
+static int lo_cow_flush(struct loop_cow *cow)
+{
+	int ret;
+
+	ret = vfs_fsync(cow->delta, 0);
+	if (unlikely(ret && ret != -EINVAL))
+		return -EIO;
+	ret = lo_cow_write_bitmap(cow);
+	if (ret)
+		return ret;
+	ret = vfs_fsync(cow->delta, 0);
+	if (unlikely(ret && ret != -EINVAL))
+		return -EIO;
+	return 0;
+}
+
+static void lo_cow_mark(struct loop_cow *cow, u64 block)
+{
+	__set_bit_le(block, cow->bitmap);
+	__set_bit((block >> 3) / LOOP_COW_CHUNK, cow->dirty);
+}
+
+static int lo_cow_read(struct loop_device *lo, struct loop_cow *cow,
+		       void *buf, unsigned len, loff_t pos)
+{
+	if (test_bit_le(pos >> cow->block_shift, cow->bitmap))
+		return lo_file_io(cow->delta, READ, buf, len,
+				 cow->data_offset + pos);
+	return lo_file_io(lo->lo_backing_file, READ, buf, len,
+			 lo->lo_offset + pos);
+}
+
+static int lo_cow_write(struct loop_device *lo, struct loop_cow *cow,
+			void *buf, unsigned len, loff_t pos)
+{
+	unsigned int bsize = 1 << cow->block_shift;
+	u64 block = pos >> cow->block_shift;
+	unsigned boff = pos & (bsize - 1);
+	int ret;
+
+	if (test_bit_le(block, cow->bitmap) || len == bsize) {
+		ret = lo_file_io(cow->delta, WRITE, buf, len,
+				cow->data_offset + pos);
+	} else {
+		/* partial write to a block still in the base: copy it up */
+		pos -= boff;
+		ret = lo_file_io(lo->lo_backing_file, READ, cow->bounce, bsize,
+				lo->lo_offset + pos);
+		if (ret)
+			return ret;
+		memcpy(cow->bounce + boff, buf, len);
+		ret = lo_file_io(cow->delta, WRITE, cow->bounce, bsize,
+				cow->data_offset + pos);
+	}
+	if (ret)
+		return ret;
+	lo_cow_mark(cow, block);
+	return 0;
+}
+
+static int do_bio_cow(struct loop_device *lo, struct loop_cow *cow,
+		      struct bio *bio)
+{
+	unsigned int bsize = 1 << cow->block_shift;
+	loff_t pos = (loff_t) bio->bi_sector << 9;
+	int rw = bio_rw(bio);
+	struct bio_vec *bvec;
+	int i, ret = 0;
+
+	if (rw == WRITE && (bio->bi_rw & REQ_FLUSH)) {
+		ret = lo_cow_flush(cow);
+		if (ret)
+			return ret;
+	}
+
+	bio_for_each_segment(bvec, bio, i) {
+		char *buf = kmap(bvec->bv_page) + bvec->bv_offset;
+		unsigned done = 0;
+
+		while (done < bvec->bv_len) {
+			unsigned len = min_t(unsigned, bvec->bv_len - done,
+					     bsize - (pos & (bsize - 1)));
+
+			if (rw == WRITE)
+				ret = lo_cow_write(lo, cow, buf + done, len, pos);
+			else
+				ret = lo_cow_read(lo, cow, buf + done, len, pos);
+			if (ret)
+				break;
+			done += len;
+			pos += len;
+		}
+		if (rw == READ)
+			flush_dcache_page(bvec->bv_page);
+		kunmap(bvec->bv_page);
+		if (ret)
+			return ret;
+	}
+
+	if (rw == WRITE && (bio->bi_rw & REQ_FUA))
+		ret = lo_cow_flush(cow);
+	return ret;
+}
+
+static void loop_cow_free(struct loop_cow *cow)
+{
+	vfree(cow->dirty);
+	vfree(cow->bitmap);
+	kfree(cow->bounce);
+	kfree(cow);
+}
+
+/*
+ * Set up the overlay state for @delta, formatting the file if it is
+ * empty and validating its header otherwise.
+ */
+static struct loop_cow *loop_cow_open(struct loop_device *lo,
+				      struct file *delta)
+{
+	struct loop_cow_header *hdr;
+	struct loop_cow *cow;
+	u64 nr_blocks;
+	int error;
+
+	nr_blocks = DIV_ROUND_UP((u64)get_capacity(lo->lo_disk) << 9,
+				 1 << LOOP_COW_BLOCK_SHIFT);
+
+	error = -ENOMEM;
+	hdr = kzalloc(LOOP_COW_CHUNK, GFP_KERNEL);
+	cow = kzalloc(sizeof(*cow), GFP_KERNEL);
+	if (!hdr || !cow)
+		goto out;
+
+	cow->delta = delta;
+	if (i_size_read(delta->f_mapping->host) == 0) {
+		hdr->magic = cpu_to_le32(LOOP_COW_MAGIC);
+		hdr->version = cpu_to_le32(LOOP_COW_VERSION);
+		hdr->block_shift = cpu_to_le32(LOOP_COW_BLOCK_SHIFT);
+		hdr->nr_blocks = cpu_to_le64(nr_blocks);
+		hdr->bitmap_offset = cpu_to_le64(LOOP_COW_CHUNK);
+		hdr->data_offset = cpu_to_le64(LOOP_COW_CHUNK +
+				round_up(DIV_ROUND_UP(nr_blocks, 8),
+					 LOOP_COW_CHUNK));
+		error = lo_file_io(delta, WRITE, hdr, LOOP_COW_CHUNK, 0);
+		if (error)
+			goto out;
+	} else {
+		error = lo_file_io(delta, READ, hdr, LOOP_COW_CHUNK, 0);
+		if (error)
+			goto out;
+	}
+
+	error = -EINVAL;
+	if (le32_to_cpu(hdr->magic) != LOOP_COW_MAGIC ||
+	    le32_to_cpu(hdr->version) != LOOP_COW_VERSION ||
+	    le32_to_cpu(hdr->block_shift) != LOOP_COW_BLOCK_SHIFT ||
+	    le64_to_cpu(hdr->nr_blocks) != nr_blocks)
+		goto out;
+
+	cow->block_shift = LOOP_COW_BLOCK_SHIFT;
+	cow->nr_blocks = nr_blocks;
+	cow->bitmap_offset = le64_to_cpu(hdr->bitmap_offset);
+	cow->data_offset = le64_to_cpu(hdr->data_offset);
+	cow->bitmap_size = round_up(DIV_ROUND_UP(nr_blocks, 8), LOOP_COW_CHUNK);
+	if (cow->bitmap_offset < LOOP_COW_CHUNK ||
+	    cow->data_offset < cow->bitmap_offset + cow->bitmap_size)
+		goto out;
+
+	error = -ENOMEM;
+	cow->bitmap = vzalloc(cow->bitmap_size);
+	cow->dirty = vzalloc(BITS_TO_LONGS(cow->bitmap_size / LOOP_COW_CHUNK) *
+			     sizeof(long));
+	cow->bounce = kmalloc(1 << cow->block_shift, GFP_KERNEL);
+	if (!cow->bitmap || !cow->dirty || !cow->bounce)
+		goto out;
+
+	/* a fresh file reads back as zeroes past the header */
+	error = lo_file_io(delta, READ, cow->bitmap, cow->bitmap_size,
+			  cow->bitmap_offset);
+	if (error)
+		goto out;
+
+	kfree(hdr);
+	return cow;
+
+out:
+	if (cow)
+		loop_cow_free(cow);
+	kfree(hdr);
+	return ERR_PTR(error);
+}
+
+/*
+ * Compressed images.  Decompressed blocks are kept in a small per-device
+ * LRU, so sequential reads through a block only inflate it once.  As
+ * with the overlay, only the worker thread touches this state.
+ */
+static int lo_cmp_fill(struct loop_device *lo, struct loop_cmp *cmp,
+		       struct loop_cmp_entry *e, u64 block)
+{
+	struct file *file = lo->lo_backing_file;
+	loff_t start = cmp->offsets[block];
+	size_t clen = cmp->offsets[block + 1] - start;
+	size_t len = min_t(u64, cmp->block_size,
+			   cmp->image_size - (block << cmp->block_shift));
+	struct z_stream_s *zs = &cmp->zstream;
+	int ret;
+
+	e->block = LOOP_CMP_NO_BLOCK;
+	if (len < cmp->block_size)
+		memset(e->data + len, 0, cmp->block_size - len);
+
+	/* incompressible blocks are stored as is */
+	if (clen == len) {
+		ret = lo_file_io(file, READ, e->data, len,
+				 lo->lo_offset + start);
+		if (!ret)
+			e->block = block;
+		return ret;
+	}
+
+	ret = lo_file_io(file, READ, cmp->cbuf, clen, lo->lo_offset + start);
+	if (ret)
+		return ret;
+
+	zlib_inflateReset(zs);
+	zs->next_in = cmp->cbuf;
+	zs->avail_in = clen;
+	zs->next_out = e->data;
+	zs->avail_out = len;
+	ret = zlib_inflate(zs, Z_FINISH);
+	if (ret != Z_STREAM_END || zs->total_out != len) {
+		printk(KERN_ERR "loop: corrupt compressed block %llu\n",
+		       (unsigned long long)block);
+		return -EIO;
+	}
+	e->block = block;
+	return 0;
+}
+
+static struct loop_cmp_entry *lo_cmp_get(struct loop_device *lo,
+					 struct loop_cmp *cmp, u64 block)
+{
+	struct loop_cmp_entry *e;
+	int ret;
+
+	list_for_each_entry(e, &cmp->lru, lru)
+		if (e->block == block)
+			goto found;
+
+	/* reuse the least recently used entry */
+	e = list_entry(cmp->lru.prev, struct loop_cmp_entry, lru);
+	ret = lo_cmp_fill(lo, cmp, e, block);
+	if (ret)
+		return ERR_PTR(ret);
+found:
+	list_move(&e->lru, &cmp->lru);
+	return e;
+}
+
+static int do_bio_cmp(struct loop_device *lo, struct loop_cmp *cmp,
+		      struct bio *bio)
+{
+	loff_t pos = (loff_t) bio->bi_sector << 9;
+	struct bio_vec *bvec;
+	int i, ret = 0;
+
+	if (bio_rw(bio) == WRITE)
+		return -EIO;
+
+	bio_for_each_segment(bvec, bio, i) {
+		char *buf = kmap(bvec->bv_page) + bvec->bv_offset;
+		unsigned done = 0;
+
+		while (done < bvec->bv_len) {
+			unsigned boff = pos & (cmp->block_size - 1);
+			unsigned len = min_t(unsigned, bvec->bv_len - done,
+					     cmp->block_size - boff);
+			struct loop_cmp_entry *e;
+
+			if (pos >= cmp->image_size) {
+				memset(buf + done, 0, len);
+			} else {
+				e = lo_cmp_get(lo, cmp,
+					       pos >> cmp->block_shift);
+				if (IS_ERR(e)) {
+					ret = PTR_ERR(e);
+					break;
+				}
+				memcpy(buf + done, e->data + boff, len);
+			}
+			done += len;
+			pos += len;
+		}
+		flush_dcache_page(bvec->bv_page);
+		kunmap(bvec->bv_page);
+		if (ret)
+			break;
+	}
 	return ret;
 }
 
+static void loop_cmp_free(struct loop_cmp *cmp)
+{
+	unsigned int i;
+
+	for (i = 0; i < cmp->nr_entries; i++)
+		vfree(cmp->entries[i].data);
+	if (cmp->zstream.workspace) {
+		zlib_inflateEnd(&cmp->zstream);
+		vfree(cmp->zstream.workspace);
+	}
+	vfree(cmp->cbuf);
+	vfree(cmp->offsets);
+	kfree(cmp);
+}
+
+/*
+ * Read and validate the header and offset table of a compressed image
+ * at lo_offset of the backing file.
+ */
+static struct loop_cmp *loop_cmp_open(struct loop_device *lo,
+				      unsigned int nr_entries)
+{
+	struct file *file = lo->lo_backing_file;
+	loff_t fsize = i_size_read(file->f_mapping->host) - lo->lo_offset;
+	struct loop_cmp_header hdr;
+	struct loop_cmp *cmp;
+	size_t table, max_clen = 0;
+	unsigned int bsize;
+	u64 nr, i;
+	int error;
+
+	error = lo_file_io(file, READ, &hdr, sizeof(hdr), lo->lo_offset);
+	if (error)
+		return ERR_PTR(error);
+
+	bsize = le32_to_cpu(hdr.block_size);
+	nr = le32_to_cpu(hdr.nr_blocks);
+	if (le32_to_cpu(hdr.magic) != LOOP_CMP_MAGIC ||
+	    le32_to_cpu(hdr.version) != LOOP_CMP_VERSION ||
+	    !is_power_of_2(bsize) || bsize < LOOP_CMP_MIN_BLOCK ||
+	    bsize > LOOP_CMP_MAX_BLOCK || !nr || nr > LOOP_CMP_MAX_BLOCKS ||
+	    sizeof(hdr) + (nr + 1) * sizeof(u64) > fsize ||
+	    le64_to_cpu(hdr.image_size) > nr * bsize ||
+	    le64_to_cpu(hdr.image_size) <= (nr - 1) * bsize)
+		return ERR_PTR(-EINVAL);
+
+	cmp = kzalloc(sizeof(*cmp) + nr_entries * sizeof(cmp->entries[0]),
+		      GFP_KERNEL);
+	if (!cmp)
+		return ERR_PTR(-ENOMEM);
+	cmp->block_size = bsize;
+	cmp->block_shift = ilog2(bsize);
+	cmp->nr_blocks = nr;
+	cmp->image_size = le64_to_cpu(hdr.image_size);
+	INIT_LIST_HEAD(&cmp->lru);
+
+	error = -ENOMEM;
+	table = (nr + 1) * sizeof(u64);
+	cmp->offsets = vmalloc(table);
+	if (!cmp->offsets)
+		goto out;
+	error = lo_file_io(file, READ, cmp->offsets, table,
+			   lo->lo_offset + sizeof(hdr));
+	if (error)
+		goto out;
+
+	error = -EINVAL;
+	for (i = 0; i <= nr; i++)
+		cmp->offsets[i] = le64_to_cpu((__force __le64)cmp->offsets[i]);
+	if (cmp->offsets[0] < sizeof(hdr) + table || cmp->offsets[nr] > fsize)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		if (cmp->offsets[i + 1] < cmp->offsets[i] ||
+		    cmp->offsets[i + 1] - cmp->offsets[i] > 2 * bsize)
+			goto out;
+		max_clen = max_t(size_t, max_clen,
+				 cmp->offsets[i + 1] - cmp->offsets[i]);
+	}
+
+	error = -ENOMEM;
+	cmp->cbuf = vmalloc(max_clen ?: 1);
+	cmp->zstream.workspace = vmalloc(zlib_inflate_workspacesize());
+	if (!cmp->cbuf || !cmp->zstream.workspace)
+		goto out;
+	if (zlib_inflateInit(&cmp->zstream) != Z_OK) {
+		vfree(cmp->zstream.workspace);
+		cmp->zstream.workspace = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < nr_entries; i++) {
+		struct loop_cmp_entry *e = &cmp->entries[i];
+
+		e->data = vmalloc(bsize);
+		if (!e->data)
+			goto out;
+		e->block = LOOP_CMP_NO_BLOCK;
+		list_add_tail(&e->lru, &cmp->lru);
+		cmp->nr_entries++;
+	}
+	return cmp;
+
+out:
+	loop_cmp_free(cmp);
+	return ERR_PTR(error);
+}
+
+/*
+ * Live migration.  The worker copies one chunk between rounds of bios and
+ * mirrors every completed write that lands below the copy cursor, so the
+ * destination converges while the queue is never held up for longer than
+ * one chunk.  Data is copied as stored, so transfer functions need no
+ * special care.
+ */
+static int lo_migrate_copy(struct loop_device *lo, struct loop_migrate *m,
+			   loff_t pos, loff_t len)
+{
+	while (len > 0) {
+		size_t n = min_t(loff_t, len, LOOP_MIGRATE_CHUNK);
+		int ret;
+
+		ret = lo_file_io(lo->lo_backing_file, READ, m->buf, n, pos);
+		if (!ret)
+			ret = lo_file_io(m->file, WRITE, m->buf, n, pos);
+		if (ret)
+			return ret;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * A failure to mirror only aborts the migration; the write itself has
+ * reached the old backing file, which is still authoritative.
+ */
+static void lo_migrate_mirror(struct loop_device *lo, loff_t pos,
+			      unsigned int len)
+{
+	struct loop_migrate *m = to_loop_priv(lo)->migrate;
+	loff_t end;
+
+	if (!m || m->error)
+		return;
+	end = min_t(loff_t, pos + len, m->pos);
+	if (pos < end)
+		m->error = lo_migrate_copy(lo, m, pos, end - pos);
+}
+
 static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 {
+	struct loop_cow *cow = to_loop_priv(lo)->cow;
+	struct loop_cmp *cmp = to_loop_priv(lo)->cmp;
 	loff_t pos;
 	int ret;
 
+	if (cow)
+		return do_bio_cow(lo, cow, bio);
+	if (cmp)
+		return do_bio_cmp(lo, cmp, bio);
+
 	pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
 
 	if (bio_rw(bio) == WRITE) {
@@ -485,6 +1259,8 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 		}
 
 		ret = lo_send(lo, bio, pos);
+		if (!ret)
+			lo_migrate_mirror(lo, pos, bio->bi_size);
 
 		if ((bio->bi_rw & REQ_FUA) && !ret) {
 			ret = vfs_fsync(file, 0);
@@ -503,15 +1279,96 @@ out:
  */
 static void loop_add_bio(struct loop_device *lo, struct bio *bio)
 {
+	struct loop_priv *p = to_loop_priv(lo);
+
+	if (p->stamp_nr < LOOP_STAMP_NR)
+		p->stamp_in[p->stamp_nr] = ktime_get();
+	p->stamp_nr++;
 	bio_list_add(&lo->lo_bio_list, bio);
 }
 
 /*
- * Grab first pending buffer
+ * Grab all pending buffers at once, together with their enqueue stamps
  */
-static struct bio *loop_get_bio(struct loop_device *lo)
+static void loop_get_bios(struct loop_device *lo, struct bio_list *bios)
 {
-	return bio_list_pop(&lo->lo_bio_list);
+	struct loop_priv *p = to_loop_priv(lo);
+
+	swap(p->stamp_in, p->stamp_out);
+	p->stamp_out_nr = min_t(unsigned int, p->stamp_nr, LOOP_STAMP_NR);
+	p->stamp_out_idx = 0;
+	p->stamp_nr = 0;
+
+	bio_list_merge(bios, &lo->lo_bio_list);
+	bio_list_init(&lo->lo_bio_list);
+}
+
+/*
+ * I/O statistics.  These are updated by the worker thread only, so no
+ * locking is needed; sysfs readers may see slightly torn values.
+ */
+static inline int loop_stat_class(struct bio *bio)
+{
+	if (bio->bi_rw & REQ_FLUSH)
+		return LOOP_STAT_FLUSH;
+	return bio_rw(bio) == WRITE ? LOOP_STAT_WRITE : LOOP_STAT_READ;
+}
+
+static inline unsigned int loop_lat_bucket(u64 us)
+{
+	return min_t(unsigned int, fls64(us), LOOP_LAT_BUCKETS - 1);
+}
+
+/*
+ * Called when the worker picks up a bio; accounts the time it spent
+ * waiting on lo_bio_list.  Must be called once per bio, in list order.
+ */
+static void loop_stat_dequeue(struct loop_device *lo, struct bio *bio,
+			      ktime_t now)
+{
+	struct loop_priv *p = to_loop_priv(lo);
+	struct loop_io_stats *st;
+	u64 us;
+
+	if (p->stamp_out_idx >= p->stamp_out_nr) {
+		p->stamp_out_idx++;
+		return;
+	}
+	us = ktime_us_delta(now, p->stamp_out[p->stamp_out_idx++]);
+	if (unlikely(!bio->bi_bdev))
+		return;
+
+	st = &p->stats[loop_stat_class(bio)];
+	st->queue_us += us;
+	st->queue_hist[loop_lat_bucket(us)]++;
+}
+
+/*
+ * Called on completion; accounts the time since the worker picked the
+ * bio up, i.e. time spent servicing it against the backing file.
+ */
+static void loop_stat_complete(struct loop_device *lo, struct bio *bio,
+			       ktime_t start, int error)
+{
+	struct loop_io_stats *st = &to_loop_priv(lo)->stats[loop_stat_class(bio)];
+	u64 us = ktime_us_delta(ktime_get(), start);
+
+	st->ios++;
+	st->sectors += bio_sectors(bio);
+	if (error)
+		st->errors++;
+	st->service_us += us;
+	st->service_hist[loop_lat_bucket(us)]++;
+}
+
+static void loop_stat_reset(struct loop_device *lo)
+{
+	struct loop_priv *p = to_loop_priv(lo);
+
+	memset(p->stats, 0, sizeof(p->stats));
+	p->stamp_nr = 0;
+	p->stamp_out_nr = 0;
+	p->stamp_out_idx = 0;
 }
 
 static int loop_make_request(struct request_queue *q, struct bio *old_bio)
@@ -524,6 +1381,17 @@ static int loop_make_request(struct request_queue *q, struct bio *old_bio)
 
 	BUG_ON(!lo || (rw != READ && rw != WRITE));
 
+	/*
+	 * The queue limits already keep well-behaved submitters aligned;
+	 * anything else would force read-modify-write in the backing file.
+	 */
+	if (unlikely((((unsigned int)old_bio->bi_sector << 9) |
+		      old_bio->bi_size) &
+		     (to_loop_priv(lo)->logical_block_size - 1))) {
+		bio_io_error(old_bio);
+		return 0;
+	}
+
 	spin_lock_irq(&lo->lo_lock);
 	if (lo->lo_state != Lo_bound)
 		goto out;
@@ -542,20 +1410,162 @@ out:
 
 struct switch_request {
 	struct file *file;
+	struct loop_cow *cow;
+	struct loop_cmp *cmp;
+	struct loop_migrate *migrate;
 	struct completion wait;
 };
 
 static void do_loop_switch(struct loop_device *, struct switch_request *);
 
-static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
+static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio,
+				   ktime_t start)
 {
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
+		loop_stat_complete(lo, bio, start, ret);
+		bio_endio(bio, ret);
+	}
+}
+
+/*
+ * Upper limit for a write batch, so that i_mutex of the backing inode is
+ * not held for an unbounded time while a long sequential stream drains.
+ */
+#define LOOP_BATCH_MAX_SECTORS	2048
+
+/*
+ * A bio may join a write batch if it is a plain data write.  Flush and FUA
+ * writes need vfs_fsync(), which takes i_mutex itself, so they are always
+ * handled on their own by do_bio_filebacked().
+ */
+static inline bool loop_bio_batchable(struct loop_device *lo, struct bio *bio)
+{
+	return (lo->lo_flags & LO_FLAGS_USE_AOPS) && !loop_remapped(lo) &&
+		!to_loop_priv(lo)->migrate && bio->bi_bdev &&
+		bio_rw(bio) == WRITE && !(bio->bi_rw & (REQ_FLUSH | REQ_FUA)) &&
+		!loop_xfer_parallel(lo, bio);
+}
+
+/*
+ * Write a run of contiguous bios to the backing file, taking i_mutex of
+ * the backing inode only once for the whole run.  Every bio is still
+ * completed with its own status.
+ */
+static void loop_handle_write_batch(struct loop_device *lo,
+				    struct bio_list *batch, ktime_t start)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+	struct bio *bio;
+
+	mutex_lock(&inode->i_mutex);
+	while ((bio = bio_list_pop(batch))) {
+		loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+		int ret = lo_send_aops(lo, bio, pos);
+
+		loop_stat_complete(lo, bio, start, ret);
 		bio_endio(bio, ret);
 	}
+	mutex_unlock(&inode->i_mutex);
+}
+
+/*
+ * Handle a list of bios spliced off lo_bio_list in submission order.
+ * Contiguous plain writes are gathered into batches; everything else,
+ * including the magic switch bio, is a batch boundary and is handled
+ * alone so that ordering is preserved.  Bios in a batch are picked up
+ * back to back, so they share the batch start time for accounting.
+ */
+static void loop_handle_bios(struct loop_device *lo, struct bio_list *bios)
+{
+	struct bio_list batch;
+	struct blk_plug plug;
+	unsigned int batch_sectors = 0;
+	ktime_t batch_start = ktime_set(0, 0);
+	struct bio *bio;
+
+	bio_list_init(&batch);
+	blk_start_plug(&plug);
+	while ((bio = bio_list_pop(bios))) {
+		ktime_t now = ktime_get();
+
+		loop_stat_dequeue(lo, bio, now);
+		if (loop_bio_batchable(lo, bio)) {
+			if (!bio_list_empty(&batch) &&
+			    (batch.tail->bi_sector + bio_sectors(batch.tail) !=
+			     bio->bi_sector ||
+			     batch_sectors + bio_sectors(bio) >
+			     LOOP_BATCH_MAX_SECTORS)) {
+				loop_handle_write_batch(lo, &batch,
+							batch_start);
+				batch_sectors = 0;
+			}
+			if (bio_list_empty(&batch))
+				batch_start = now;
+			bio_list_add(&batch, bio);
+			batch_sectors += bio_sectors(bio);
+			continue;
+		}
+		if (!bio_list_empty(&batch)) {
+			loop_handle_write_batch(lo, &batch, batch_start);
+			batch_sectors = 0;
+		}
+		loop_handle_bio(lo, bio, now);
+	}
+	if (!bio_list_empty(&batch))
+		loop_handle_write_batch(lo, &batch, batch_start);
+	blk_finish_plug(&plug);
+}
+
+static void loop_install_file(struct loop_device *lo, struct file *file);
+
+/*
+ * Copy the next chunk of a running migration, and switch over to the
+ * destination once everything has been copied.
+ */
+static void loop_migrate_step(struct loop_device *lo)
+{
+	struct loop_migrate *m = to_loop_priv(lo)->migrate;
+	struct address_space *mapping;
+	loff_t len;
+
+	if (!m)
+		return;
+
+	len = min_t(loff_t, m->end - m->pos, LOOP_MIGRATE_CHUNK);
+	if (!m->error && !ACCESS_ONCE(m->abort) && len > 0) {
+		m->error = lo_migrate_copy(lo, m, m->pos, len);
+		m->pos += len;
+		if (!m->error && m->pos < m->end)
+			return;
+	}
+
+	spin_lock_irq(&lo->lo_lock);
+	to_loop_priv(lo)->migrate = NULL;
+	spin_unlock_irq(&lo->lo_lock);
+
+	if (!m->error && !m->abort) {
+		m->error = vfs_fsync(m->file, 0);
+		if (m->error == -EINVAL)
+			m->error = 0;
+	}
+	if (!m->error && !m->abort) {
+		mapping = m->file->f_mapping;
+		mapping_set_gfp_mask(mapping, m->old_gfp_mask);
+		m->old_file = lo->lo_backing_file;
+		loop_install_file(lo, m->file);
+
+		spin_lock_irq(&lo->lo_lock);
+		if (mapping->a_ops->write_begin)
+			lo->lo_flags |= LO_FLAGS_USE_AOPS;
+		else
+			lo->lo_flags &= ~LO_FLAGS_USE_AOPS;
+		spin_unlock_irq(&lo->lo_lock);
+	}
+	complete(&m->done);
 }
 
 /*
@@ -573,7 +1583,7 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 static int loop_thread(void *data)
 {
 	struct loop_device *lo = data;
-	struct bio *bio;
+	struct bio_list bios;
 
 	set_user_nice(current, -20);
 
@@ -581,16 +1591,21 @@ static int loop_thread(void *data)
 
 		wait_event_interruptible(lo->lo_event,
 				!bio_list_empty(&lo->lo_bio_list) ||
+				to_loop_priv(lo)->migrate ||
 				kthread_should_stop());
 
-		if (bio_list_empty(&lo->lo_bio_list))
-			continue;
-		spin_lock_irq(&lo->lo_lock);
-		bio = loop_get_bio(lo);
-		spin_unlock_irq(&lo->lo_lock);
+		if (!bio_list_empty(&lo->lo_bio_list)) {
+			bio_list_init(&bios);
+			spin_lock_irq(&lo->lo_lock);
+			loop_get_bios(lo, &bios);
+			spin_unlock_irq(&lo->lo_lock);
 
-		BUG_ON(!bio);
-		loop_handle_bio(lo, bio);
+			BUG_ON(bio_list_empty(&bios));
+			loop_handle_bios(lo, &bios);
+		}
+
+		/* a running migration advances by one chunk per round */
+		loop_migrate_step(lo);
 	}
 
 	return 0;
@@ -601,21 +1616,26 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct switch_request *w)
 {
-	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
 	if (!bio)
 		return -ENOMEM;
-	init_completion(&w.wait);
-	w.file = file;
-	bio->bi_private = &w;
+	init_completion(&w->wait);
+	bio->bi_private = w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
-	wait_for_completion(&w.wait);
+	wait_for_completion(&w->wait);
 	return 0;
 }
 
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	struct switch_request w = { .file = file };
+
+	return __loop_switch(lo, &w);
+}
+
 /*
  * Helper to flush the IOs in loop, but keeping loop thread running
  */
@@ -629,25 +1649,41 @@ static int loop_flush(struct loop_device *lo)
 }
 
 /*
- * Do the actual switch; called from the BIO completion routine
+ * Make file the backing file; only called from the worker thread.
  */
-static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
+static void loop_install_file(struct loop_device *lo, struct file *file)
 {
-	struct file *file = p->file;
-	struct file *old_file = lo->lo_backing_file;
-	struct address_space *mapping;
-
-	/* if no new file, only flush of queued bios requested */
-	if (!file)
-		goto out;
+	struct address_space *mapping = file->f_mapping;
 
-	mapping = file->f_mapping;
-	mapping_set_gfp_mask(old_file->f_mapping, lo->old_gfp_mask);
+	mapping_set_gfp_mask(lo->lo_backing_file->f_mapping, lo->old_gfp_mask);
 	lo->lo_backing_file = file;
 	lo->lo_blocksize = S_ISBLK(mapping->host->i_mode) ?
 		mapping->host->i_bdev->bd_block_size : PAGE_SIZE;
 	lo->old_gfp_mask = mapping_gfp_mask(mapping);
 	mapping_set_gfp_mask(mapping, lo->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
+}
+
+/*
+ * Do the actual switch; called from the BIO completion routine
+ */
+static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
+{
+	/* these keep the backing file, or change it later on their own */
+	if (p->cow || p->cmp || p->migrate) {
+		spin_lock_irq(&lo->lo_lock);
+		if (p->cow)
+			to_loop_priv(lo)->cow = p->cow;
+		if (p->cmp)
+			to_loop_priv(lo)->cmp = p->cmp;
+		if (p->migrate)
+			to_loop_priv(lo)->migrate = p->migrate;
+		spin_unlock_irq(&lo->lo_lock);
+		goto out;
+	}
+
+	/* without a new file only a flush of queued bios was requested */
+	if (p->file)
+		loop_install_file(lo, p->file);
 out:
 	complete(&p->wait);
 }
@@ -677,6 +1713,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
 		goto out;
 
+	/* the delta bitmap or offset table describes the current file */
+	error = -EBUSY;
+	if (loop_remapped(lo))
+		goto out;
+
 	error = -EBADF;
 	file = fget(arg);
 	if (!file)
@@ -710,6 +1751,314 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	return error;
 }
 
+/*
+ * loop_set_delta_fd turns a bound device into a copy-on-write overlay:
+ * the current backing file is only read from any more, and all writes go
+ * to the delta file.  The device becomes writable even if the base was
+ * opened read-only.  Transfer functions are not supported in this mode.
+ */
+static int loop_set_delta_fd(struct loop_device *lo, fmode_t mode,
+			     struct block_device *bdev, unsigned int arg)
+{
+	struct switch_request w = { };
+	struct address_space *mapping;
+	struct loop_cow *cow;
+	struct file *file;
+	int error;
+
+	error = -ENXIO;
+	if (lo->lo_state != Lo_bound)
+		goto out;
+
+	error = -EBUSY;
+	if (loop_remapped(lo))
+		goto out;
+
+	error = -EINVAL;
+	if (lo->lo_encryption || !(mode & FMODE_WRITE))
+		goto out;
+
+	error = -EBADF;
+	file = fget(arg);
+	if (!file)
+		goto out;
+
+	error = -EINVAL;
+	mapping = file->f_mapping;
+	if (!S_ISREG(mapping->host->i_mode) || !(file->f_mode & FMODE_WRITE) ||
+	    !file->f_op->read || !file->f_op->write)
+		goto out_putf;
+
+	cow = loop_cow_open(lo, file);
+	if (IS_ERR(cow)) {
+		error = PTR_ERR(cow);
+		goto out_putf;
+	}
+	cow->old_gfp_mask = mapping_gfp_mask(mapping);
+	mapping_set_gfp_mask(mapping, cow->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
+
+	w.cow = cow;
+	error = __loop_switch(lo, &w);
+	if (error) {
+		mapping_set_gfp_mask(mapping, cow->old_gfp_mask);
+		loop_cow_free(cow);
+		goto out_putf;
+	}
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags &= ~LO_FLAGS_READ_ONLY;
+	spin_unlock_irq(&lo->lo_lock);
+	set_device_ro(bdev, 0);
+	if (file->f_op->fsync)
+		blk_queue_flush(lo->lo_queue, REQ_FLUSH);
+	return 0;
+
+ out_putf:
+	fput(file);
+ out:
+	return error;
+}
+
+/*
+ * loop_migrate_fd moves a bound device, writable or not, to a new backing
+ * file without draining it: see LOOP_MIGRATE_FD.  The whole old file up
+ * to the end of the device is copied, so lo_offset stays valid.  Waiting
+ * for the copy can be interrupted by a fatal signal, which abandons the
+ * migration and leaves the device on the old file.  lo_ctl_mutex is dropped
+ * for the wait; lo_ioctl() turns away everything but status queries.
+ */
+static int loop_migrate_fd(struct loop_device *lo, struct block_device *bdev,
+			   unsigned int arg)
+{
+	struct switch_request w = { };
+	struct address_space *mapping;
+	struct loop_migrate *m;
+	struct inode *inode;
+	struct file *file;
+	int error;
+
+	error = -ENXIO;
+	if (lo->lo_state != Lo_bound)
+		goto out;
+
+	error = -EBUSY;
+	if (loop_remapped(lo))
+		goto out;
+
+	error = -EBADF;
+	file = fget(arg);
+	if (!file)
+		goto out;
+
+	error = -EINVAL;
+	mapping = file->f_mapping;
+	inode = mapping->host;
+	if ((!S_ISREG(inode->i_mode) && !S_ISBLK(inode->i_mode)) ||
+	    !(file->f_mode & FMODE_WRITE) || !file->f_op->read ||
+	    !file->f_op->write ||
+	    inode == lo->lo_backing_file->f_mapping->host)
+		goto out_putf;
+
+	error = -ENOMEM;
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		goto out_putf;
+	m->buf = vmalloc(LOOP_MIGRATE_CHUNK);
+	if (!m->buf)
+		goto out_free;
+	m->file = file;
+	m->end = lo->lo_offset + ((loff_t)get_capacity(lo->lo_disk) << 9);
+	init_completion(&m->done);
+
+	/* a block device has to be large enough to take the whole copy */
+	error = -ENOSPC;
+	if (S_ISBLK(inode->i_mode) && i_size_read(inode) < m->end)
+		goto out_free;
+
+	m->old_gfp_mask = mapping_gfp_mask(mapping);
+	mapping_set_gfp_mask(mapping, m->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
+
+	w.migrate = m;
+	error = __loop_switch(lo, &w);
+	if (error)
+		goto out_gfp;
+
+	to_loop_priv(lo)->migrating = true;
+	mutex_unlock(&lo->lo_ctl_mutex);
+	if (wait_for_completion_killable(&m->done)) {
+		/* the worker notices between two chunks */
+		m->abort = true;
+		wait_for_completion(&m->done);
+	}
+	mutex_lock_nested(&lo->lo_ctl_mutex, 1);
+	to_loop_priv(lo)->migrating = false;
+
+	error = m->error;
+	if (!error && !m->old_file)
+		error = -EINTR;
+	if (error)
+		goto out_gfp;
+
+	fput(m->old_file);
+	vfree(m->buf);
+	kfree(m);
+	if (max_part > 0)
+		ioctl_by_bdev(bdev, BLKRRPART, 0);
+	return 0;
+
+ out_gfp:
+	mapping_set_gfp_mask(mapping, m->old_gfp_mask);
+ out_free:
+	vfree(m->buf);
+	kfree(m);
+ out_putf:
+	fput(file);
+ out:
+	return error;
+}
+
+/*
+ * Write back the bitmap and drop the delta file.  Called once the worker
+ * thread is gone.
+ */
+static void loop_cow_release(struct loop_cow *cow)
+{
+	if (lo_cow_flush(cow))
+		printk(KERN_ERR "loop: failed to write back delta bitmap\n");
+	mapping_set_gfp_mask(cow->delta->f_mapping, cow->old_gfp_mask);
+	fput(cow->delta);
+	loop_cow_free(cow);
+}
+
+static void loop_config_block_size(struct loop_device *lo, unsigned int bsize)
+{
+	struct request_queue *q = lo->lo_queue;
+
+	to_loop_priv(lo)->logical_block_size = bsize;
+	blk_queue_logical_block_size(q, bsize);
+	blk_queue_physical_block_size(q, bsize);
+	blk_queue_io_min(q, bsize);
+	blk_queue_io_opt(q, bsize > 512 ? bsize : 0);
+}
+
+/*
+ * Block size of the backing store: the physical block size of a backing
+ * block device, or the block size of the filesystem holding a file.
+ */
+static unsigned int loop_backing_block_size(struct file *file)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	if (S_ISBLK(inode->i_mode))
+		return bdev_physical_block_size(inode->i_bdev);
+	return min_t(unsigned int, inode->i_sb->s_blocksize, PAGE_SIZE);
+}
+
+/*
+ * loop_set_block_size advertises a larger logical block size, so that the
+ * upper layers only issue I/O in whole, aligned blocks and the backing
+ * file is written in whole pages.  The device should be idle: bios queued
+ * under the old size are drained first, but new unaligned ones are failed.
+ */
+static int loop_set_block_size(struct loop_device *lo,
+			       struct block_device *bdev, unsigned long arg)
+{
+	unsigned int bsize = arg;
+	int err;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+
+	if (!bsize)
+		bsize = loop_backing_block_size(lo->lo_backing_file);
+	if (bsize < 512 || bsize > PAGE_SIZE || !is_power_of_2(bsize))
+		return -EINVAL;
+	/* any offset goes at 512 bytes, see loop_set_status() */
+	if (bsize > 512 && (lo->lo_offset & (bsize - 1)))
+		return -EINVAL;
+	/* the size is fixed by the delta file or the compressed image */
+	if (loop_remapped(lo))
+		return -EBUSY;
+	if (bsize == to_loop_priv(lo)->logical_block_size)
+		return 0;
+
+	err = loop_flush(lo);
+	if (err)
+		return err;
+	sync_blockdev(bdev);
+	invalidate_bdev(bdev);
+
+	loop_config_block_size(lo, bsize);
+	err = figure_loop_size(lo);
+	if (err)
+		return err;
+
+	mutex_lock(&bdev->bd_mutex);
+	bd_set_size(bdev, (loff_t)get_capacity(lo->lo_disk) << 9);
+	/* let user-space know about the new size */
+	kobject_uevent(&disk_to_dev(bdev->bd_disk)->kobj, KOBJ_CHANGE);
+	mutex_unlock(&bdev->bd_mutex);
+
+	if (block_size(bdev) < bsize)
+		set_blocksize(bdev, bsize);
+	return 0;
+}
+
+/*
+ * loop_set_compressed presents the backing file, which must hold a
+ * compressed image, as a read-only device of the uncompressed size.  arg
+ * is the number of decompressed blocks to cache, 0 for the default.
+ */
+static int loop_set_compressed(struct loop_device *lo,
+			       struct block_device *bdev, unsigned long arg)
+{
+	struct switch_request w = { };
+	struct loop_cmp *cmp;
+	int old_flags, error;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+	if (loop_remapped(lo))
+		return -EBUSY;
+	if (lo->lo_encryption || arg > LOOP_CMP_CACHE_MAX)
+		return -EINVAL;
+
+	cmp = loop_cmp_open(lo, arg ? arg : LOOP_CMP_CACHE_DEFAULT);
+	if (IS_ERR(cmp))
+		return PTR_ERR(cmp);
+
+	/* dirty pages belong to the raw mapping, write them out while it is */
+	sync_blockdev(bdev);
+
+	/* no new writes to the raw file from here on */
+	spin_lock_irq(&lo->lo_lock);
+	old_flags = lo->lo_flags;
+	lo->lo_flags |= LO_FLAGS_READ_ONLY;
+	spin_unlock_irq(&lo->lo_lock);
+
+	w.cmp = cmp;
+	error = __loop_switch(lo, &w);
+	if (error) {
+		spin_lock_irq(&lo->lo_lock);
+		lo->lo_flags = old_flags;
+		spin_unlock_irq(&lo->lo_lock);
+		loop_cmp_free(cmp);
+		return error;
+	}
+
+	set_device_ro(bdev, 1);
+	invalidate_bdev(bdev);
+	set_capacity(lo->lo_disk, DIV_ROUND_UP(cmp->image_size, 512));
+	mutex_lock(&bdev->bd_mutex);
+	bd_set_size(bdev, (loff_t)get_capacity(lo->lo_disk) << 9);
+	/* let user-space know about the new size */
+	kobject_uevent(&disk_to_dev(bdev->bd_disk)->kobj, KOBJ_CHANGE);
+	mutex_unlock(&bdev->bd_mutex);
+	if (max_part > 0)
+		ioctl_by_bdev(bdev, BLKRRPART, 0);
+	return 0;
+}
+
 static inline int is_loop_device(struct file *file)
 {
 	struct inode *i = file->f_mapping->host;
@@ -767,6 +2116,45 @@ static ssize_t loop_attr_backing_file_show(struct loop_device *lo, char *buf)
 	return ret;
 }
 
+static ssize_t loop_attr_delta_file_show(struct loop_device *lo, char *buf)
+{
+	struct loop_cow *cow;
+	ssize_t ret;
+	char *p = NULL;
+
+	spin_lock_irq(&lo->lo_lock);
+	cow = to_loop_priv(lo)->cow;
+	if (cow)
+		p = d_path(&cow->delta->f_path, buf, PAGE_SIZE - 1);
+	spin_unlock_irq(&lo->lo_lock);
+
+	if (IS_ERR_OR_NULL(p))
+		ret = PTR_ERR(p);
+	else {
+		ret = strlen(p);
+		memmove(buf, p, ret);
+		buf[ret++] = '\n';
+		buf[ret] = 0;
+	}
+
+	return ret;
+}
+
+static ssize_t loop_attr_migration_show(struct loop_device *lo, char *buf)
+{
+	struct loop_migrate *m;
+	ssize_t ret = 0;
+
+	spin_lock_irq(&lo->lo_lock);
+	m = to_loop_priv(lo)->migrate;
+	if (m)
+		ret = sprintf(buf, "%llu %llu\n", (unsigned long long)m->pos,
+			      (unsigned long long)m->end);
+	spin_unlock_irq(&lo->lo_lock);
+
+	return ret;
+}
+
 static ssize_t loop_attr_offset_show(struct loop_device *lo, char *buf)
 {
 	return sprintf(buf, "%llu\n", (unsigned long long)lo->lo_offset);
@@ -784,16 +2172,87 @@ static ssize_t loop_attr_autoclear_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", autoclear ? "1" : "0");
 }
 
+static const char *loop_stat_names[LOOP_STAT_NR] = {
+	[LOOP_STAT_READ]	= "read",
+	[LOOP_STAT_WRITE]	= "write",
+	[LOOP_STAT_FLUSH]	= "flush",
+};
+
+/*
+ * One line per I/O class:
+ *   <class> <ios> <sectors> <errors> <queue usecs> <service usecs>
+ */
+static ssize_t loop_attr_stat_show(struct loop_device *lo, char *buf)
+{
+	struct loop_priv *p = to_loop_priv(lo);
+	ssize_t ret = 0;
+	int i;
+
+	for (i = 0; i < LOOP_STAT_NR; i++) {
+		struct loop_io_stats *st = &p->stats[i];
+
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret,
+				 "%s %lu %lu %lu %llu %llu\n",
+				 loop_stat_names[i], st->ios, st->sectors,
+				 st->errors,
+				 (unsigned long long)st->queue_us,
+				 (unsigned long long)st->service_us);
+	}
+	return ret;
+}
+
+static ssize_t loop_attr_show_hist(struct loop_device *lo, char *buf,
+				   bool service)
+{
+	struct loop_priv *p = to_loop_priv(lo);
+	ssize_t ret = 0;
+	int i, b;
+
+	for (i = 0; i < LOOP_STAT_NR; i++) {
+		unsigned long *hist = service ? p->stats[i].service_hist :
+						p->stats[i].queue_hist;
+
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%s",
+				 loop_stat_names[i]);
+		for (b = 0; b < LOOP_LAT_BUCKETS; b++)
+			ret += scnprintf(buf + ret, PAGE_SIZE - ret, " %lu",
+					 hist[b]);
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "\n");
+	}
+	return ret;
+}
+
+static ssize_t loop_attr_queue_latency_show(struct loop_device *lo, char *buf)
+{
+	return loop_attr_show_hist(lo, buf, false);
+}
+
+static ssize_t loop_attr_service_latency_show(struct loop_device *lo,
+					      char *buf)
+{
+	return loop_attr_show_hist(lo, buf, true);
+}
+
 LOOP_ATTR_RO(backing_file);
+LOOP_ATTR_RO(delta_file);
+LOOP_ATTR_RO(migration);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
+LOOP_ATTR_RO(stat);
+LOOP_ATTR_RO(queue_latency);
+LOOP_ATTR_RO(service_latency);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
+	&loop_attr_delta_file.attr,
+	&loop_attr_migration.attr,
 	&loop_attr_offset.attr,
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
+	&loop_attr_stat.attr,
+	&loop_attr_queue_latency.attr,
+	&loop_attr_service_latency.attr,
 	NULL,
 };
 
@@ -899,6 +2358,8 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 	mapping_set_gfp_mask(mapping, lo->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
 
 	bio_list_init(&lo->lo_bio_list);
+	loop_stat_reset(lo);
+	loop_config_block_size(lo, 512);
 
 	/*
 	 * set queue make_request_fn, and add limits based on lower level
@@ -991,6 +2452,8 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 {
 	struct file *filp = lo->lo_backing_file;
 	gfp_t gfp = lo->old_gfp_mask;
+	struct loop_cow *cow;
+	struct loop_cmp *cmp;
 
 	if (lo->lo_state != Lo_bound)
 		return -ENXIO;
@@ -1009,6 +2472,10 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
+	cow = to_loop_priv(lo)->cow;
+	to_loop_priv(lo)->cow = NULL;
+	cmp = to_loop_priv(lo)->cmp;
+	to_loop_priv(lo)->cmp = NULL;
 	spin_unlock_irq(&lo->lo_lock);
 
 	loop_release_xfer(lo);
@@ -1047,6 +2514,10 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	 * bd_mutex which is usually taken before lo_ctl_mutex.
 	 */
 	fput(filp);
+	if (cow)
+		loop_cow_release(cow);
+	if (cmp)
+		loop_cmp_free(cmp);
 	return 0;
 }
 
@@ -1066,6 +2537,17 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	/* any offset goes at the default size, as it always did */
+	if (to_loop_priv(lo)->logical_block_size > 512 &&
+	    (info->lo_offset & (to_loop_priv(lo)->logical_block_size - 1)))
+		return -EINVAL;
+
+	/* overlays and compressed images are laid out without transfer */
+	if (loop_remapped(lo) &&
+	    (info->lo_encrypt_type || lo->lo_offset != info->lo_offset ||
+	     lo->lo_sizelimit != info->lo_sizelimit))
+		return -EBUSY;
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -1267,6 +2749,10 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = -ENXIO;
 	if (unlikely(lo->lo_state != Lo_bound))
 		goto out;
+	/* the size is fixed by the delta file or the compressed image */
+	err = -EBUSY;
+	if (loop_remapped(lo))
+		goto out;
 	err = figure_loop_size(lo);
 	if (unlikely(err))
 		goto out;
@@ -1291,6 +2777,12 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 	int err;
 
 	mutex_lock_nested(&lo->lo_ctl_mutex, 1);
+	/* a migration waits for its copy, leave the configuration alone */
+	if (to_loop_priv(lo)->migrating &&
+	    cmd != LOOP_GET_STATUS && cmd != LOOP_GET_STATUS64) {
+		err = -EBUSY;
+		goto out;
+	}
 	switch (cmd) {
 	case LOOP_SET_FD:
 		err = loop_set_fd(lo, mode, bdev, arg);
@@ -1298,6 +2790,20 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 	case LOOP_CHANGE_FD:
 		err = loop_change_fd(lo, bdev, arg);
 		break;
+	case LOOP_SET_DELTA_FD:
+		err = loop_set_delta_fd(lo, mode, bdev, arg);
+		break;
+	case LOOP_SET_COMPRESSED:
+		err = loop_set_compressed(lo, bdev, arg);
+		break;
+	case LOOP_MIGRATE_FD:
+		err = loop_migrate_fd(lo, bdev, arg);
+		break;
+	case LOOP_SET_BLOCK_SIZE:
+		err = -EPERM;
+		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
+			err = loop_set_block_size(lo, bdev, arg);
+		break;
 	case LOOP_CLR_FD:
 		/* loop_clr_fd would have unlocked lo_ctl_mutex on success */
 		err = loop_clr_fd(lo, bdev);
@@ -1324,6 +2830,7 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
+out:
 	mutex_unlock(&lo->lo_ctl_mutex);
 
 out_unlocked:
@@ -1458,8 +2965,10 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 	switch(cmd) {
 	case LOOP_SET_STATUS:
 		mutex_lock(&lo->lo_ctl_mutex);
-		err = loop_set_status_compat(
-			lo, (const struct compat_loop_info __user *) arg);
+		err = -EBUSY;
+		if (!to_loop_priv(lo)->migrating)
+			err = loop_set_status_compat(
+				lo, (const struct compat_loop_info __user *) arg);
 		mutex_unlock(&lo->lo_ctl_mutex);
 		break;
 	case LOOP_GET_STATUS:
@@ -1475,6 +2984,10 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DELTA_FD:
+	case LOOP_SET_BLOCK_SIZE:
+	case LOOP_SET_COMPRESSED:
+	case LOOP_MIGRATE_FD:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1546,6 +3059,8 @@ module_param(max_loop, int, S_IRUGO);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+module_param(parallel_xfer, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(parallel_xfer, "Run transfer functions of multi-page bios on all CPUs");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1587,12 +3102,17 @@ EXPORT_SYMBOL(loop_unregister_transfer);
 
 static struct loop_device *loop_alloc(int i)
 {
+	struct loop_priv *p;
 	struct loop_device *lo;
 	struct gendisk *disk;
 
-	lo = kzalloc(sizeof(*lo), GFP_KERNEL);
-	if (!lo)
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
 		goto out;
+	p->stamp_in = p->stamp_buf[0];
+	p->stamp_out = p->stamp_buf[1];
+	p->logical_block_size = 512;
+	lo = &p->lo;
 
 	lo->lo_queue = blk_alloc_queue(GFP_KERNEL);
 	if (!lo->lo_queue)
@@ -1618,7 +3138,7 @@ static struct loop_device *loop_alloc(int i)
 out_free_queue:
 	blk_cleanup_queue(lo->lo_queue);
 out_free_dev:
-	kfree(lo);
+	kfree(p);
 out:
 	return NULL;
 }
@@ -1628,7 +3148,7 @@ static void loop_free(struct loop_device *lo)
 	blk_cleanup_queue(lo->lo_queue);
 	put_disk(lo->lo_disk);
 	list_del(&lo->lo_list);
-	kfree(lo);
+	kfree(to_loop_priv(lo));
 }
 
 static struct loop_device *loop_init_one(int i)
@@ -1668,6 +3188,36 @@ static struct kobject *loop_probe(dev_t dev, int *part, void *data)
 	return kobj;
 }
 
+static int __init loop_xfer_init(void)
+{
+	loop_xfer_cache = KMEM_CACHE(loop_xfer_job, 0);
+	if (!loop_xfer_cache)
+		goto out;
+	loop_xfer_pool = mempool_create_slab_pool(LOOP_XFER_POOL_MIN,
+						  loop_xfer_cache);
+	if (!loop_xfer_pool)
+		goto out_cache;
+	loop_xfer_wq = alloc_workqueue("loop_xfer",
+				       WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!loop_xfer_wq)
+		goto out_pool;
+	return 0;
+
+out_pool:
+	mempool_destroy(loop_xfer_pool);
+out_cache:
+	kmem_cache_destroy(loop_xfer_cache);
+out:
+	return -ENOMEM;
+}
+
+static void loop_xfer_exit(void)
+{
+	destroy_workqueue(loop_xfer_wq);
+	mempool_destroy(loop_xfer_pool);
+	kmem_cache_destroy(loop_xfer_cache);
+}
+
 static int __init loop_init(void)
 {
 	int i, nr;
@@ -1718,8 +3268,13 @@ static int __init loop_init(void)
 		range = 1UL << MINORBITS;
 	}
 
-	if (register_blkdev(LOOP_MAJOR, "loop"))
+	if (loop_xfer_init())
+		return -ENOMEM;
+
+	if (register_blkdev(LOOP_MAJOR, "loop")) {
+		loop_xfer_exit();
 		return -EIO;
+	}
 
 	for (i = 0; i < nr; i++) {
 		lo = loop_alloc(i);
@@ -1746,6 +3301,7 @@ Enomem:
 		loop_free(lo);
 
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	loop_xfer_exit();
 	return -ENOMEM;
 }
 
@@ -1761,6 +3317,7 @@ static void __exit loop_exit(void)
 
 	blk_unregister_region(MKDEV(LOOP_MAJOR, 0), range);
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	loop_xfer_exit();
 }
 
 module_init(loop_init);
@@ -0,0 +1,235 @@
+/*
+ * loop.h - driver-private definitions for the loop block device
+ *
+ * struct loop_device and the userspace interface live in <linux/loop.h>.
+ * State that only the loop driver itself needs is kept in struct
+ * loop_priv, which embeds the public structure; loop.c allocates the
+ * two together, so container_of() always gets from one to the other.
+ */
+
+#ifndef _DRIVERS_BLOCK_LOOP_H
+#define _DRIVERS_BLOCK_LOOP_H
+
+#include <linux/loop.h>
+#include <linux/ktime.h>
+#include <linux/zlib.h>
+
+/*
+ * Set the logical block size of a bound device (arg in bytes, 512 up to
+ * PAGE_SIZE, or 0 for the block size of the backing file).  Same number
+ * as in later kernels' <linux/loop.h>.
+ */
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE	0x4C09
+#endif
+
+/*
+ * Attach a writable delta file to a bound device (arg is the fd).  The
+ * original backing file becomes a read-only base: writes go to the
+ * delta, reads are served from the delta for blocks written there and
+ * from the base otherwise.
+ */
+#define LOOP_SET_DELTA_FD	0x4C40
+
+/*
+ * On-disk layout of a delta file, all fields little endian:
+ *
+ *   0				struct loop_cow_header
+ *   bitmap_offset		one bit per block, set if the block is
+ *				present in the delta
+ *   data_offset + n * bsize	block n, at the same relative position as
+ *				on the device, so the file stays sparse
+ *
+ * The bitmap is written back on flush/FUA and when the device is torn
+ * down.  Blocks whose bit did not reach the disk are read from the base
+ * again, which is fine since such writes were never acknowledged as
+ * stable.
+ */
+#define LOOP_COW_MAGIC		0x574f434cU	/* "LCOW" */
+#define LOOP_COW_VERSION	1
+#define LOOP_COW_BLOCK_SHIFT	12
+#define LOOP_COW_CHUNK		4096	/* header and bitmap write unit */
+
+struct loop_cow_header {
+	__le32	magic;
+	__le32	version;
+	__le32	block_shift;
+	__le32	pad;
+	__le64	nr_blocks;
+	__le64	bitmap_offset;
+	__le64	data_offset;
+};
+
+struct loop_cow {
+	struct file	*delta;
+	gfp_t		old_gfp_mask;
+	unsigned int	block_shift;
+	u64		nr_blocks;
+	loff_t		bitmap_offset;
+	loff_t		data_offset;
+	size_t		bitmap_size;	/* bytes, multiple of LOOP_COW_CHUNK */
+	unsigned long	*bitmap;	/* little endian, as on disk */
+	unsigned long	*dirty;		/* one bit per bitmap chunk */
+	void		*bounce;	/* one block, for copy-up */
+};
+
+/*
+ * Present a compressed image read-only (arg is the number of decompressed
+ * blocks to cache per device, 0 for the default).  The backing file must
+ * hold, starting at lo_offset:
+ *
+ *   struct loop_cmp_header
+ *   nr_blocks + 1 __le64 offsets, relative to lo_offset; block n is
+ *	stored in [offset[n], offset[n + 1])
+ *   the blocks, each a zlib stream of block_size bytes, or stored raw
+ *	if its length equals block_size
+ *
+ * The last block may be short if image_size is not a multiple of the
+ * block size.
+ */
+#define LOOP_SET_COMPRESSED	0x4C41
+
+#define LOOP_CMP_MAGIC		0x504d434cU	/* "LCMP" */
+#define LOOP_CMP_VERSION	1
+#define LOOP_CMP_MIN_BLOCK	(64 << 10)
+#define LOOP_CMP_MAX_BLOCK	(1 << 20)
+#define LOOP_CMP_MAX_BLOCKS	(1 << 24)	/* 128M offset table */
+
+struct loop_cmp_header {
+	__le32	magic;
+	__le32	version;
+	__le32	block_size;
+	__le32	nr_blocks;
+	__le64	image_size;
+};
+
+/* one decompressed block in the per-device LRU */
+struct loop_cmp_entry {
+	struct list_head	lru;
+	u64			block;
+	void			*data;
+};
+
+#define LOOP_CMP_NO_BLOCK	(~0ULL)
+#define LOOP_CMP_CACHE_DEFAULT	8
+#define LOOP_CMP_CACHE_MAX	64
+
+struct loop_cmp {
+	unsigned int		block_size;
+	unsigned int		block_shift;
+	u64			nr_blocks;
+	u64			image_size;
+	u64			*offsets;	/* nr_blocks + 1, cpu order */
+	void			*cbuf;		/* largest compressed block */
+	struct z_stream_s	zstream;
+	struct list_head	lru;		/* most recently used first */
+	unsigned int		nr_entries;
+	struct loop_cmp_entry	entries[0];
+};
+
+/*
+ * Move a bound device to a new backing file (arg is the fd) while it stays
+ * in use.  The worker copies the old file to the new one a chunk at a time
+ * between rounds of I/O and mirrors writes to the part already copied;
+ * when the copy is complete the new file is synced and replaces the old
+ * one.  The ioctl returns once the device has switched over.  Meanwhile
+ * the device can be opened and closed and its status read, but other
+ * ioctls fail with -EBUSY.
+ */
+#define LOOP_MIGRATE_FD		0x4C42
+#define LOOP_MIGRATE_CHUNK	(256 << 10)
+
+struct loop_migrate {
+	struct file		*file;		/* destination */
+	struct file		*old_file;	/* set on cutover */
+	gfp_t			old_gfp_mask;
+	loff_t			pos;		/* everything below is copied */
+	loff_t			end;
+	void			*buf;		/* one chunk */
+	bool			abort;
+	int			error;
+	struct completion	done;
+};
+
+/* I/O classes accounted separately in the per-device statistics */
+enum {
+	LOOP_STAT_READ,
+	LOOP_STAT_WRITE,
+	LOOP_STAT_FLUSH,
+	LOOP_STAT_NR
+};
+
+/*
+ * Latency histograms are log2 in microseconds: bucket 0 counts samples
+ * below 1us, bucket i samples in [2^(i-1), 2^i) us.  The last bucket
+ * also collects everything slower than that (about 4s).
+ */
+#define LOOP_LAT_BUCKETS	24
+
+struct loop_io_stats {
+	unsigned long	ios;
+	unsigned long	sectors;
+	unsigned long	errors;
+	u64		queue_us;	/* total time spent on lo_bio_list */
+	u64		service_us;	/* total time spent in the backing file */
+	unsigned long	queue_hist[LOOP_LAT_BUCKETS];
+	unsigned long	service_hist[LOOP_LAT_BUCKETS];
+};
+
+/*
+ * Enqueue timestamps are kept for at most this many bios per worker
+ * round; bios beyond that are still serviced and counted, only their
+ * queue time is not sampled.
+ */
+#define LOOP_STAMP_NR		256
+
+struct loop_priv {
+	struct loop_device	lo;
+
+	/*
+	 * Enqueue timestamps of the bios on lo_bio_list, in list order.
+	 * stamp_in and stamp_nr are protected by lo_lock; the worker swaps
+	 * the two buffers when it splices lo_bio_list and then owns
+	 * stamp_out exclusively.
+	 */
+	ktime_t			*stamp_in;
+	unsigned int		stamp_nr;
+	ktime_t			*stamp_out;
+	unsigned int		stamp_out_nr;
+	unsigned int		stamp_out_idx;
+	ktime_t			stamp_buf[2][LOOP_STAMP_NR];
+
+	/* only updated by the worker thread, read locklessly from sysfs */
+	struct loop_io_stats	stats[LOOP_STAT_NR];
+
+	/* advertised logical block size; bios not aligned to it are failed */
+	unsigned int		logical_block_size;
+
+	/* copy-on-write delta, installed by the worker under lo_lock */
+	struct loop_cow		*cow;
+
+	/* compressed image, installed by the worker under lo_lock */
+	struct loop_cmp		*cmp;
+
+	/* running migration, installed and removed by the worker under lo_lock */
+	struct loop_migrate	*migrate;
+
+	/* LOOP_MIGRATE_FD waits without lo_ctl_mutex, under which this is set */
+	bool			migrating;
+};
+
+static inline struct loop_priv *to_loop_priv(struct loop_device *lo)
+{
+	return container_of(lo, struct loop_priv, lo);
+}
+
+/*
+ * True if device blocks do not map 1:1 onto the backing file, so offset,
+ * size and transfer changes are not allowed.
+ */
+static inline bool loop_remapped(struct loop_device *lo)
+{
+	return to_loop_priv(lo)->cow || to_loop_priv(lo)->cmp;
+}
+
+#endif /* _DRIVERS_BLOCK_LOOP_H */
@@ -0,0 +1,140 @@
+#!/usr/bin/env bash
+
+# Benchmark nbd over loopback against the reference server in nbdref.c
+#
+# Attaches a device over TCP on localhost and over a unix socket, runs an
+# fio matrix of block size x queue depth x access pattern on one
+# connection, then sweeps the number of connections at a fixed point.
+# Results go to stdout (or -o file) as CSV.
+#
+# With -S the device asks for structured replies, so zeroed ranges of
+# reads come over as holes.
+#
+# Must be run as root, with the nbd module and fio available.
+#
+# usage: bench.sh [-d /dev/nbdX] [-f backing file] [-s size] [-r seconds]
+#                 [-o results.csv] [-S]
+
+set -e
+
+DEV=/dev/nbd0
+FILE=
+SIZE=1G
+RUNTIME=10
+OUT=/dev/stdout
+PORT=10809
+SOCK=/tmp/nbdref.$$.sock
+ATTACH_OPTS=
+
+BLOCK_SIZES="4k 64k 1m"
+IODEPTHS="1 8 32"
+PATTERNS="randread randwrite read write"
+CONNS="1 2 4 8"
+
+while getopts "d:f:s:r:o:S" opt; do
+	case $opt in
+	d) DEV=$OPTARG ;;
+	f) FILE=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	r) RUNTIME=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	S) ATTACH_OPTS=-S ;;
+	*) sed -n '3,17p' "$0"; exit 1 ;;
+	esac
+done
+
+# paths are taken relative to where we were started
+case $OUT in /*) ;; *) OUT=$PWD/$OUT ;; esac
+case $FILE in /*|"") ;; *) FILE=$PWD/$FILE ;; esac
+
+cd "$(dirname "$0")"
+make -s nbdref
+modprobe nbd 2>/dev/null || true
+
+SERVER_PIDS=
+ATTACH_PID=
+
+cleanup() {
+	detach
+	if [ -n "$SERVER_PIDS" ]; then
+		kill $SERVER_PIDS 2>/dev/null || true
+	fi
+	rm -f "$SOCK"
+}
+trap cleanup EXIT
+
+start_servers() {
+	local backing=
+	[ -n "$FILE" ] && backing="-f $FILE"
+	./nbdref serve -p $PORT -s $SIZE $backing &
+	SERVER_PIDS="$SERVER_PIDS $!"
+	./nbdref serve -u "$SOCK" -s $SIZE $backing &
+	SERVER_PIDS="$SERVER_PIDS $!"
+	sleep 1
+}
+
+# attach <transport> <conns>
+attach() {
+	if [ "$1" = tcp ]; then
+		./nbdref attach -d $DEV -p $PORT -c $2 $ATTACH_OPTS &
+	else
+		./nbdref attach -d $DEV -u "$SOCK" -c $2 $ATTACH_OPTS &
+	fi
+	ATTACH_PID=$!
+	# the size is set just before NBD_DO_IT
+	for i in $(seq 50); do
+		[ "$(blockdev --getsize64 $DEV 2>/dev/null)" != 0 ] && return
+		sleep 0.1
+	done
+	echo "bench.sh: $DEV did not come up" >&2
+	exit 1
+}
+
+detach() {
+	[ -z "$ATTACH_PID" ] && return
+	./nbdref detach -d $DEV || true
+	wait $ATTACH_PID || true
+	ATTACH_PID=
+}
+
+# run_fio <transport> <conns> <pattern> <bs> <iodepth>
+#
+# In fio's terse format version 3, fields 7, 8 and 40 are read
+# bandwidth (KiB/s), IOPS and mean latency (us); 48, 49 and 81 are the
+# same for writes.
+run_fio() {
+	local line
+	line=$(fio --name=nbd --filename=$DEV --direct=1 --ioengine=libaio \
+		--rw=$3 --bs=$4 --iodepth=$5 --runtime=$RUNTIME --time_based \
+		--group_reporting --output-format=terse --terse-version=3)
+	echo "$line" | awk -F';' -v t=$1 -v c=$2 -v rw=$3 -v bs=$4 -v qd=$5 '
+		{
+			if (rw ~ /read/)
+				printf "%s,%s,%s,%s,%s,%s,%s,%.1f\n", t, c, rw, bs, qd, $8, $7, $40
+			else
+				printf "%s,%s,%s,%s,%s,%s,%s,%.1f\n", t, c, rw, bs, qd, $49, $48, $81
+		}'
+}
+
+start_servers
+
+echo "transport,conns,rw,bs,iodepth,iops,bw_kib,lat_mean_us" > "$OUT"
+for transport in tcp unix; do
+	attach $transport 1
+	for bs in $BLOCK_SIZES; do
+		for qd in $IODEPTHS; do
+			for rw in $PATTERNS; do
+				run_fio $transport 1 $rw $bs $qd >> "$OUT"
+			done
+		done
+	done
+	detach
+
+	for conns in $CONNS; do
+		attach $transport $conns
+		for rw in randread randwrite; do
+			run_fio $transport $conns $rw 4k 32 >> "$OUT"
+		done
+		detach
+	done
+done
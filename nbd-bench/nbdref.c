@@ -0,0 +1,839 @@
+/*
+ * nbdref - reference server and client for benchmarking nbd
+ *
+ * A deliberately small implementation of the NBD protocol as spoken by
+ * drivers/block/nbd.c, so that the driver can be measured over loopback
+ * without an external nbd-server:
+ *
+ *   nbdref serve  [-p port | -u path] [-f file] [-s size] [-r]
+ *	Export a memory buffer (1G by default) or a file over TCP on
+ *	127.0.0.1 or over a unix socket.  Every connection gets the fixed
+ *	newstyle handshake and is served by its own thread.
+ *
+ *   nbdref attach -d /dev/nbdX [-H host] [-p port | -u path] [-c conns]
+ *		   [-t timeout] [-S] [-W]
+ *	Open conns connections to a server, hand them to the device and
+ *	run it until it is disconnected.  With -S, ask for structured
+ *	replies, so that the server sends zeroed ranges of reads as holes.
+ *	With -W, tell the driver that it is the only writer to the export,
+ *	which lets it use its read cache (see /sys/block/nbdX/read_cache).
+ *
+ *   nbdref detach -d /dev/nbdX
+ *	Disconnect a running device.
+ *
+ * The server supports FLUSH, FUA and TRIM, and advertises them.  Requests
+ * on one connection are served in order, so the queue depth seen by the
+ * server is the number of connections.
+ *
+ * This file is released under GPLv2 or later.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <endian.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/fs.h>
+#include <linux/nbd.h>
+
+#ifndef NBD_SET_FLAGS
+#define NBD_SET_FLAGS		_IO(0xab, 10)
+#endif
+#ifndef NBD_FLAG_HAS_FLAGS
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)
+#define NBD_FLAG_SEND_FUA	(1 << 3)
+#define NBD_FLAG_SEND_TRIM	(1 << 5)
+#endif
+#ifndef NBD_FLAG_CAN_MULTI_CONN
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
+#endif
+#ifndef NBD_CMD_FLUSH
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_TRIM		4
+#endif
+#ifndef NBD_CMD_FLAG_FUA
+#define NBD_CMD_FLAG_FUA	(1 << 16)
+#endif
+
+/* the driver's own flags, see nbd.h */
+#ifndef NBD_FLAG_STRUCTURED_REPLY
+#define NBD_FLAG_STRUCTURED_REPLY	(1 << 16)
+#endif
+#ifndef NBD_FLAG_SINGLE_WRITER
+#define NBD_FLAG_SINGLE_WRITER		(1 << 17)
+#endif
+
+/* fixed newstyle handshake */
+#define NBD_OPTS_MAGIC		0x49484156454F5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x3e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_REP_ACK		1
+#define NBD_REP_ERR_UNSUP	((1U << 31) | 1)
+#define NBD_REP_ERR_INVALID	((1U << 31) | 3)
+#define NBD_MAX_OPT_LEN		4096
+
+struct nbd_hello {
+	char		magic[8];	/* "NBDMAGIC" */
+	uint64_t	opts_magic;
+	uint16_t	flags;
+} __attribute__ ((packed));
+
+struct nbd_option {
+	uint64_t	magic;
+	uint32_t	option;
+	uint32_t	length;
+} __attribute__ ((packed));
+
+struct nbd_option_reply {
+	uint64_t	magic;
+	uint32_t	option;
+	uint32_t	type;
+	uint32_t	length;
+} __attribute__ ((packed));
+
+struct nbd_export_info {
+	uint64_t	size;
+	uint16_t	flags;
+} __attribute__ ((packed));
+
+/* structured replies */
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668e33ef
+#define NBD_REPLY_FLAG_DONE		(1 << 0)
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_OFFSET_HOLE	2
+#define NBD_REPLY_TYPE_ERROR		((1 << 15) + 1)
+
+struct nbd_chunk {
+	uint32_t	magic;
+	uint16_t	flags;
+	uint16_t	type;
+	char		handle[8];
+	uint32_t	length;
+	uint64_t	offset;		/* or error + message length */
+	uint32_t	hole_size;
+} __attribute__ ((packed));
+
+#define NBD_CHUNK_HDR		20	/* up to length */
+#define NBDREF_HOLE_GRAIN	4096	/* zeroed runs are found in these */
+#define NBD_MAX_CONNS		8
+#define NBDREF_DEFAULT_PORT	10809
+#define NBDREF_MAX_LEN		(32 << 20)
+#define NBDREF_DEFAULT_SIZE	(1ULL << 30)
+
+struct export {
+	int		fd;		/* -1 if memory backed */
+	char		*mem;
+	uint64_t	size;
+	uint32_t	flags;		/* NBD_FLAG_* */
+};
+
+static struct export exp = { .fd = -1 };
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* the export itself; returns 0 or an errno for the reply */
+static int exp_read(char *buf, uint64_t from, uint32_t len)
+{
+	if (exp.fd < 0) {
+		memcpy(buf, exp.mem + from, len);
+		return 0;
+	}
+	return pread(exp.fd, buf, len, from) == len ? 0 : EIO;
+}
+
+static int exp_write(const char *buf, uint64_t from, uint32_t len, bool fua)
+{
+	if (exp.fd < 0) {
+		memcpy(exp.mem + from, buf, len);
+		return 0;
+	}
+	if (pwrite(exp.fd, buf, len, from) != len)
+		return EIO;
+	if (fua && fdatasync(exp.fd))
+		return EIO;
+	return 0;
+}
+
+static int exp_flush(void)
+{
+	if (exp.fd >= 0 && fdatasync(exp.fd))
+		return EIO;
+	return 0;
+}
+
+static int exp_trim(uint64_t from, uint32_t len)
+{
+	if (exp.fd < 0) {
+		memset(exp.mem + from, 0, len);
+		return 0;
+	}
+	/* a hint only, failure is not an error */
+	fallocate(exp.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  from, len);
+	return 0;
+}
+
+static int send_option_reply(int sock, uint32_t option, uint32_t type)
+{
+	struct nbd_option_reply reply = {
+		.magic = htobe64(NBD_REP_MAGIC),
+		.option = htobe32(option),
+		.type = htobe32(type),
+	};
+
+	return write_all(sock, &reply, sizeof(reply));
+}
+
+/*
+ * Fixed newstyle negotiation, up to NBD_OPT_EXPORT_NAME.  The export has
+ * no name, any name is accepted.  Returns 0 when transmission starts.
+ */
+static int negotiate(int sock, bool *structured)
+{
+	struct nbd_hello hello = {
+		.magic = "NBDMAGIC",
+		.opts_magic = htobe64(NBD_OPTS_MAGIC),
+		.flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+	};
+	struct nbd_export_info info = {
+		.size = htobe64(exp.size),
+		.flags = htobe16(exp.flags),
+	};
+	static const char zeroes[124];
+	char data[NBD_MAX_OPT_LEN];
+	uint32_t cflags;
+
+	*structured = false;
+	if (write_all(sock, &hello, sizeof(hello)) ||
+	    read_all(sock, &cflags, sizeof(cflags)))
+		return -1;
+	cflags = be32toh(cflags);
+
+	for (;;) {
+		struct nbd_option opt;
+		uint32_t option, len;
+
+		if (read_all(sock, &opt, sizeof(opt)) ||
+		    be64toh(opt.magic) != NBD_OPTS_MAGIC)
+			return -1;
+		option = be32toh(opt.option);
+		len = be32toh(opt.length);
+		if (len > sizeof(data) || read_all(sock, data, len))
+			return -1;
+
+		switch (option) {
+		case NBD_OPT_EXPORT_NAME:
+			if (write_all(sock, &info, sizeof(info)))
+				return -1;
+			if (!(cflags & NBD_FLAG_NO_ZEROES) &&
+			    write_all(sock, zeroes, sizeof(zeroes)))
+				return -1;
+			return 0;
+		case NBD_OPT_ABORT:
+			send_option_reply(sock, option, NBD_REP_ACK);
+			return -1;
+		case NBD_OPT_STRUCTURED_REPLY:
+			if (len) {
+				if (send_option_reply(sock, option,
+						      NBD_REP_ERR_INVALID))
+					return -1;
+				break;
+			}
+			*structured = true;
+			if (send_option_reply(sock, option, NBD_REP_ACK))
+				return -1;
+			break;
+		default:
+			if (send_option_reply(sock, option, NBD_REP_ERR_UNSUP))
+				return -1;
+		}
+	}
+}
+
+static bool is_zero(const char *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+static int send_chunk(int sock, const char *handle, uint16_t type,
+		      bool done, uint64_t offset, const char *data,
+		      uint32_t len)
+{
+	struct nbd_chunk chunk = {
+		.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC),
+		.flags = htobe16(done ? NBD_REPLY_FLAG_DONE : 0),
+		.type = htobe16(type),
+		.offset = htobe64(offset),
+	};
+	size_t hdr = NBD_CHUNK_HDR + sizeof(chunk.offset);
+
+	memcpy(chunk.handle, handle, sizeof(chunk.handle));
+	if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+		chunk.hole_size = htobe32(len);
+		hdr += sizeof(chunk.hole_size);
+		len = 0;
+	}
+	chunk.length = htobe32(hdr - NBD_CHUNK_HDR + len);
+	if (write_all(sock, &chunk, hdr))
+		return -1;
+	return len ? write_all(sock, data, len) : 0;
+}
+
+/*
+ * Reply to a read with structured chunks: runs of zeroed blocks go out as
+ * holes, everything else as data.
+ */
+static int send_read_chunks(int sock, const char *handle, const char *buf,
+			    uint64_t from, uint32_t len)
+{
+	uint32_t off = 0, end, n;
+	bool hole;
+
+	if (!len) {
+		struct nbd_chunk chunk = {
+			.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC),
+			.flags = htobe16(NBD_REPLY_FLAG_DONE),
+		};
+
+		memcpy(chunk.handle, handle, sizeof(chunk.handle));
+		return write_all(sock, &chunk, NBD_CHUNK_HDR);
+	}
+
+	while (off < len) {
+		n = len - off < NBDREF_HOLE_GRAIN ? len - off :
+			NBDREF_HOLE_GRAIN;
+		hole = is_zero(buf + off, n);
+		for (end = off + n; end < len; end += n) {
+			n = len - end < NBDREF_HOLE_GRAIN ? len - end :
+				NBDREF_HOLE_GRAIN;
+			if (is_zero(buf + end, n) != hole)
+				break;
+		}
+		if (send_chunk(sock, handle, hole ? NBD_REPLY_TYPE_OFFSET_HOLE :
+			       NBD_REPLY_TYPE_OFFSET_DATA, end == len,
+			       from + off, buf + off, end - off))
+			return -1;
+		off = end;
+	}
+	return 0;
+}
+
+static int send_read_error(int sock, const char *handle, int error)
+{
+	struct nbd_chunk chunk = {
+		.magic = htobe32(NBD_STRUCTURED_REPLY_MAGIC),
+		.flags = htobe16(NBD_REPLY_FLAG_DONE),
+		.type = htobe16(NBD_REPLY_TYPE_ERROR),
+		.length = htobe32(6),	/* error, empty message */
+	};
+	uint32_t err = htobe32(error);
+
+	memcpy(chunk.handle, handle, sizeof(chunk.handle));
+	memcpy(&chunk.offset, &err, sizeof(err));
+	return write_all(sock, &chunk, NBD_CHUNK_HDR + 6);
+}
+
+static void *serve_conn(void *arg)
+{
+	int sock = (intptr_t)arg;
+	bool structured;
+	char *buf = NULL;
+
+	if (negotiate(sock, &structured))
+		goto out;
+
+	buf = malloc(NBDREF_MAX_LEN);
+	if (!buf)
+		goto out;
+
+	for (;;) {
+		struct nbd_request req;
+		struct nbd_reply reply;
+		uint32_t type, len;
+		uint64_t from;
+		int error = 0;
+
+		if (read_all(sock, &req, sizeof(req)))
+			break;
+		if (be32toh(req.magic) != NBD_REQUEST_MAGIC) {
+			fprintf(stderr, "nbdref: bad request magic\n");
+			break;
+		}
+		type = be32toh(req.type);
+		from = be64toh(req.from);
+		len = be32toh(req.len);
+
+		reply.magic = htobe32(NBD_REPLY_MAGIC);
+		memcpy(reply.handle, req.handle, sizeof(reply.handle));
+
+		switch (type & 0xffff) {
+		case NBD_CMD_DISC:
+			goto out;
+		case NBD_CMD_FLUSH:
+			error = exp_flush();
+			break;
+		case NBD_CMD_READ:
+		case NBD_CMD_WRITE:
+		case NBD_CMD_TRIM:
+			if (len > NBDREF_MAX_LEN || from > exp.size ||
+			    len > exp.size - from) {
+				/* the payload of a bad write cannot be skipped */
+				if ((type & 0xffff) == NBD_CMD_WRITE)
+					goto out;
+				error = EINVAL;
+				len = 0;
+				break;
+			}
+			if ((type & 0xffff) == NBD_CMD_READ) {
+				error = exp_read(buf, from, len);
+			} else if ((type & 0xffff) == NBD_CMD_WRITE) {
+				if (read_all(sock, buf, len))
+					goto out;
+				if (exp.flags & NBD_FLAG_READ_ONLY)
+					error = EPERM;
+				else
+					error = exp_write(buf, from, len,
+						type & NBD_CMD_FLAG_FUA);
+			} else {
+				error = exp_trim(from, len);
+			}
+			break;
+		default:
+			error = EINVAL;
+		}
+
+		if (structured && (type & 0xffff) == NBD_CMD_READ) {
+			if (error ? send_read_error(sock, req.handle, error) :
+			    send_read_chunks(sock, req.handle, buf, from, len))
+				break;
+			continue;
+		}
+
+		reply.error = htobe32(error);
+		if (write_all(sock, &reply, sizeof(reply)))
+			break;
+		if ((type & 0xffff) == NBD_CMD_READ && !error &&
+		    write_all(sock, buf, len))
+			break;
+	}
+out:
+	free(buf);
+	close(sock);
+	return NULL;
+}
+
+static int listen_on(const char *path, int port)
+{
+	int fd, one = 1;
+
+	if (path) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		if (strlen(path) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "nbdref: socket path too long\n");
+			exit(1);
+		}
+		strcpy(sun.sun_path, path);
+		unlink(path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			die("socket");
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)))
+			die("bind");
+	} else {
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_port = htons(port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			die("socket");
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+			die("bind");
+	}
+	if (listen(fd, NBD_MAX_CONNS))
+		die("listen");
+	return fd;
+}
+
+static int do_serve(const char *path, int port, const char *file,
+		    uint64_t size, bool ro)
+{
+	int lfd;
+
+	/* all connections share one file, a flush syncs all of them */
+	exp.flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+		    NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM |
+		    NBD_FLAG_CAN_MULTI_CONN;
+	if (ro)
+		exp.flags |= NBD_FLAG_READ_ONLY;
+
+	if (file) {
+		struct stat st;
+
+		exp.fd = open(file, (ro ? O_RDONLY : O_RDWR) | O_CREAT, 0600);
+		if (exp.fd < 0)
+			die(file);
+		if (fstat(exp.fd, &st))
+			die("fstat");
+		if (size && (uint64_t)st.st_size < size &&
+		    ftruncate(exp.fd, size))
+			die("ftruncate");
+		exp.size = size ? size : (uint64_t)st.st_size;
+	} else {
+		exp.size = size ? size : NBDREF_DEFAULT_SIZE;
+		exp.mem = mmap(NULL, exp.size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			       -1, 0);
+		if (exp.mem == MAP_FAILED)
+			die("mmap");
+	}
+	if (!exp.size) {
+		fprintf(stderr, "nbdref: empty export\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	lfd = listen_on(path, port);
+	for (;;) {
+		pthread_t thread;
+		int sock, one = 1;
+
+		sock = accept(lfd, NULL, NULL);
+		if (sock < 0) {
+			if (errno == EINTR)
+				continue;
+			die("accept");
+		}
+		if (!path)
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one,
+				   sizeof(one));
+		if (pthread_create(&thread, NULL, serve_conn,
+				   (void *)(intptr_t)sock)) {
+			close(sock);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+static int connect_to(const char *host, const char *path, int port)
+{
+	int fd, one = 1;
+
+	if (path) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			die("socket");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)))
+			die(path);
+	} else {
+		struct addrinfo hints = {
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM,
+		};
+		struct addrinfo *ai;
+		char service[16];
+		int ret;
+
+		snprintf(service, sizeof(service), "%d", port);
+		ret = getaddrinfo(host, service, &hints, &ai);
+		if (ret) {
+			fprintf(stderr, "nbdref: %s: %s\n", host,
+				gai_strerror(ret));
+			exit(1);
+		}
+		fd = socket(ai->ai_family, SOCK_STREAM, 0);
+		if (fd < 0)
+			die("socket");
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen))
+			die(host);
+		freeaddrinfo(ai);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+/*
+ * Fixed newstyle handshake, asking for structured replies if structured
+ * is set.  Returns the export size and the flags for NBD_SET_FLAGS.
+ */
+static void handshake(int sock, bool structured, uint64_t *size,
+		      uint32_t *flags)
+{
+	struct nbd_hello hello;
+	struct nbd_export_info info;
+	struct nbd_option opt = { .magic = htobe64(NBD_OPTS_MAGIC) };
+	uint32_t cflags;
+	char zeroes[124];
+
+	if (read_all(sock, &hello, sizeof(hello)))
+		die("handshake");
+	if (memcmp(hello.magic, "NBDMAGIC", 8) ||
+	    be64toh(hello.opts_magic) != NBD_OPTS_MAGIC ||
+	    !(be16toh(hello.flags) & NBD_FLAG_FIXED_NEWSTYLE)) {
+		fprintf(stderr, "nbdref: not a fixed newstyle nbd server\n");
+		exit(1);
+	}
+	cflags = be16toh(hello.flags) &
+		 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	cflags = htobe32(cflags);
+	if (write_all(sock, &cflags, sizeof(cflags)))
+		die("handshake");
+	cflags = be32toh(cflags);
+
+	*flags = 0;
+	if (structured) {
+		struct nbd_option_reply reply;
+		char data[NBD_MAX_OPT_LEN];
+
+		opt.option = htobe32(NBD_OPT_STRUCTURED_REPLY);
+		if (write_all(sock, &opt, sizeof(opt)) ||
+		    read_all(sock, &reply, sizeof(reply)) ||
+		    be64toh(reply.magic) != NBD_REP_MAGIC ||
+		    be32toh(reply.length) > sizeof(data) ||
+		    read_all(sock, data, be32toh(reply.length)))
+			die("handshake");
+		if (be32toh(reply.type) == NBD_REP_ACK)
+			*flags |= NBD_FLAG_STRUCTURED_REPLY;
+		else
+			fprintf(stderr, "nbdref: no structured replies\n");
+	}
+
+	opt.option = htobe32(NBD_OPT_EXPORT_NAME);
+	if (write_all(sock, &opt, sizeof(opt)) ||
+	    read_all(sock, &info, sizeof(info)))
+		die("handshake");
+	if (!(cflags & NBD_FLAG_NO_ZEROES) &&
+	    read_all(sock, zeroes, sizeof(zeroes)))
+		die("handshake");
+	*size = be64toh(info.size);
+	*flags |= be16toh(info.flags);
+}
+
+static int do_attach(const char *dev, const char *host, const char *path,
+		     int port, int conns, int timeout, bool structured,
+		     bool single_writer)
+{
+	uint64_t size = 0, s;
+	uint32_t flags = 0, f;
+	int nbd, i, ret;
+
+	nbd = open(dev, O_RDWR);
+	if (nbd < 0)
+		die(dev);
+
+	for (i = 0; i < conns; i++) {
+		int sock = connect_to(host, path, port);
+
+		handshake(sock, structured, &s, &f);
+		if (i && (s != size || f != flags)) {
+			fprintf(stderr, "nbdref: export changed between "
+				"connections\n");
+			return 1;
+		}
+		size = s;
+		flags = f;
+		if (ioctl(nbd, NBD_SET_SOCK, sock) < 0)
+			die("NBD_SET_SOCK");
+		close(sock);
+	}
+
+	if (ioctl(nbd, NBD_SET_BLKSIZE, 4096UL) < 0)
+		die("NBD_SET_BLKSIZE");
+	if (ioctl(nbd, NBD_SET_SIZE_BLOCKS, (unsigned long)(size >> 12)) < 0)
+		die("NBD_SET_SIZE_BLOCKS");
+	if (single_writer)
+		flags |= NBD_FLAG_SINGLE_WRITER;
+	if (ioctl(nbd, NBD_SET_FLAGS, (unsigned long)flags) < 0)
+		perror("NBD_SET_FLAGS");	/* older kernels */
+	if (timeout && ioctl(nbd, NBD_SET_TIMEOUT, (unsigned long)timeout) < 0)
+		die("NBD_SET_TIMEOUT");
+
+	ret = ioctl(nbd, NBD_DO_IT);
+	if (ret < 0)
+		perror("NBD_DO_IT");
+	ioctl(nbd, NBD_CLEAR_QUE);
+	ioctl(nbd, NBD_CLEAR_SOCK);
+	close(nbd);
+	return ret < 0;
+}
+
+static int do_detach(const char *dev)
+{
+	int nbd = open(dev, O_RDWR);
+
+	if (nbd < 0)
+		die(dev);
+	if (ioctl(nbd, NBD_DISCONNECT) < 0)
+		die("NBD_DISCONNECT");
+	close(nbd);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: nbdref serve  [-p port | -u path] [-f file] [-s size] [-r]\n"
+		"       nbdref attach -d dev [-H host] [-p port | -u path] "
+		"[-c conns] [-t timeout] [-S] [-W]\n"
+		"       nbdref detach -d dev\n");
+	exit(1);
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	const char *cmd, *dev = NULL, *host = "127.0.0.1", *path = NULL;
+	const char *file = NULL;
+	uint64_t size = 0;
+	int port = NBDREF_DEFAULT_PORT, conns = 1, timeout = 0, opt;
+	bool ro = false, structured = false, single_writer = false;
+
+	if (argc < 2)
+		usage();
+	cmd = argv[1];
+	argv++;
+	argc--;
+
+	while ((opt = getopt(argc, argv, "c:d:f:H:p:rs:St:u:W")) != -1) {
+		switch (opt) {
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			ro = true;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'S':
+			structured = true;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		case 'W':
+			single_writer = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!strcmp(cmd, "serve"))
+		return do_serve(path, port, file, size, ro);
+	if (!dev)
+		usage();
+	if (!strcmp(cmd, "attach")) {
+		if (conns < 1 || conns > NBD_MAX_CONNS) {
+			fprintf(stderr, "nbdref: 1 to %d connections\n",
+				NBD_MAX_CONNS);
+			return 1;
+		}
+		return do_attach(dev, host, path, port, conns, timeout,
+				 structured, single_writer);
+	}
+	if (!strcmp(cmd, "detach"))
+		return do_detach(dev);
+	usage();
+	return 1;
+}
@@ -32,12 +32,15 @@
 #include <net/sock.h>
 #include <linux/net.h>
 #include <linux/kthread.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 #include <asm/system.h>
 #include <asm/types.h>
 
-#include <linux/nbd.h>
+#include "nbd.h"
 
 #define LO_MAGIC 0x68797548
 
@@ -57,7 +60,7 @@ static unsigned int debugflags;
 #endif /* NDEBUG */
 
 static unsigned int nbds_max = 16;
-static struct nbd_device *nbd_dev;
+static struct nbd_priv *nbd_dev;
 static int max_part;
 
 /*
@@ -85,6 +88,8 @@ static const char *ioctl_cmd_to_ascii(int cmd)
 	case NBD_PRINT_DEBUG: return "print-debug";
 	case NBD_SET_SIZE_BLOCKS: return "set-size-blocks";
 	case NBD_DISCONNECT: return "disconnect";
+	case NBD_SET_FLAGS: return "set-flags";
+	case NBD_SET_RECONNECT: return "set-reconnect";
 	case BLKROSET: return "set-read-only";
 	case BLKFLSBUF: return "flush-buffer-cache";
 	}
@@ -97,6 +102,8 @@ static const char *nbdcmd_to_ascii(int cmd)
 	case  NBD_CMD_READ: return "read";
 	case NBD_CMD_WRITE: return "write";
 	case  NBD_CMD_DISC: return "disconnect";
+	case NBD_CMD_FLUSH: return "flush";
+	case  NBD_CMD_TRIM: return "trim";
 	}
 	return "invalid";
 }
@@ -116,60 +123,415 @@ static void nbd_end_request(struct request *req)
 	spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
-static void sock_shutdown(struct nbd_device *lo, int lock)
+static bool nbd_cache_on(struct nbd_device *lo)
 {
-	/* Forcibly shutdown the socket causing all listeners
-	 * to error
-	 *
-	 * FIXME: This code is duplicated from sys_shutdown, but
-	 * there should be a more generic interface rather than
-	 * calling socket ops directly here */
-	if (lock)
-		mutex_lock(&lo->tx_lock);
-	if (lo->sock) {
-		printk(KERN_WARNING "%s: shutting down socket\n",
-			lo->disk->disk_name);
-		kernel_sock_shutdown(lo->sock, SHUT_RDWR);
-		lo->sock = NULL;
+	struct nbd_priv *p = to_nbd_priv(lo);
+
+	return p->cache.max && (p->server_flags & NBD_FLAG_SINGLE_WRITER);
+}
+
+/* the cache functions below are called with cache->lock held */
+static struct nbd_cache_entry *nbd_cache_find(struct nbd_cache *cache,
+					      u64 block)
+{
+	struct nbd_cache_entry *e;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(e, node,
+			     &cache->hash[hash_64(block, cache->hash_bits)],
+			     hash)
+		if (e->block == block)
+			return e;
+	return NULL;
+}
+
+static void nbd_cache_drop(struct nbd_cache *cache, struct nbd_cache_entry *e)
+{
+	list_del(&e->lru);
+	hlist_del(&e->hash);
+	__free_page(e->page);
+	kfree(e);
+	cache->nr--;
+}
+
+static void nbd_cache_clear(struct nbd_cache *cache)
+{
+	while (!list_empty(&cache->lru))
+		nbd_cache_drop(cache, list_entry(cache->lru.next,
+				struct nbd_cache_entry, lru));
+	cache->gen++;
+}
+
+/* drop the blocks overlapping len bytes at pos */
+static void nbd_cache_invalidate(struct nbd_cache *cache, u64 pos, u64 len)
+{
+	struct nbd_cache_entry *e, *tmp;
+	u64 block, last;
+
+	cache->gen++;
+	if (!len || !cache->nr)
+		return;
+
+	block = pos >> NBD_CACHE_SHIFT;
+	last = (pos + len - 1) >> NBD_CACHE_SHIFT;
+	if (last - block >= cache->nr) {
+		/* a large trim, walking the cache is cheaper */
+		list_for_each_entry_safe(e, tmp, &cache->lru, lru)
+			if (e->block >= block && e->block <= last)
+				nbd_cache_drop(cache, e);
+		return;
 	}
-	if (lock)
-		mutex_unlock(&lo->tx_lock);
+	for (; block <= last; block++) {
+		e = nbd_cache_find(cache, block);
+		if (e)
+			nbd_cache_drop(cache, e);
+	}
+}
+
+/*
+ * The entry for block, most recently used from now on.  A new one takes
+ * the place of the least recently used entry once the cache is full.
+ * Returns NULL if there is no memory; the caller fills in the data.
+ */
+static struct nbd_cache_entry *nbd_cache_get(struct nbd_cache *cache,
+					     u64 block)
+{
+	struct nbd_cache_entry *e = nbd_cache_find(cache, block);
+
+	if (e)
+		goto found;
+
+	if (cache->nr < cache->max) {
+		e = kmalloc(sizeof(*e), GFP_NOWAIT);
+		if (!e)
+			return NULL;
+		e->page = alloc_page(GFP_NOWAIT);
+		if (!e->page) {
+			kfree(e);
+			return NULL;
+		}
+		list_add(&e->lru, &cache->lru);
+		cache->nr++;
+	} else {
+		if (list_empty(&cache->lru))
+			return NULL;
+		e = list_entry(cache->lru.prev, struct nbd_cache_entry, lru);
+		hlist_del(&e->hash);
+	}
+	e->block = block;
+	hlist_add_head(&e->hash,
+		       &cache->hash[hash_64(block, cache->hash_bits)]);
+found:
+	list_move(&e->lru, &cache->lru);
+	return e;
 }
 
-static void nbd_xmit_timeout(unsigned long arg)
+/* copy n bytes between a bio page and a cache entry */
+static void nbd_cache_copy(struct bio_vec *bvec, unsigned int bv_off,
+			   struct nbd_cache_entry *e, unsigned int off,
+			   unsigned int n, bool to_cache)
 {
-	struct task_struct *task = (struct task_struct *)arg;
+	char *kaddr = kmap_atomic(bvec->bv_page, KM_USER0);
+	char *data = page_address(e->page) + off;
 
-	printk(KERN_WARNING "nbd: killing hung xmit (%s, pid: %d)\n",
-		task->comm, task->pid);
-	force_sig(SIGKILL, task);
+	if (to_cache) {
+		memcpy(data, kaddr + bv_off, n);
+	} else {
+		memcpy(kaddr + bv_off, data, n);
+		flush_dcache_page(bvec->bv_page);
+	}
+	kunmap_atomic(kaddr, KM_USER0);
 }
 
 /*
- *  Send or receive packet.
+ * Complete a read from the cache if every block it touches is there.
+ * Otherwise remember the cache generation in req->special, which nbd does
+ * not use for anything else, for nbd_cache_fill().
  */
-static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
-		int msg_flags)
+static bool nbd_cache_read(struct nbd_device *lo, struct request *req)
 {
-	struct socket *sock = lo->sock;
-	int result;
-	struct msghdr msg;
-	struct kvec iov;
-	sigset_t blocked, oldset;
+	struct nbd_cache *cache = &to_nbd_priv(lo)->cache;
+	u64 pos = (u64)blk_rq_pos(req) << 9;
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	u64 block, last;
+
+	spin_lock_irq(&cache->lock);
+	req->special = (void *)(unsigned long)cache->gen;
+	if (!blk_rq_bytes(req))
+		goto miss;
+	last = (pos + blk_rq_bytes(req) - 1) >> NBD_CACHE_SHIFT;
+	for (block = pos >> NBD_CACHE_SHIFT; block <= last; block++)
+		if (!nbd_cache_find(cache, block))
+			goto miss;
+
+	rq_for_each_segment(bvec, req, iter) {
+		unsigned int done = 0, off, n;
+
+		while (done < bvec->bv_len) {
+			off = pos & (NBD_CACHE_BLOCK - 1);
+			n = min(bvec->bv_len - done, NBD_CACHE_BLOCK - off);
+			nbd_cache_copy(bvec, bvec->bv_offset + done,
+				       nbd_cache_get(cache,
+						     pos >> NBD_CACHE_SHIFT),
+				       off, n, false);
+			pos += n;
+			done += n;
+		}
+	}
+	cache->hits++;
+	spin_unlock_irq(&cache->lock);
+
+	dprintk(DBG_BLKDEV, "%s: request %p: served from cache\n",
+			lo->disk->disk_name, req);
+	req->errors = 0;
+	nbd_end_request(req);
+	return true;
+
+miss:
+	cache->misses++;
+	spin_unlock_irq(&cache->lock);
+	return false;
+}
+
+/*
+ * Put the blocks a successful read covered completely into the cache,
+ * unless a write or trim came by while it was in flight.
+ */
+static void nbd_cache_fill(struct nbd_device *lo, struct request *req)
+{
+	struct nbd_cache *cache = &to_nbd_priv(lo)->cache;
+	u64 pos = (u64)blk_rq_pos(req) << 9;
+	u64 first = ALIGN(pos, NBD_CACHE_BLOCK);
+	u64 end = (pos + blk_rq_bytes(req)) & ~(u64)(NBD_CACHE_BLOCK - 1);
+	struct nbd_cache_entry *e = NULL;
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+
+	spin_lock_irq(&cache->lock);
+	if ((u32)(unsigned long)req->special != cache->gen)
+		goto out;
+
+	rq_for_each_segment(bvec, req, iter) {
+		unsigned int done = 0, off, n;
+
+		while (done < bvec->bv_len) {
+			off = pos & (NBD_CACHE_BLOCK - 1);
+			n = min(bvec->bv_len - done, NBD_CACHE_BLOCK - off);
+			if (pos >= first && pos < end) {
+				/* pieces never straddle a block boundary */
+				if (!off)
+					e = nbd_cache_get(cache,
+						pos >> NBD_CACHE_SHIFT);
+				if (e)
+					nbd_cache_copy(bvec,
+						bvec->bv_offset + done,
+						e, off, n, true);
+			}
+			pos += n;
+			done += n;
+		}
+	}
+out:
+	spin_unlock_irq(&cache->lock);
+}
+
+/*
+ * Called for each request before it is queued.  Returns true if it was
+ * served from the cache.
+ */
+static bool nbd_cache_request(struct nbd_device *lo, struct request *req)
+{
+	struct nbd_cache *cache = &to_nbd_priv(lo)->cache;
+
+	if (!nbd_cache_on(lo) || req->cmd_type != REQ_TYPE_FS)
+		return false;
+	if (rq_data_dir(req) == READ)
+		return nbd_cache_read(lo, req);
+
+	if (!(req->cmd_flags & REQ_FLUSH)) {
+		spin_lock_irq(&cache->lock);
+		nbd_cache_invalidate(cache, (u64)blk_rq_pos(req) << 9,
+				     blk_rq_bytes(req));
+		spin_unlock_irq(&cache->lock);
+	}
+	return false;
+}
+
+/* Called by the receiver before a request is completed. */
+static void nbd_cache_complete(struct nbd_device *lo, struct request *req)
+{
+	struct nbd_cache *cache = &to_nbd_priv(lo)->cache;
+
+	if (!nbd_cache_on(lo) || req->cmd_type != REQ_TYPE_FS)
+		return;
+	if (rq_data_dir(req) == READ) {
+		if (!req->errors)
+			nbd_cache_fill(lo, req);
+	} else if (!(req->cmd_flags & REQ_FLUSH)) {
+		spin_lock_irq(&cache->lock);
+		nbd_cache_invalidate(cache, (u64)blk_rq_pos(req) << 9,
+				     blk_rq_bytes(req));
+		spin_unlock_irq(&cache->lock);
+	}
+}
+
+/*
+ * Stop using conn for new requests and forcibly shut its socket down,
+ * causing everybody blocked on it to error out.  The receiver of the
+ * connection then tears it down.
+ *
+ * FIXME: This code is duplicated from sys_shutdown, but
+ * there should be a more generic interface rather than
+ * calling socket ops directly here
+ */
+static void nbd_conn_fail(struct nbd_conn *conn)
+{
+	struct nbd_device *lo = conn->lo;
+	struct socket *sock = NULL;
+
+	/* the socket itself lives until the file is put */
+	spin_lock_irq(&lo->queue_lock);
+	if (!conn->dead)
+		sock = conn->sock;
+	conn->dead = true;
+	spin_unlock_irq(&lo->queue_lock);
+
+	if (sock) {
+		printk(KERN_WARNING "%s: shutting down socket %u\n",
+			lo->disk->disk_name, conn->index);
+		kernel_sock_shutdown(sock, SHUT_RDWR);
+	}
+	/* a sender may be waiting for a tag */
+	wake_up(&to_nbd_priv(lo)->tag_wq);
+}
+
+static void sock_shutdown(struct nbd_device *lo)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+	unsigned int i;
+
+	for (i = 0; i < p->nr_conns; i++)
+		nbd_conn_fail(&p->conns[i]);
+}
+
+/*
+ * Only SIGKILL may interrupt a transfer.  Senders and receivers block all
+ * other signals once when they start, rather than around every transfer.
+ */
+static void nbd_block_signals(sigset_t *oldset)
+{
+	sigset_t blocked;
+
+	siginitsetinv(&blocked, sigmask(SIGKILL));
+	sigprocmask(SIG_SETMASK, &blocked, oldset);
+}
+
+/* turn the result of one socket call into an error, or what was moved */
+static int sock_xmit_result(struct nbd_conn *conn, int result)
+{
+	if (signal_pending(current)) {
+		siginfo_t info;
+		printk(KERN_WARNING "nbd (pid %d: %s) got signal %d\n",
+			task_pid_nr(current), current->comm,
+			dequeue_signal_lock(current, &current->blocked, &info));
+		nbd_conn_fail(conn);
+		return -EINTR;
+	}
+	if (result == 0)
+		return -EPIPE; /* short read */
+	return result;
+}
+
+static struct socket *sock_get(struct nbd_conn *conn, int send)
+{
+	struct socket *sock = conn->sock;
 
 	if (unlikely(!sock)) {
 		printk(KERN_ERR "%s: Attempted %s on closed socket in sock_xmit\n",
-		       lo->disk->disk_name, (send ? "send" : "recv"));
+		       conn->lo->disk->disk_name, (send ? "send" : "recv"));
+		return NULL;
+	}
+	sock->sk->sk_allocation = GFP_NOIO;
+	return sock;
+}
+
+/* most buffers received with one recvmsg */
+#define NBD_RECV_SEGS		16
+
+/*
+ * Receive size bytes into the nr buffers of vec, with as few recvmsg
+ * calls as the socket allows.
+ */
+static int sock_recvv(struct nbd_conn *conn, const struct kvec *vec, int nr,
+		int size, int msg_flags)
+{
+	struct socket *sock = sock_get(conn, 0);
+	struct kvec iov[NBD_RECV_SEGS];
+	struct msghdr msg;
+	int result, done = 0, skip, i, n;
+
+	BUG_ON(nr > NBD_RECV_SEGS);
+	if (!sock)
 		return -EINVAL;
+
+	do {
+		/*
+		 * The socket consumes the kvecs it is given, so hand it a
+		 * fresh copy of whatever is still missing.
+		 */
+		skip = done;
+		for (i = n = 0; i < nr; i++) {
+			if (skip >= vec[i].iov_len) {
+				skip -= vec[i].iov_len;
+				continue;
+			}
+			iov[n].iov_base = vec[i].iov_base + skip;
+			iov[n].iov_len = vec[i].iov_len - skip;
+			skip = 0;
+			n++;
+		}
+
+		msg.msg_name = NULL;
+		msg.msg_namelen = 0;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		msg.msg_flags = msg_flags | MSG_NOSIGNAL;
+
+		result = kernel_recvmsg(sock, &msg, iov, n, size - done,
+					msg.msg_flags);
+		result = sock_xmit_result(conn, result);
+		if (result <= 0)
+			break;
+		done += result;
+	} while (done < size);
+
+	return result;
+}
+
+/*
+ *  Send or receive packet.  If page is set, size bytes at offset in it
+ *  are sent with sendpage instead of buf.
+ */
+static int __sock_xmit(struct nbd_conn *conn, int send, void *buf,
+		struct page *page, unsigned offset, int size, int msg_flags)
+{
+	struct socket *sock;
+	int result;
+	struct msghdr msg;
+	struct kvec iov;
+
+	if (!send) {
+		iov.iov_base = buf;
+		iov.iov_len = size;
+		return sock_recvv(conn, &iov, 1, size, msg_flags);
 	}
 
-	/* Allow interception of SIGKILL only
-	 * Don't allow other signals to interrupt the transmission */
-	siginitsetinv(&blocked, sigmask(SIGKILL));
-	sigprocmask(SIG_SETMASK, &blocked, &oldset);
+	sock = sock_get(conn, 1);
+	if (!sock)
+		return -EINVAL;
 
 	do {
-		sock->sk->sk_allocation = GFP_NOIO;
 		iov.iov_base = buf;
 		iov.iov_len = size;
 		msg.msg_name = NULL;
@@ -178,77 +540,96 @@ static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
 		msg.msg_controllen = 0;
 		msg.msg_flags = msg_flags | MSG_NOSIGNAL;
 
-		if (send) {
-			struct timer_list ti;
-
-			if (lo->xmit_timeout) {
-				init_timer(&ti);
-				ti.function = nbd_xmit_timeout;
-				ti.data = (unsigned long)current;
-				ti.expires = jiffies + lo->xmit_timeout;
-				add_timer(&ti);
-			}
+		if (page)
+			result = kernel_sendpage(sock, page, offset, size,
+						 msg.msg_flags);
+		else
 			result = kernel_sendmsg(sock, &msg, &iov, 1, size);
-			if (lo->xmit_timeout)
-				del_timer_sync(&ti);
-		} else
-			result = kernel_recvmsg(sock, &msg, &iov, 1, size,
-						msg.msg_flags);
-
-		if (signal_pending(current)) {
-			siginfo_t info;
-			printk(KERN_WARNING "nbd (pid %d: %s) got signal %d\n",
-				task_pid_nr(current), current->comm,
-				dequeue_signal_lock(current, &current->blocked, &info));
-			result = -EINTR;
-			sock_shutdown(lo, !send);
-			break;
-		}
-
-		if (result <= 0) {
-			if (result == 0)
-				result = -EPIPE; /* short read */
+		result = sock_xmit_result(conn, result);
+		if (result <= 0)
 			break;
-		}
 		size -= result;
 		buf += result;
+		offset += result;
 	} while (size > 0);
 
-	sigprocmask(SIG_SETMASK, &oldset, NULL);
-
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *lo, struct bio_vec *bvec,
+static inline int sock_xmit(struct nbd_conn *conn, int send, void *buf,
+		int size, int msg_flags)
+{
+	return __sock_xmit(conn, send, buf, NULL, 0, size, msg_flags);
+}
+
+/*
+ * Write payloads are sent straight from the bio pages: the socket takes
+ * its own page references, and the request is not completed before the
+ * reply shows that the server has all of the data, so the pages cannot
+ * be reused while TCP may still need them.  Slab pages must not be
+ * referenced that way (see _drbd_send_page()), so those are copied.
+ */
+static inline int sock_send_bvec(struct nbd_conn *conn, struct bio_vec *bvec,
 		int flags)
 {
 	int result;
-	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 1, kaddr + bvec->bv_offset, bvec->bv_len, flags);
+	void *kaddr;
+
+	if (likely(!PageSlab(bvec->bv_page) &&
+		   page_count(bvec->bv_page) >= 1))
+		return __sock_xmit(conn, 1, NULL, bvec->bv_page,
+				   bvec->bv_offset, bvec->bv_len, flags);
+
+	kaddr = kmap(bvec->bv_page);
+	result = sock_xmit(conn, 1, kaddr + bvec->bv_offset, bvec->bv_len,
+			flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *lo, struct request *req)
+/*
+ * always call with the tx_lock of conn held; more says that another
+ * request follows right away, so the tail of this one may be held back
+ * and go out in the same segment as the next
+ */
+static int nbd_send_req(struct nbd_conn *conn, struct request *req, bool more)
 {
+	struct nbd_device *lo = conn->lo;
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
+	u32 type = nbd_cmd(req);
+
+	if (req->cmd_flags & REQ_FUA)
+		type |= NBD_CMD_FLAG_FUA;
 
 	request.magic = htonl(NBD_REQUEST_MAGIC);
-	request.type = htonl(nbd_cmd(req));
-	request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
-	request.len = htonl(size);
-	memcpy(request.handle, &req, sizeof(req));
+	request.type = htonl(type);
+	if (nbd_cmd(req) == NBD_CMD_FLUSH) {
+		/* other values are reserved */
+		request.from = 0;
+		request.len = 0;
+	} else {
+		request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
+		request.len = htonl(size);
+	}
+	memset(request.handle, 0, sizeof(request.handle));
+	if (req->tag >= 0) {
+		struct nbd_handle handle = {
+			.tag = req->tag,
+			.cookie = to_nbd_priv(lo)->cookies[req->tag],
+		};
+
+		memcpy(request.handle, &handle, sizeof(handle));
+	}
 
 	dprintk(DBG_TX, "%s: request %p: sending control (%s@%llu,%uB)\n",
 			lo->disk->disk_name, req,
 			nbdcmd_to_ascii(nbd_cmd(req)),
 			(unsigned long long)blk_rq_pos(req) << 9,
 			blk_rq_bytes(req));
-	result = sock_xmit(lo, 1, &request, sizeof(request),
-			(nbd_cmd(req) == NBD_CMD_WRITE) ? MSG_MORE : 0);
+	result = sock_xmit(conn, 1, &request, sizeof(request),
+			(nbd_cmd(req) == NBD_CMD_WRITE || more) ? MSG_MORE : 0);
 	if (result <= 0) {
 		printk(KERN_ERR "%s: Send control failed (result %d)\n",
 				lo->disk->disk_name, result);
@@ -264,11 +645,11 @@ static int nbd_send_req(struct nbd_device *lo, struct request *req)
 		 */
 		rq_for_each_segment(bvec, req, iter) {
 			flags = 0;
-			if (!rq_iter_last(req, iter))
+			if (!rq_iter_last(req, iter) || more)
 				flags = MSG_MORE;
 			dprintk(DBG_TX, "%s: request %p: sending %d bytes data\n",
 					lo->disk->disk_name, req, bvec->bv_len);
-			result = sock_send_bvec(lo, bvec, flags);
+			result = sock_send_bvec(conn, bvec, flags);
 			if (result <= 0) {
 				printk(KERN_ERR "%s: Send data failed (result %d)\n",
 						lo->disk->disk_name, result);
@@ -282,80 +663,439 @@ error_out:
 	return -EIO;
 }
 
-static struct request *nbd_find_request(struct nbd_device *lo,
-					struct request *xreq)
+/*
+ * Pick the live connection with the fewest requests queued or in flight,
+ * starting after the last one picked so that equally loaded connections
+ * take turns.  Called with queue_lock held.
+ */
+static struct nbd_conn *nbd_pick_conn(struct nbd_device *lo)
 {
-	struct request *req, *tmp;
-	int err;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct nbd_conn *conn, *best = NULL;
+	unsigned int i;
 
-	err = wait_event_interruptible(lo->active_wq, lo->active_req != xreq);
-	if (unlikely(err))
-		goto out;
-
-	spin_lock(&lo->queue_lock);
-	list_for_each_entry_safe(req, tmp, &lo->queue_head, queuelist) {
-		if (req != xreq)
+	for (i = 0; i < p->nr_conns; i++) {
+		conn = &p->conns[(p->next_conn + i) % p->nr_conns];
+		if (conn->dead)
 			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&lo->queue_lock);
-		return req;
+		if (!best || conn->queued + conn->inflight <
+			     best->queued + best->inflight)
+			best = conn;
 	}
-	spin_unlock(&lo->queue_lock);
+	if (best)
+		p->next_conn = best->index + 1;
+	return best;
+}
 
-	err = -ENOENT;
+/*
+ * Hand req to the sender of a live connection.  If there is none left,
+ * hold on to it while a reconnect may still come, or else fail it.
+ */
+static void nbd_queue_req(struct nbd_device *lo, struct request *req)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct nbd_conn *conn;
+	bool parked = false;
+
+	spin_lock_irq(&lo->queue_lock);
+	conn = nbd_pick_conn(lo);
+	if (conn) {
+		list_add_tail(&req->queuelist, &conn->waiting_queue);
+		conn->queued++;
+	} else if (p->reconnect_timeout && !p->give_up) {
+		list_add_tail(&req->queuelist, &lo->waiting_queue);
+		parked = true;
+	}
+	spin_unlock_irq(&lo->queue_lock);
+
+	if (conn) {
+		wake_up(&conn->waiting_wq);
+	} else if (!parked) {
+		printk(KERN_ERR "%s: No connection left for request\n",
+			lo->disk->disk_name);
+		req->errors++;
+		nbd_end_request(req);
+	}
+}
 
+/*
+ * Put req into a free slot of the in-flight table and set req->tag.
+ * Returns false if all tags are in use.
+ */
+static bool nbd_tag_get(struct nbd_conn *conn, struct request *req)
+{
+	struct nbd_device *lo = conn->lo;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	unsigned int tag;
+
+	spin_lock_irq(&lo->queue_lock);
+	tag = find_first_zero_bit(p->tag_map, NBD_NR_TAGS);
+	if (tag < NBD_NR_TAGS) {
+		__set_bit(tag, p->tag_map);
+		p->tags[tag] = req;
+		/* cookie 0 is never used, a zeroed handle matches nothing */
+		if (!++p->next_cookie)
+			++p->next_cookie;
+		p->cookies[tag] = p->next_cookie;
+		p->tag_conn[tag] = conn->index;
+		p->deadline[tag] = jiffies + lo->xmit_timeout;
+		p->nr_inflight++;
+		conn->inflight++;
+		req->tag = tag;
+	}
+	spin_unlock_irq(&lo->queue_lock);
+
+	return tag < NBD_NR_TAGS;
+}
+
+static void __nbd_tag_put(struct nbd_priv *p, unsigned int tag)
+{
+	__clear_bit(tag, p->tag_map);
+	p->tags[tag] = NULL;
+	p->nr_inflight--;
+	p->conns[p->tag_conn[tag]].inflight--;
+	wake_up(&p->tag_wq);
+}
+
+/*
+ * Take the request in slot tag out of the table, if the slot is still in
+ * use with the given cookie.  Returns NULL if somebody else got there
+ * first.
+ */
+static struct request *nbd_tag_put(struct nbd_device *lo, unsigned int tag,
+				   u32 cookie)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct request *req = NULL;
+
+	if (tag >= NBD_NR_TAGS)
+		return NULL;
+
+	spin_lock_irq(&lo->queue_lock);
+	if (test_bit(tag, p->tag_map) && p->cookies[tag] == cookie) {
+		req = p->tags[tag];
+		__nbd_tag_put(p, tag);
+	}
+	spin_unlock_irq(&lo->queue_lock);
+
+	return req;
+}
+
+/*
+ * The request a reply on conn is for, or NULL.  It stays in the table, so
+ * only the receiver of conn may use it.
+ */
+static struct request *nbd_lookup_request(struct nbd_conn *conn,
+					  const char *handle)
+{
+	struct nbd_device *lo = conn->lo;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct request *xreq = NULL;
+	struct nbd_handle h;
+
+	memcpy(&h, handle, sizeof(h));
+	if (h.tag < NBD_NR_TAGS) {
+		spin_lock_irq(&lo->queue_lock);
+		if (test_bit(h.tag, p->tag_map) &&
+		    p->cookies[h.tag] == h.cookie &&
+		    p->tag_conn[h.tag] == conn->index)
+			xreq = p->tags[h.tag];
+		spin_unlock_irq(&lo->queue_lock);
+	}
+	return xreq;
+}
+
+/* as nbd_lookup_request(), but takes the request out of the table */
+static struct request *nbd_find_request(struct nbd_conn *conn,
+					const char *handle)
+{
+	struct nbd_handle h;
+
+	if (!nbd_lookup_request(conn, handle))
+		return ERR_PTR(-ENOENT);
+
+	memcpy(&h, handle, sizeof(h));
+	return nbd_tag_put(conn->lo, h.tag, h.cookie) ? : ERR_PTR(-ENOENT);
+}
+
+/*
+ * Receive len bytes of read payload, for offset bytes into the request,
+ * straight into its bio pages, with one recvmsg over up to NBD_RECV_SEGS
+ * segments at a time.  The limit keeps the number of pages kmapped at
+ * once, and the stack use, bounded.
+ */
+static int sock_recv_req(struct nbd_conn *conn, struct request *req,
+			 unsigned int offset, unsigned int len)
+{
+	struct kvec iov[NBD_RECV_SEGS];
+	struct page *pages[NBD_RECV_SEGS];
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	int nr = 0, size = 0, result = 0;
+
+	rq_for_each_segment(bvec, req, iter) {
+		unsigned int bv_offset = bvec->bv_offset;
+		unsigned int bv_len = bvec->bv_len;
+
+		if (offset >= bv_len) {
+			offset -= bv_len;
+			continue;
+		}
+		bv_offset += offset;
+		bv_len = min(bv_len - offset, len);
+		offset = 0;
+
+		pages[nr] = bvec->bv_page;
+		iov[nr].iov_base = kmap(bvec->bv_page) + bv_offset;
+		iov[nr].iov_len = bv_len;
+		size += bv_len;
+		len -= bv_len;
+		if (++nr < NBD_RECV_SEGS && len)
+			continue;
+
+		result = sock_recvv(conn, iov, nr, size, MSG_WAITALL);
+		dprintk(DBG_RX, "%s: request %p: got %d bytes data\n",
+			conn->lo->disk->disk_name, req, size);
+		while (nr)
+			kunmap(pages[--nr]);
+		size = 0;
+		if (result <= 0 || !len)
+			goto out;
+	}
 out:
-	return ERR_PTR(err);
+	return result;
 }
 
-static inline int sock_recv_bvec(struct nbd_device *lo, struct bio_vec *bvec)
+/* zero-fill len bytes of a read, offset bytes into the request */
+static void nbd_zero_req(struct request *req, unsigned int offset,
+			 unsigned int len)
 {
-	int result;
-	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 0, kaddr + bvec->bv_offset, bvec->bv_len,
-			MSG_WAITALL);
-	kunmap(bvec->bv_page);
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+
+	rq_for_each_segment(bvec, req, iter) {
+		unsigned int bv_len = bvec->bv_len;
+
+		if (offset >= bv_len) {
+			offset -= bv_len;
+			continue;
+		}
+		bv_len = min(bv_len - offset, len);
+		zero_user(bvec->bv_page, bvec->bv_offset + offset, bv_len);
+		offset = 0;
+		len -= bv_len;
+		if (!len)
+			return;
+	}
+}
+
+/* read and drop len bytes of a reply nobody needs */
+static int sock_skip(struct nbd_conn *conn, unsigned int len)
+{
+	char buf[64];
+	int result = 1;
+
+	while (len && result > 0) {
+		result = sock_xmit(conn, 0, buf, min_t(unsigned int, len,
+				sizeof(buf)), MSG_WAITALL);
+		len -= min_t(unsigned int, len, sizeof(buf));
+	}
 	return result;
 }
 
-/* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *lo)
+/*
+ * Handle one chunk of a structured reply whose header is in chunk.  The
+ * request stays in the table until its last chunk, which sets *reqp.
+ * Returns 0, or an error that takes the connection down.
+ */
+static int nbd_read_chunk(struct nbd_conn *conn,
+			  struct nbd_structured_reply *chunk,
+			  struct request **reqp)
 {
+	struct nbd_device *lo = conn->lo;
+	u16 flags = ntohs(chunk->flags);
+	u16 type = ntohs(chunk->type);
+	u32 length = ntohl(chunk->length);
+	struct request *req;
+	int result = 1;
+
+	*reqp = NULL;
+	req = nbd_lookup_request(conn, chunk->handle);
+	if (!req) {
+		printk(KERN_ERR "%s: Unexpected reply (%p)\n",
+				lo->disk->disk_name, chunk->handle);
+		return -EBADR;
+	}
+
+	switch (type) {
+	case NBD_REPLY_TYPE_NONE:
+		if (length || !(flags & NBD_REPLY_FLAG_DONE))
+			goto bad;
+		break;
+
+	case NBD_REPLY_TYPE_OFFSET_DATA:
+	case NBD_REPLY_TYPE_OFFSET_HOLE: {
+		struct {
+			__be64	offset;
+			__be32	hole_size;
+		} __attribute__ ((packed)) hdr;
+		u64 start = (u64)blk_rq_pos(req) << 9;
+		u64 offset;
+		u32 len;
+
+		if (nbd_cmd(req) != NBD_CMD_READ)
+			goto bad;
+		if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+			if (length <= sizeof(hdr.offset))
+				goto bad;
+			result = sock_xmit(conn, 0, &hdr, sizeof(hdr.offset),
+					   MSG_WAITALL);
+			len = length - sizeof(hdr.offset);
+		} else {
+			if (length != sizeof(hdr))
+				goto bad;
+			result = sock_xmit(conn, 0, &hdr, sizeof(hdr),
+					   MSG_WAITALL);
+			len = be32_to_cpu(hdr.hole_size);
+		}
+		if (result <= 0)
+			break;
+
+		offset = be64_to_cpu(hdr.offset);
+		if (!len || offset < start ||
+		    offset - start >= blk_rq_bytes(req) ||
+		    len > blk_rq_bytes(req) - (offset - start))
+			goto bad;
+
+		if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+			result = sock_recv_req(conn, req, offset - start, len);
+		} else {
+			dprintk(DBG_RX, "%s: request %p: %u bytes hole\n",
+				lo->disk->disk_name, req, len);
+			nbd_zero_req(req, offset - start, len);
+		}
+		break;
+	}
+
+	case NBD_REPLY_TYPE_ERROR:
+	case NBD_REPLY_TYPE_ERROR_OFFSET: {
+		__be32 error;
+
+		if (length < sizeof(error) + sizeof(__be16))
+			goto bad;
+		result = sock_xmit(conn, 0, &error, sizeof(error),
+				   MSG_WAITALL);
+		if (result <= 0)
+			break;
+		printk(KERN_ERR "%s: Other side returned error (%d)\n",
+				lo->disk->disk_name, ntohl(error));
+		req->errors++;
+		/* the message and the offset are of no use to us */
+		result = sock_skip(conn, length - sizeof(error));
+		break;
+	}
+
+	default:
+		goto bad;
+	}
+
+	if (result <= 0) {
+		printk(KERN_ERR "%s: Receive data failed (result %d)\n",
+				lo->disk->disk_name, result);
+		return result;
+	}
+
+	if (flags & NBD_REPLY_FLAG_DONE) {
+		req = nbd_find_request(conn, chunk->handle);
+		if (IS_ERR(req))
+			return PTR_ERR(req);
+		*reqp = req;
+	}
+	return 0;
+
+bad:
+	printk(KERN_ERR "%s: Malformed reply chunk (type %u, length %u)\n",
+			lo->disk->disk_name, type, length);
+	return -EPROTO;
+}
+
+/*
+ * A request taken back from the tag table goes to another connection, but
+ * not while its sender may still look at the old tag; like for
+ * nbd_complete_req(), the sender does it then.
+ */
+static void nbd_retry_req(struct nbd_conn *conn, struct request *req)
+{
+	struct nbd_device *lo = conn->lo;
+
+	spin_lock_irq(&lo->queue_lock);
+	if (conn->active_req == req) {
+		conn->active_retry = true;
+		req = NULL;
+	}
+	spin_unlock_irq(&lo->queue_lock);
+
+	if (req)
+		nbd_queue_req(lo, req);
+}
+
+/* NULL returned = something went wrong, the connection goes down */
+static struct request *nbd_read_stat(struct nbd_conn *conn)
+{
+	struct nbd_device *lo = conn->lo;
 	int result;
-	struct nbd_reply reply;
+	union {
+		struct nbd_reply		simple;
+		struct nbd_structured_reply	chunk;
+	} r;
 	struct request *req;
 
-	reply.magic = 0;
-	result = sock_xmit(lo, 0, &reply, sizeof(reply), MSG_WAITALL);
+again:
+	/* the two kinds of header agree up to the handle */
+	r.simple.magic = 0;
+	result = sock_xmit(conn, 0, &r.simple, sizeof(r.simple), MSG_WAITALL);
 	if (result <= 0) {
 		printk(KERN_ERR "%s: Receive control failed (result %d)\n",
 				lo->disk->disk_name, result);
 		goto harderror;
 	}
 
-	if (ntohl(reply.magic) != NBD_REPLY_MAGIC) {
+	if (ntohl(r.simple.magic) == NBD_STRUCTURED_REPLY_MAGIC &&
+	    (to_nbd_priv(lo)->server_flags & NBD_FLAG_STRUCTURED_REPLY)) {
+		result = sock_xmit(conn, 0, &r.chunk.length,
+				   sizeof(r.chunk.length), MSG_WAITALL);
+		if (result > 0)
+			result = nbd_read_chunk(conn, &r.chunk, &req);
+		if (result < 0)
+			goto harderror;
+		if (!req)
+			goto again;
+		return req;
+	}
+
+	if (ntohl(r.simple.magic) != NBD_REPLY_MAGIC) {
 		printk(KERN_ERR "%s: Wrong magic (0x%lx)\n",
 				lo->disk->disk_name,
-				(unsigned long)ntohl(reply.magic));
+				(unsigned long)ntohl(r.simple.magic));
 		result = -EPROTO;
 		goto harderror;
 	}
 
-	req = nbd_find_request(lo, *(struct request **)reply.handle);
+	req = nbd_find_request(conn, r.simple.handle);
 	if (IS_ERR(req)) {
 		result = PTR_ERR(req);
 		if (result != -ENOENT)
 			goto harderror;
 
 		printk(KERN_ERR "%s: Unexpected reply (%p)\n",
-				lo->disk->disk_name, reply.handle);
+				lo->disk->disk_name, r.simple.handle);
 		result = -EBADR;
 		goto harderror;
 	}
 
-	if (ntohl(reply.error)) {
+	if (ntohl(r.simple.error)) {
 		printk(KERN_ERR "%s: Other side returned error (%d)\n",
-				lo->disk->disk_name, ntohl(reply.error));
+				lo->disk->disk_name, ntohl(r.simple.error));
 		req->errors++;
 		return req;
 	}
@@ -363,19 +1103,14 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 	dprintk(DBG_RX, "%s: request %p: got reply\n",
 			lo->disk->disk_name, req);
 	if (nbd_cmd(req) == NBD_CMD_READ) {
-		struct req_iterator iter;
-		struct bio_vec *bvec;
-
-		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(lo, bvec);
-			if (result <= 0) {
-				printk(KERN_ERR "%s: Receive data failed (result %d)\n",
-						lo->disk->disk_name, result);
-				req->errors++;
-				return req;
-			}
-			dprintk(DBG_RX, "%s: request %p: got %d bytes data\n",
-				lo->disk->disk_name, req, bvec->bv_len);
+		result = sock_recv_req(conn, req, 0, blk_rq_bytes(req));
+		if (result <= 0) {
+			printk(KERN_ERR "%s: Receive data failed (result %d)\n",
+					lo->disk->disk_name, result);
+			/* the read can be retried on another connection */
+			nbd_conn_fail(conn);
+			nbd_retry_req(conn, req);
+			goto harderror;
 		}
 	}
 	return req;
@@ -384,6 +1119,167 @@ harderror:
 	return NULL;
 }
 
+/*
+ * Called by the receiver of a connection once it has failed.  Requests
+ * sent or queued on it go back to the remaining connections.
+ */
+static void nbd_conn_down(struct nbd_conn *conn)
+{
+	struct nbd_device *lo = conn->lo;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct request *req, *tmp;
+	unsigned int tag;
+	LIST_HEAD(requeue);
+
+	nbd_conn_fail(conn);
+
+	/* wait for a send in progress to fail */
+	mutex_lock(&conn->tx_lock);
+	conn->sock = NULL;
+	mutex_unlock(&conn->tx_lock);
+
+	spin_lock_irq(&lo->queue_lock);
+	for_each_set_bit(tag, p->tag_map, NBD_NR_TAGS) {
+		if (p->tag_conn[tag] != conn->index)
+			continue;
+		req = p->tags[tag];
+		__nbd_tag_put(p, tag);
+		list_add_tail(&req->queuelist, &requeue);
+	}
+	list_splice_tail_init(&conn->waiting_queue, &requeue);
+	conn->queued = 0;
+	spin_unlock_irq(&lo->queue_lock);
+
+	list_for_each_entry_safe(req, tmp, &requeue, queuelist) {
+		list_del_init(&req->queuelist);
+		nbd_queue_req(lo, req);
+	}
+
+	/* only now may nbd_reconnect() put a new socket here */
+	mutex_lock(&conn->tx_lock);
+	conn->torn_down = true;
+	mutex_unlock(&conn->tx_lock);
+}
+
+/*
+ * The reply to a request can arrive before its sender has returned from
+ * sending it.  Rather than wait, leave the completion to the sender then.
+ */
+static void nbd_complete_req(struct nbd_conn *conn, struct request *req)
+{
+	struct nbd_device *lo = conn->lo;
+
+	spin_lock_irq(&lo->queue_lock);
+	if (conn->active_req == req) {
+		conn->active_done = true;
+		req = NULL;
+	}
+	spin_unlock_irq(&lo->queue_lock);
+
+	if (req)
+		nbd_end_request(req);
+}
+
+/*
+ * Stop waiting for reconnects and fail the requests held back meanwhile.
+ * The device goes down once the remaining receivers are gone.
+ */
+static void nbd_give_up(struct nbd_device *lo)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct request *req, *tmp;
+	LIST_HEAD(parked);
+
+	spin_lock_irq(&lo->queue_lock);
+	p->give_up = true;
+	list_splice_init(&lo->waiting_queue, &parked);
+	spin_unlock_irq(&lo->queue_lock);
+
+	list_for_each_entry_safe(req, tmp, &parked, queuelist) {
+		list_del_init(&req->queuelist);
+		req->errors++;
+		nbd_end_request(req);
+	}
+	wake_up(&p->recv_wq);
+}
+
+/*
+ * Drop a reference on nr_receivers.  When the last receiver is gone the
+ * reconnect window opens, or without reconnect mode the device is done.
+ */
+static void nbd_put_receiver(struct nbd_device *lo)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+
+	spin_lock_irq(&lo->queue_lock);
+	if (atomic_dec_and_test(&p->nr_receivers)) {
+		p->down_since = jiffies;
+		if (!p->reconnect_timeout)
+			p->give_up = true;
+	}
+	spin_unlock_irq(&lo->queue_lock);
+	wake_up(&p->recv_wq);
+}
+
+static int nbd_recv_thread(void *data)
+{
+	struct nbd_conn *conn = data;
+	struct request *req;
+
+	set_user_nice(current, -20);
+	nbd_block_signals(NULL);
+	while ((req = nbd_read_stat(conn)) != NULL) {
+		nbd_cache_complete(conn->lo, req);
+		nbd_complete_req(conn, req);
+	}
+
+	nbd_conn_down(conn);
+	nbd_put_receiver(conn->lo);
+	return 0;
+}
+
+/*
+ * Runs once a second while the device is up.  A connection with a request
+ * past its deadline is presumed hung and taken down, which sends its
+ * requests elsewhere.  If no connection has come back within the reconnect
+ * window, give up.
+ */
+static void nbd_timeout_work(struct work_struct *work)
+{
+	struct nbd_priv *p = container_of(to_delayed_work(work),
+					  struct nbd_priv, timeout_work);
+	struct nbd_device *lo = &p->lo;
+	unsigned long expired = 0;
+	unsigned int tag, i;
+	bool give_up;
+
+	BUILD_BUG_ON(NBD_MAX_CONNS > BITS_PER_LONG);
+
+	spin_lock_irq(&lo->queue_lock);
+	if (lo->xmit_timeout) {
+		for_each_set_bit(tag, p->tag_map, NBD_NR_TAGS)
+			if (time_after_eq(jiffies, p->deadline[tag]))
+				__set_bit(p->tag_conn[tag], &expired);
+	}
+	give_up = p->reconnect_timeout && !p->give_up &&
+		  !atomic_read(&p->nr_receivers) &&
+		  time_after_eq(jiffies, p->down_since + p->reconnect_timeout);
+	spin_unlock_irq(&lo->queue_lock);
+
+	for_each_set_bit(i, &expired, NBD_MAX_CONNS) {
+		printk(KERN_ERR "%s: Request timed out on connection %u\n",
+			lo->disk->disk_name, i);
+		nbd_conn_fail(&p->conns[i]);
+	}
+	if (give_up) {
+		printk(KERN_ERR "%s: No reconnect within %lu seconds\n",
+			lo->disk->disk_name, p->reconnect_timeout / HZ);
+		nbd_give_up(lo);
+	}
+
+	schedule_delayed_work(&p->timeout_work, HZ);
+}
+
 static ssize_t pid_show(struct device *dev,
 			struct device_attribute *attr, char *buf)
 {
@@ -398,9 +1294,206 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
+static ssize_t read_cache_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct nbd_device *lo = dev_to_disk(dev)->private_data;
+
+	return sprintf(buf, "%u\n", to_nbd_priv(lo)->cache.max);
+}
+
+/* resizing empties the cache */
+static ssize_t read_cache_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct nbd_device *lo = dev_to_disk(dev)->private_data;
+	struct nbd_cache *cache = &to_nbd_priv(lo)->cache;
+	struct hlist_head *hash = NULL, *old;
+	unsigned int bits = 0;
+	unsigned long max;
+
+	if (kstrtoul(buf, 0, &max) || max > NBD_CACHE_MAX)
+		return -EINVAL;
+	if (max) {
+		/* about two blocks per chain when full */
+		bits = max_t(int, ilog2(roundup_pow_of_two(max)) - 1, 1);
+		hash = vzalloc(sizeof(*hash) << bits);
+		if (!hash)
+			return -ENOMEM;
+	}
+
+	spin_lock_irq(&cache->lock);
+	nbd_cache_clear(cache);
+	old = cache->hash;
+	cache->hash = hash;
+	cache->hash_bits = bits;
+	cache->max = max;
+	spin_unlock_irq(&cache->lock);
+
+	vfree(old);
+	return count;
+}
+
+static ssize_t read_cache_stats_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct nbd_device *lo = dev_to_disk(dev)->private_data;
+	struct nbd_cache *cache = &to_nbd_priv(lo)->cache;
+
+	return sprintf(buf, "%u %lu %lu\n", cache->nr, cache->hits,
+		       cache->misses);
+}
+
+static struct device_attribute read_cache_attr =
+	__ATTR(read_cache, S_IRUGO | S_IWUSR, read_cache_show,
+	       read_cache_store);
+static struct device_attribute read_cache_stats_attr =
+	__ATTR(read_cache_stats, S_IRUGO, read_cache_stats_show, NULL);
+
+static struct attribute *nbd_attrs[] = {
+	&read_cache_attr.attr,
+	&read_cache_stats_attr.attr,
+	NULL,
+};
+
+static struct attribute_group nbd_attribute_group = {
+	.attrs = nbd_attrs,
+};
+
+static int nbd_thread(void *data);
+
+/*
+ * Start the receiver of conn, and its sender unless it still has one from
+ * before a reconnect.
+ */
+static int nbd_start_conn(struct nbd_conn *conn)
+{
+	struct nbd_device *lo = conn->lo;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct task_struct *thread;
+
+	if (!conn->sender) {
+		thread = kthread_create(nbd_thread, conn, "%s-%u",
+					lo->disk->disk_name, conn->index);
+		if (IS_ERR(thread))
+			return PTR_ERR(thread);
+		conn->sender = thread;
+		wake_up_process(thread);
+	}
+
+	atomic_inc(&p->nr_receivers);
+	thread = kthread_run(nbd_recv_thread, conn, "%s-%u-rx",
+			     lo->disk->disk_name, conn->index);
+	if (IS_ERR(thread)) {
+		nbd_put_receiver(lo);
+		return PTR_ERR(thread);
+	}
+	return 0;
+}
+
+/*
+ * Take a new socket on a running device in reconnect mode.  It replaces a
+ * connection that went down, or is added if all are up, and the requests
+ * held back while there was none go out on it.
+ */
+static int nbd_reconnect(struct nbd_device *lo, struct file *file)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+	struct nbd_conn *conn = NULL;
+	struct file *old_file = NULL;
+	struct request *req, *tmp;
+	LIST_HEAD(parked);
+	unsigned int i;
+	int ret;
+
+	/*
+	 * The receiver drops the socket once a connection failed, but the
+	 * slot is only free after it has requeued the requests of the old one.
+	 */
+	for (i = 0; i < p->nr_conns; i++) {
+		mutex_lock(&p->conns[i].tx_lock);
+		if (!p->conns[i].sock && p->conns[i].torn_down) {
+			conn = &p->conns[i];
+			break;
+		}
+		mutex_unlock(&p->conns[i].tx_lock);
+	}
+	if (!conn) {
+		if (p->nr_conns == NBD_MAX_CONNS)
+			return -EBUSY;
+		/* a new slot, not picked for requests before it is up */
+		conn = &p->conns[p->nr_conns];
+		mutex_lock(&conn->tx_lock);
+		conn->dead = true;
+		conn->torn_down = true;
+		spin_lock_irq(&lo->queue_lock);
+		p->nr_conns++;
+		spin_unlock_irq(&lo->queue_lock);
+	}
+
+	/* hold the device up while the connection is started */
+	conn->sock = SOCKET_I(file->f_path.dentry->d_inode);
+	spin_lock_irq(&lo->queue_lock);
+	if (p->give_up) {
+		spin_unlock_irq(&lo->queue_lock);
+		conn->sock = NULL;
+		mutex_unlock(&conn->tx_lock);
+		return -EBUSY;
+	}
+	atomic_inc(&p->nr_receivers);
+	conn->dead = false;
+	conn->torn_down = false;
+	list_splice_init(&lo->waiting_queue, &parked);
+	spin_unlock_irq(&lo->queue_lock);
+
+	ret = nbd_start_conn(conn);
+	if (ret) {
+		/* no receiver was started, the slot is free again */
+		nbd_conn_fail(conn);
+		conn->sock = NULL;
+		conn->torn_down = true;
+		spin_lock_irq(&lo->queue_lock);
+		list_splice_tail_init(&conn->waiting_queue, &parked);
+		conn->queued = 0;
+		spin_unlock_irq(&lo->queue_lock);
+	} else {
+		old_file = conn->file;
+		conn->file = file;
+		if (lo->file == old_file) {
+			lo->file = file;
+			lo->sock = conn->sock;
+		}
+		lo->harderror = 0;
+		printk(KERN_INFO "%s: connection %u is back\n",
+			lo->disk->disk_name, conn->index);
+	}
+	mutex_unlock(&conn->tx_lock);
+
+	list_for_each_entry_safe(req, tmp, &parked, queuelist) {
+		list_del_init(&req->queuelist);
+		nbd_queue_req(lo, req);
+	}
+	nbd_put_receiver(lo);
+
+	if (old_file)
+		fput(old_file);
+	return ret;
+}
+
+static bool nbd_stopped(struct nbd_priv *p)
+{
+	return p->give_up && !atomic_read(&p->nr_receivers);
+}
+
+/*
+ * Run the device until the last connection is gone and no reconnect is
+ * expected, or the caller is interrupted, which takes all connections down.
+ */
 static int nbd_do_it(struct nbd_device *lo)
 {
-	struct request *req;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	unsigned int i;
 	int ret;
 
 	BUG_ON(lo->magic != LO_MAGIC);
@@ -413,8 +1506,35 @@ static int nbd_do_it(struct nbd_device *lo)
 		return ret;
 	}
 
-	while ((req = nbd_read_stat(lo)) != NULL)
-		nbd_end_request(req);
+	lo->harderror = 0;
+	p->give_up = false;
+	atomic_set(&p->nr_receivers, 0);
+	for (i = 0; i < p->nr_conns; i++) {
+		ret = nbd_start_conn(&p->conns[i]);
+		if (ret)
+			break;
+	}
+	if (lo->xmit_timeout || p->reconnect_timeout)
+		schedule_delayed_work(&p->timeout_work, HZ);
+
+	if (ret)
+		lo->harderror = ret;
+	if (ret || wait_event_interruptible(p->recv_wq, nbd_stopped(p))) {
+		if (!lo->harderror)
+			lo->harderror = -EINTR;
+		nbd_give_up(lo);
+		sock_shutdown(lo);
+		wait_event(p->recv_wq, nbd_stopped(p));
+	}
+	cancel_delayed_work_sync(&p->timeout_work);
+
+	for (i = 0; i < p->nr_conns; i++) {
+		struct nbd_conn *conn = &p->conns[i];
+
+		if (conn->sender)
+			kthread_stop(conn->sender);
+		conn->sender = NULL;
+	}
 
 	sysfs_remove_file(&disk_to_dev(lo->disk)->kobj, &pid_attr.attr);
 	lo->pid = 0;
@@ -423,39 +1543,95 @@ static int nbd_do_it(struct nbd_device *lo)
 
 static void nbd_clear_que(struct nbd_device *lo)
 {
+	struct nbd_priv *p = to_nbd_priv(lo);
 	struct request *req;
+	unsigned int i, tag;
 
 	BUG_ON(lo->magic != LO_MAGIC);
 
 	/*
-	 * Because we have set lo->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
+	 * Because we have set lo->sock to NULL and no sender or receiver
+	 * is running, all modifications to the table and the queues must
+	 * have completed by now.  For the same reason, no request can be
+	 * in the middle of being sent.
 	 *
 	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
+	 * purging them here.
 	 */
 	BUG_ON(lo->sock);
-	BUG_ON(lo->active_req);
 
-	while (!list_empty(&lo->queue_head)) {
-		req = list_entry(lo->queue_head.next, struct request,
+	for_each_set_bit(tag, p->tag_map, NBD_NR_TAGS) {
+		req = p->tags[tag];
+		__nbd_tag_put(p, tag);
+		req->errors++;
+		nbd_end_request(req);
+	}
+
+	while (!list_empty(&lo->waiting_queue)) {
+		req = list_entry(lo->waiting_queue.next, struct request,
 				 queuelist);
 		list_del_init(&req->queuelist);
 		req->errors++;
 		nbd_end_request(req);
 	}
+
+	for (i = 0; i < p->nr_conns; i++) {
+		struct nbd_conn *conn = &p->conns[i];
+
+		BUG_ON(conn->active_req);
+		while (!list_empty(&conn->waiting_queue)) {
+			req = list_entry(conn->waiting_queue.next,
+					 struct request, queuelist);
+			list_del_init(&req->queuelist);
+			req->errors++;
+			nbd_end_request(req);
+		}
+		conn->queued = 0;
+	}
 }
 
+/*
+ * Drop all connections of a device that is not running.
+ */
+static void nbd_put_conns(struct nbd_device *lo)
+{
+	struct nbd_priv *p = to_nbd_priv(lo);
+	unsigned int i, nr_conns = p->nr_conns;
+
+	spin_lock_irq(&lo->queue_lock);
+	p->nr_conns = 0;
+	spin_unlock_irq(&lo->queue_lock);
+
+	for (i = 0; i < nr_conns; i++) {
+		struct nbd_conn *conn = &p->conns[i];
+
+		if (conn->file)
+			fput(conn->file);
+		conn->file = NULL;
+		conn->sock = NULL;
+		conn->dead = false;
+		conn->torn_down = false;
+	}
+}
 
-static void nbd_handle_req(struct nbd_device *lo, struct request *req)
+static void nbd_handle_req(struct nbd_conn *conn, struct request *req,
+			   bool more)
 {
+	struct nbd_device *lo = conn->lo;
+	struct nbd_priv *p = to_nbd_priv(lo);
+	bool requeue = false, lost, done, retry;
+	u32 cookie;
+	int ret;
+
 	if (req->cmd_type != REQ_TYPE_FS)
 		goto error_out;
 
 	nbd_cmd(req) = NBD_CMD_READ;
 	if (rq_data_dir(req) == WRITE) {
-		nbd_cmd(req) = NBD_CMD_WRITE;
+		if (req->cmd_flags & REQ_DISCARD)
+			nbd_cmd(req) = NBD_CMD_TRIM;
+		else
+			nbd_cmd(req) = NBD_CMD_WRITE;
 		if (lo->flags & NBD_READ_ONLY) {
 			printk(KERN_ERR "%s: Write on read-only\n",
 					lo->disk->disk_name);
@@ -463,33 +1639,78 @@ static void nbd_handle_req(struct nbd_device *lo, struct request *req)
 		}
 	}
 
+	/* the flush machinery only hands us empty flushes */
+	if (req->cmd_flags & REQ_FLUSH) {
+		BUG_ON(unlikely(blk_rq_sectors(req)));
+		nbd_cmd(req) = NBD_CMD_FLUSH;
+	}
+
 	req->errors = 0;
 
-	mutex_lock(&lo->tx_lock);
-	if (unlikely(!lo->sock)) {
-		mutex_unlock(&lo->tx_lock);
-		printk(KERN_ERR "%s: Attempted send on closed socket\n",
-		       lo->disk->disk_name);
-		goto error_out;
+	/*
+	 * The request goes into the in-flight table before it is sent, so
+	 * the reply can never overtake it.  If all tags are busy, wait for
+	 * a reply to free one.
+	 */
+	req->tag = -1;
+	wait_event(p->tag_wq, nbd_tag_get(conn, req) || conn->dead ||
+		   kthread_should_stop());
+	if (req->tag < 0) {
+		nbd_queue_req(lo, req);
+		return;
+	}
+	cookie = p->cookies[req->tag];
+
+	mutex_lock(&conn->tx_lock);
+	if (unlikely(!conn->sock)) {
+		/* the connection went down, unless it took the request along */
+		mutex_unlock(&conn->tx_lock);
+		if (nbd_tag_put(lo, req->tag, cookie))
+			nbd_queue_req(lo, req);
+		return;
 	}
 
-	lo->active_req = req;
+	/*
+	 * The connection may have gone down and been replaced while we
+	 * waited for tx_lock, taking the request along.
+	 */
+	spin_lock_irq(&lo->queue_lock);
+	lost = !test_bit(req->tag, p->tag_map) ||
+	       p->cookies[req->tag] != cookie;
+	if (!lost)
+		conn->active_req = req;
+	spin_unlock_irq(&lo->queue_lock);
+	if (unlikely(lost)) {
+		mutex_unlock(&conn->tx_lock);
+		return;
+	}
+
+	ret = nbd_send_req(conn, req, more);
 
-	if (nbd_send_req(lo, req) != 0) {
+	spin_lock_irq(&lo->queue_lock);
+	conn->active_req = NULL;
+	done = conn->active_done;
+	conn->active_done = false;
+	retry = conn->active_retry;
+	conn->active_retry = false;
+	spin_unlock_irq(&lo->queue_lock);
+
+	if (ret) {
 		printk(KERN_ERR "%s: Request send failed\n",
 				lo->disk->disk_name);
-		req->errors++;
-		nbd_end_request(req);
-	} else {
-		spin_lock(&lo->queue_lock);
-		list_add(&req->queuelist, &lo->queue_head);
-		spin_unlock(&lo->queue_lock);
+		/*
+		 * Retry on another connection, unless a reply has already
+		 * claimed the request.
+		 */
+		nbd_conn_fail(conn);
+		requeue = nbd_tag_put(lo, req->tag, cookie) != NULL;
 	}
+	mutex_unlock(&conn->tx_lock);
 
-	lo->active_req = NULL;
-	mutex_unlock(&lo->tx_lock);
-	wake_up_all(&lo->active_wq);
-
+	if (requeue || retry)
+		nbd_queue_req(lo, req);
+	else if (done)
+		nbd_end_request(req);
 	return;
 
 error_out:
@@ -497,30 +1718,43 @@ error_out:
 	nbd_end_request(req);
 }
 
+/*
+ * Sends never wait for replies: requests are taken off the queue in
+ * batches and sent back to back, with MSG_MORE on all but the last one
+ * so that small requests share segments.
+ */
 static int nbd_thread(void *data)
 {
-	struct nbd_device *lo = data;
+	struct nbd_conn *conn = data;
+	struct nbd_device *lo = conn->lo;
 	struct request *req;
+	LIST_HEAD(batch);
 
 	set_user_nice(current, -20);
-	while (!kthread_should_stop() || !list_empty(&lo->waiting_queue)) {
+	nbd_block_signals(NULL);
+	while (!kthread_should_stop() || !list_empty(&conn->waiting_queue)) {
 		/* wait for something to do */
-		wait_event_interruptible(lo->waiting_wq,
+		wait_event_interruptible(conn->waiting_wq,
 					 kthread_should_stop() ||
-					 !list_empty(&lo->waiting_queue));
+					 !list_empty(&conn->waiting_queue));
 
-		/* extract request */
-		if (list_empty(&lo->waiting_queue))
+		/* extract requests */
+		if (list_empty(&conn->waiting_queue))
 			continue;
 
 		spin_lock_irq(&lo->queue_lock);
-		req = list_entry(lo->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
+		list_splice_tail_init(&conn->waiting_queue, &batch);
+		conn->queued = 0;
 		spin_unlock_irq(&lo->queue_lock);
 
-		/* handle request */
-		nbd_handle_req(lo, req);
+		/* handle requests */
+		while (!list_empty(&batch)) {
+			req = list_entry(batch.next, struct request,
+					 queuelist);
+			list_del_init(&req->queuelist);
+			nbd_handle_req(conn, req, !list_empty(&batch) ||
+				       !list_empty(&conn->waiting_queue));
+		}
 	}
 	return 0;
 }
@@ -557,24 +1791,59 @@ static void do_nbd_request(struct request_queue *q)
 			continue;
 		}
 
-		spin_lock_irq(&lo->queue_lock);
-		list_add_tail(&req->queuelist, &lo->waiting_queue);
-		spin_unlock_irq(&lo->queue_lock);
-
-		wake_up(&lo->waiting_wq);
+		if (!nbd_cache_request(lo, req))
+			nbd_queue_req(lo, req);
 
 		spin_lock_irq(q->queue_lock);
 	}
 }
 
+/*
+ * Advertise a write cache and discard to the block layer only if the
+ * server takes the matching commands.
+ */
+static void nbd_config_queue(struct nbd_device *lo, struct block_device *bdev)
+{
+	struct request_queue *q = lo->disk->queue;
+	u32 flags = to_nbd_priv(lo)->server_flags;
+	unsigned int flush = 0;
+
+	if (!(flags & NBD_FLAG_HAS_FLAGS))
+		flags = 0;
+
+	if (flags & NBD_FLAG_SEND_FLUSH) {
+		flush = REQ_FLUSH;
+		if (flags & NBD_FLAG_SEND_FUA)
+			flush |= REQ_FUA;
+	}
+	blk_queue_flush(q, flush);
+
+	if (flags & NBD_FLAG_SEND_TRIM) {
+		q->limits.discard_granularity = lo->blksize;
+		q->limits.max_discard_sectors = UINT_MAX;
+		q->limits.discard_zeroes_data = 0;
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+	} else {
+		q->limits.max_discard_sectors = 0;
+		queue_flag_clear_unlocked(QUEUE_FLAG_DISCARD, q);
+	}
+
+	if (flags & NBD_FLAG_READ_ONLY)
+		set_device_ro(bdev, true);
+}
+
 /* Must be called with tx_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		       unsigned int cmd, unsigned long arg)
 {
+	struct nbd_priv *p = to_nbd_priv(lo);
+
 	switch (cmd) {
 	case NBD_DISCONNECT: {
 		struct request sreq;
+		sigset_t oldset;
+		unsigned int i;
 
 	        printk(KERN_INFO "%s: NBD_DISCONNECT\n", lo->disk->disk_name);
 
@@ -583,33 +1852,66 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		nbd_cmd(&sreq) = NBD_CMD_DISC;
 		if (!lo->sock)
 			return -EINVAL;
-		nbd_send_req(lo, &sreq);
+		/* the server hangs up on us, which is no reason to wait */
+		if (lo->pid)
+			nbd_give_up(lo);
+		nbd_block_signals(&oldset);
+		for (i = 0; i < p->nr_conns; i++) {
+			struct nbd_conn *conn = &p->conns[i];
+
+			mutex_lock(&conn->tx_lock);
+			if (conn->sock)
+				nbd_send_req(conn, &sreq, false);
+			mutex_unlock(&conn->tx_lock);
+		}
+		sigprocmask(SIG_SETMASK, &oldset, NULL);
                 return 0;
 	}
- 
-	case NBD_CLEAR_SOCK: {
-		struct file *file;
 
+	case NBD_CLEAR_SOCK:
+		/* a running device is torn down by NBD_DO_IT */
+		if (lo->pid) {
+			nbd_give_up(lo);
+			sock_shutdown(lo);
+			return 0;
+		}
 		lo->sock = NULL;
-		file = lo->file;
 		lo->file = NULL;
 		nbd_clear_que(lo);
-		BUG_ON(!list_empty(&lo->queue_head));
-		if (file)
-			fput(file);
+		BUG_ON(p->nr_inflight);
+		nbd_put_conns(lo);
 		return 0;
-	}
 
 	case NBD_SET_SOCK: {
 		struct file *file;
-		if (lo->file)
+		if (lo->pid ? !p->reconnect_timeout :
+			      p->nr_conns == NBD_MAX_CONNS)
 			return -EBUSY;
 		file = fget(arg);
 		if (file) {
 			struct inode *inode = file->f_path.dentry->d_inode;
+			if (S_ISSOCK(inode->i_mode) && lo->pid) {
+				int error = nbd_reconnect(lo, file);
+
+				if (error)
+					fput(file);
+				return error;
+			}
 			if (S_ISSOCK(inode->i_mode)) {
-				lo->file = file;
-				lo->sock = SOCKET_I(inode);
+				struct nbd_conn *conn = &p->conns[p->nr_conns];
+
+				conn->file = file;
+				conn->sock = SOCKET_I(inode);
+				conn->dead = false;
+				conn->torn_down = false;
+				spin_lock_irq(&lo->queue_lock);
+				p->nr_conns++;
+				spin_unlock_irq(&lo->queue_lock);
+				/* the first socket stands for the device */
+				if (!lo->file) {
+					lo->file = file;
+					lo->sock = conn->sock;
+				}
 				if (max_part > 0)
 					bdev->bd_invalidated = 1;
 				return 0;
@@ -639,6 +1941,18 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		lo->xmit_timeout = arg * HZ;
 		return 0;
 
+	case NBD_SET_FLAGS:
+		if (lo->pid)
+			return -EBUSY;
+		p->server_flags = arg;
+		return 0;
+
+	case NBD_SET_RECONNECT:
+		if (lo->pid)
+			return -EBUSY;
+		p->reconnect_timeout = arg * HZ;
+		return 0;
+
 	case NBD_SET_SIZE_BLOCKS:
 		lo->bytesize = ((u64) arg) * lo->blksize;
 		bdev->bd_inode->i_size = lo->bytesize;
@@ -647,36 +1961,38 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct file *file;
 		int error;
 
 		if (lo->pid)
 			return -EBUSY;
 		if (!lo->file)
 			return -EINVAL;
+		/* see NBD_MAX_CONNS */
+		if (p->nr_conns > 1 &&
+		    (p->server_flags & NBD_FLAG_HAS_FLAGS) &&
+		    !(p->server_flags & NBD_FLAG_CAN_MULTI_CONN))
+			return -EINVAL;
 
+		nbd_config_queue(lo, bdev);
 		mutex_unlock(&lo->tx_lock);
-
-		thread = kthread_create(nbd_thread, lo, lo->disk->disk_name);
-		if (IS_ERR(thread)) {
-			mutex_lock(&lo->tx_lock);
-			return PTR_ERR(thread);
-		}
-		wake_up_process(thread);
 		error = nbd_do_it(lo);
-		kthread_stop(thread);
-
 		mutex_lock(&lo->tx_lock);
 		if (error)
 			return error;
-		sock_shutdown(lo, 0);
-		file = lo->file;
+		sock_shutdown(lo);
+		lo->sock = NULL;
 		lo->file = NULL;
 		nbd_clear_que(lo);
+		nbd_put_conns(lo);
+		if ((p->server_flags & NBD_FLAG_HAS_FLAGS) &&
+		    (p->server_flags & NBD_FLAG_READ_ONLY))
+			set_device_ro(bdev, false);
+		p->server_flags = 0;
+		nbd_config_queue(lo, bdev);
+		spin_lock_irq(&p->cache.lock);
+		nbd_cache_clear(&p->cache);
+		spin_unlock_irq(&p->cache.lock);
 		printk(KERN_WARNING "%s: queue cleared\n", lo->disk->disk_name);
-		if (file)
-			fput(file);
 		lo->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
 		set_capacity(lo->disk, 0);
@@ -690,14 +2006,12 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		 * This is for compatibility only.  The queue is always cleared
 		 * by NBD_DO_IT or NBD_CLEAR_SOCK.
 		 */
-		BUG_ON(!lo->sock && !list_empty(&lo->queue_head));
+		BUG_ON(!lo->sock && p->nr_inflight);
 		return 0;
 
 	case NBD_PRINT_DEBUG:
-		printk(KERN_INFO "%s: next = %p, prev = %p, head = %p\n",
-			bdev->bd_disk->disk_name,
-			lo->queue_head.next, lo->queue_head.prev,
-			&lo->queue_head);
+		printk(KERN_INFO "%s: %u requests in flight on %u connections\n",
+			bdev->bd_disk->disk_name, p->nr_inflight, p->nr_conns);
 		return 0;
 	}
 	return -ENOTTY;
@@ -739,10 +2053,13 @@ static const struct block_device_operations nbd_fops =
 static int __init nbd_init(void)
 {
 	int err = -ENOMEM;
-	int i;
+	int i, j;
 	int part_shift;
 
 	BUILD_BUG_ON(sizeof(struct nbd_request) != 28);
+	BUILD_BUG_ON(sizeof(struct nbd_structured_reply) != 20);
+	BUILD_BUG_ON(sizeof(struct nbd_handle) !=
+		     sizeof(((struct nbd_request *)0)->handle));
 
 	if (max_part < 0) {
 		printk(KERN_CRIT "nbd: max_part must be >= 0\n");
@@ -778,7 +2095,7 @@ static int __init nbd_init(void)
 		struct gendisk *disk = alloc_disk(1 << part_shift);
 		if (!disk)
 			goto out;
-		nbd_dev[i].disk = disk;
+		nbd_dev[i].lo.disk = disk;
 		/*
 		 * The new linux 2.5 block layer implementation requires
 		 * every gendisk to have its very own request_queue struct.
@@ -804,32 +2121,50 @@ static int __init nbd_init(void)
 	dprintk(DBG_INIT, "nbd: debugflags=0x%x\n", debugflags);
 
 	for (i = 0; i < nbds_max; i++) {
-		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].file = NULL;
-		nbd_dev[i].magic = LO_MAGIC;
-		nbd_dev[i].flags = 0;
-		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
-		spin_lock_init(&nbd_dev[i].queue_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		mutex_init(&nbd_dev[i].tx_lock);
-		init_waitqueue_head(&nbd_dev[i].active_wq);
-		init_waitqueue_head(&nbd_dev[i].waiting_wq);
-		nbd_dev[i].blksize = 1024;
-		nbd_dev[i].bytesize = 0;
+		struct gendisk *disk = nbd_dev[i].lo.disk;
+		nbd_dev[i].lo.file = NULL;
+		nbd_dev[i].lo.magic = LO_MAGIC;
+		nbd_dev[i].lo.flags = 0;
+		INIT_LIST_HEAD(&nbd_dev[i].lo.waiting_queue);
+		spin_lock_init(&nbd_dev[i].lo.queue_lock);
+		INIT_LIST_HEAD(&nbd_dev[i].lo.queue_head);
+		mutex_init(&nbd_dev[i].lo.tx_lock);
+		init_waitqueue_head(&nbd_dev[i].lo.active_wq);
+		init_waitqueue_head(&nbd_dev[i].lo.waiting_wq);
+		init_waitqueue_head(&nbd_dev[i].tag_wq);
+		init_waitqueue_head(&nbd_dev[i].recv_wq);
+		INIT_DELAYED_WORK(&nbd_dev[i].timeout_work, nbd_timeout_work);
+		spin_lock_init(&nbd_dev[i].cache.lock);
+		INIT_LIST_HEAD(&nbd_dev[i].cache.lru);
+		for (j = 0; j < NBD_MAX_CONNS; j++) {
+			struct nbd_conn *conn = &nbd_dev[i].conns[j];
+
+			conn->lo = &nbd_dev[i].lo;
+			conn->index = j;
+			mutex_init(&conn->tx_lock);
+			INIT_LIST_HEAD(&conn->waiting_queue);
+			init_waitqueue_head(&conn->waiting_wq);
+		}
+		nbd_dev[i].lo.blksize = 1024;
+		nbd_dev[i].lo.bytesize = 0;
 		disk->major = NBD_MAJOR;
 		disk->first_minor = i << part_shift;
 		disk->fops = &nbd_fops;
-		disk->private_data = &nbd_dev[i];
+		disk->private_data = &nbd_dev[i].lo;
 		sprintf(disk->disk_name, "nbd%d", i);
 		set_capacity(disk, 0);
 		add_disk(disk);
+		if (sysfs_create_group(&disk_to_dev(disk)->kobj,
+				       &nbd_attribute_group))
+			printk(KERN_WARNING "%s: no read cache attributes\n",
+				disk->disk_name);
 	}
 
 	return 0;
 out:
 	while (i--) {
-		blk_cleanup_queue(nbd_dev[i].disk->queue);
-		put_disk(nbd_dev[i].disk);
+		blk_cleanup_queue(nbd_dev[i].lo.disk->queue);
+		put_disk(nbd_dev[i].lo.disk);
 	}
 	kfree(nbd_dev);
 	return err;
@@ -839,9 +2174,13 @@ static void __exit nbd_cleanup(void)
 {
 	int i;
 	for (i = 0; i < nbds_max; i++) {
-		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].magic = 0;
+		struct gendisk *disk = nbd_dev[i].lo.disk;
+		nbd_dev[i].lo.magic = 0;
 		if (disk) {
+			sysfs_remove_group(&disk_to_dev(disk)->kobj,
+					   &nbd_attribute_group);
+			nbd_cache_clear(&nbd_dev[i].cache);
+			vfree(nbd_dev[i].cache.hash);
 			del_gendisk(disk);
 			blk_cleanup_queue(disk->queue);
 			put_disk(disk);
@@ -0,0 +1,217 @@
+/*
+ * nbd.h - connections, in-flight tags and the read cache of nbd.c
+ *
+ * Locking, for what struct nbd_priv adds to struct nbd_device:
+ *  - lo->queue_lock, the request queue's lock, covers the tag table, the
+ *    reconnect state, nr_conns, and the queues and counters of each
+ *    connection, including the handoff between its sender and receiver.
+ *  - a connection's tx_lock serializes the sends on its socket and
+ *    guards the socket itself.
+ *  - lo->tx_lock, held across the ioctls, covers server_flags and the
+ *    sockets added before NBD_DO_IT.
+ *  - the read cache has a spinlock of its own.
+ */
+
+#ifndef _DRIVERS_BLOCK_NBD_H
+#define _DRIVERS_BLOCK_NBD_H
+
+#include <linux/nbd.h>
+#include <linux/bitops.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+/*
+ * NBD_SET_FLAGS hands the driver the transmission flags the server sent
+ * in the handshake, which tell what it may send besides reads and writes.
+ * The bits are fixed by the NBD protocol; the #ifndefs leave them to a
+ * <linux/nbd.h> that already knows them.
+ */
+#ifndef NBD_SET_FLAGS
+#define NBD_SET_FLAGS		_IO(0xab, 10)
+#endif
+
+#ifndef NBD_FLAG_HAS_FLAGS
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)	/* flags are valid */
+#define NBD_FLAG_READ_ONLY	(1 << 1)	/* export is read-only */
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)	/* NBD_CMD_FLUSH supported */
+#define NBD_FLAG_SEND_FUA	(1 << 3)	/* NBD_CMD_FLAG_FUA supported */
+#define NBD_FLAG_SEND_TRIM	(1 << 5)	/* NBD_CMD_TRIM supported */
+#endif
+
+#ifndef NBD_FLAG_CAN_MULTI_CONN
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)	/* flush covers all connections */
+#endif
+
+#ifndef NBD_CMD_FLUSH
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_TRIM		4
+#endif
+
+/*
+ * Not a transmission flag: userspace adds this to the NBD_SET_FLAGS
+ * argument when the server agreed to NBD_OPT_STRUCTURED_REPLY during the
+ * handshake.  Replies may then come as a series of chunks, and reads of
+ * unallocated ranges as holes, which are zero-filled locally.
+ */
+#define NBD_FLAG_STRUCTURED_REPLY	(1 << 16)
+
+/*
+ * Not a transmission flag either: userspace promises that nothing but this
+ * device writes to the export, which is what makes the read cache below
+ * safe.  Without it the cache stays off, whatever its size.
+ */
+#define NBD_FLAG_SINGLE_WRITER		(1 << 17)
+
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668e33ef
+
+struct nbd_structured_reply {
+	__be32	magic;
+	__be16	flags;			/* NBD_REPLY_FLAG_* */
+	__be16	type;			/* NBD_REPLY_TYPE_* */
+	char	handle[8];
+	__be32	length;			/* of the payload that follows */
+} __attribute__ ((packed));
+
+#define NBD_REPLY_FLAG_DONE		(1 << 0)	/* last chunk */
+
+#define NBD_REPLY_TYPE_NONE		0
+#define NBD_REPLY_TYPE_OFFSET_DATA	1	/* __be64 offset, data */
+#define NBD_REPLY_TYPE_OFFSET_HOLE	2	/* __be64 offset, __be32 size */
+#define NBD_REPLY_TYPE_ERROR		((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET	((1 << 15) + 2)
+
+/* upper 16 bits of the request type carry per-command flags */
+#ifndef NBD_CMD_FLAG_FUA
+#define NBD_CMD_FLAG_FUA	(1 << 16)
+#endif
+
+/*
+ * Keep a running device up for arg seconds after its last connection went
+ * down (0, the default, tears it down right away).  Meanwhile requests are
+ * held back and NBD_SET_SOCK takes new sockets to the same server; the
+ * requests that were in flight on the lost connections are sent again.
+ * NBD_DISCONNECT and NBD_CLEAR_SOCK end the wait.
+ */
+#define NBD_SET_RECONNECT	_IO(0xab, 0x40)
+
+/*
+ * Client-side read cache of whole blocks, sized in blocks through the
+ * read_cache sysfs attribute (0, the default, turns it off).  Blocks are
+ * filled from completed reads, and dropped when a write or trim covering
+ * them is queued and again when it completes.  A read only fills the cache
+ * if no write or trim was queued or completed while it was in flight,
+ * which gen tracks.
+ */
+#define NBD_CACHE_SHIFT		12
+#define NBD_CACHE_BLOCK		(1 << NBD_CACHE_SHIFT)
+#define NBD_CACHE_MAX		(64 << 10)	/* blocks, 256M */
+
+struct nbd_cache_entry {
+	struct list_head	lru;
+	struct hlist_node	hash;
+	u64			block;
+	struct page		*page;		/* lowmem */
+};
+
+struct nbd_cache {
+	spinlock_t		lock;
+	unsigned int		max;		/* blocks */
+	unsigned int		nr;
+	struct list_head	lru;		/* most recently used first */
+	struct hlist_head	*hash;		/* 1 << hash_bits chains */
+	unsigned int		hash_bits;
+	u32			gen;
+	unsigned long		hits;
+	unsigned long		misses;
+};
+
+/*
+ * Requests on the wire are identified by a tag, their slot in the
+ * in-flight table, and a cookie that changes every time the slot is
+ * reused, so a late or bogus reply cannot complete the wrong request.
+ * Both travel in the opaque handle, which the server echoes back.
+ */
+struct nbd_handle {
+	u32	tag;
+	u32	cookie;
+};
+
+#define NBD_NR_TAGS		256
+
+/*
+ * A device may talk to its server over several sockets, each added with
+ * NBD_SET_SOCK before NBD_DO_IT.  Every connection has its own sender and
+ * receiver thread; new requests go to the live connection with the
+ * fewest requests queued or in flight.  A server that sent its flags must
+ * also set NBD_FLAG_CAN_MULTI_CONN for that, or a flush on one connection
+ * might not cover writes completed on another.
+ */
+#define NBD_MAX_CONNS		8
+
+struct nbd_conn {
+	struct nbd_device	*lo;
+	unsigned int		index;
+	struct socket		*sock;		/* NULL once torn down */
+	struct file		*file;
+	struct mutex		tx_lock;	/* serializes sends */
+	struct task_struct	*sender;
+	bool			torn_down;	/* under tx_lock: requeued, reusable */
+
+	/* protected by the device's queue_lock */
+	struct request		*active_req;	/* being sent */
+	bool			active_done;	/* its reply is in already */
+	bool			active_retry;	/* or its read data got lost */
+	struct list_head	waiting_queue;
+	unsigned int		queued;
+	unsigned int		inflight;
+	bool			dead;		/* takes no new requests */
+	wait_queue_head_t	waiting_wq;
+};
+
+struct nbd_priv {
+	struct nbd_device	lo;
+
+	u32			server_flags;	/* NBD_FLAG_* */
+
+	struct nbd_conn		conns[NBD_MAX_CONNS];
+	unsigned int		nr_conns;	/* changed under queue_lock */
+	unsigned int		next_conn;	/* round-robin among equals */
+	atomic_t		nr_receivers;
+	wait_queue_head_t	recv_wq;	/* a receiver exited */
+
+	/*
+	 * In-flight requests by tag, protected by queue_lock.  A slot is
+	 * owned by whoever clears its bit: the receiver on a matching
+	 * reply, the sender if the send fails, the teardown of the
+	 * connection it was sent on, or nbd_clear_que().
+	 */
+	unsigned long		tag_map[BITS_TO_LONGS(NBD_NR_TAGS)];
+	struct request		*tags[NBD_NR_TAGS];
+	u32			cookies[NBD_NR_TAGS];
+	u8			tag_conn[NBD_NR_TAGS];	/* sent on */
+	unsigned long		deadline[NBD_NR_TAGS];	/* if xmit_timeout */
+	u32			next_cookie;
+	unsigned int		nr_inflight;
+	wait_queue_head_t	tag_wq;		/* a tag was freed */
+
+	/*
+	 * Reconnect mode, protected by queue_lock.  While no connection is
+	 * up, requests wait on lo->waiting_queue.
+	 */
+	unsigned long		reconnect_timeout;	/* jiffies, 0 if off */
+	unsigned long		down_since;	/* last receiver exited */
+	bool			give_up;	/* stop once receivers are gone */
+
+	/* checks deadlines and the reconnect window while running */
+	struct delayed_work	timeout_work;
+
+	struct nbd_cache	cache;
+};
+
+static inline struct nbd_priv *to_nbd_priv(struct nbd_device *lo)
+{
+	return container_of(lo, struct nbd_priv, lo);
+}
+
+#endif /* _DRIVERS_BLOCK_NBD_H */